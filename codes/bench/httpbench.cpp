@@ -0,0 +1,239 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+/*
+ * http吞吐压测工具，用若干长连接反复请求同一个页面，统计每秒完成的请求数和平均时延
+ * 可以按比例混入登录POST，观察同步数据库验证对同一轮其它请求的影响
+ * 用法：HttpBench ip port path 连接数 秒数 [POST比例(0~1) 用户名 密码]
+ * 例如：HttpBench 127.0.0.1 1316 /index.html 256 10 0.05 root 123456
+ */
+
+struct Client
+{
+    int fd;
+    bool isConnecting; /* 非阻塞connect尚未完成，完成后才发出第一个请求 */
+    bool isPost;
+    std::string in;
+    std::chrono::steady_clock::time_point start;
+};
+
+static const char *g_ip = nullptr;
+static int g_port = 0;
+static std::string g_get;
+static std::string g_post;
+static double g_postRatio = 0;
+
+static uint64_t g_done = 0;
+static uint64_t g_posts = 0;
+static uint64_t g_errors = 0;
+static uint64_t g_reconnects = 0;
+static double g_latencyUs = 0;
+static double g_postLatencyUs = 0;
+
+/*
+ * 发起非阻塞连接，失败返回-1
+ */
+static int connectServer()
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_port);
+    inet_pton(AF_INET, g_ip, &addr.sin_addr);
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * 在连接上发出下一个请求，请求报文很短，一次写不完按出错处理
+ */
+static bool sendRequest(Client &c)
+{
+    c.isPost = g_postRatio > 0 && rand() < g_postRatio * RAND_MAX;
+    const std::string &req = c.isPost ? g_post : g_get;
+    c.in.clear();
+    c.start = std::chrono::steady_clock::now();
+    return send(c.fd, req.data(), req.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(req.size());
+}
+
+/*
+ * 读缓冲中已有完整的响应返回true，isKeepAlive返回服务器是否保持连接
+ */
+static bool isComplete(const std::string &in, bool &isKeepAlive)
+{
+    size_t end = in.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+        return false;
+    }
+    size_t conn = in.find("Connection: keep-alive");
+    isKeepAlive = conn != std::string::npos && conn < end;
+    size_t pos = in.find("Content-length: ");
+    if (pos == std::string::npos || pos > end)
+    {
+        return true;
+    }
+    size_t len = strtoul(in.data() + pos + strlen("Content-length: "), nullptr, 10);
+    return in.size() >= end + 4 + len;
+}
+
+/*
+ * 服务器不再保持连接(长连接请求数达到上限)或出错时重连，连接建立后再发出下一个请求
+ */
+static void reconnect(int epfd, Client &c)
+{
+    if (c.fd >= 0)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+    }
+    c.fd = connectServer();
+    g_reconnects++;
+    if (c.fd < 0)
+    {
+        g_errors++;
+        return;
+    }
+    c.isConnecting = true;
+    struct epoll_event ev = {0};
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+}
+
+/*
+ * 连接建立完成，改为等待响应并发出请求
+ */
+static void onConnected(int epfd, Client &c, uint32_t events)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0 || (events & (EPOLLERR | EPOLLHUP)))
+    {
+        g_errors++;
+        reconnect(epfd, c);
+        return;
+    }
+    c.isConnecting = false;
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+    if (sendRequest(c) == false)
+    {
+        g_errors++;
+        reconnect(epfd, c);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 6 && argc != 9)
+    {
+        fprintf(stderr, "usage: %s ip port path connections seconds [postRatio user password]\n", argv[0]);
+        return 1;
+    }
+    g_ip = argv[1];
+    g_port = atoi(argv[2]);
+    int connNum = atoi(argv[4]);
+    int seconds = atoi(argv[5]);
+    g_get = std::string("GET ") + argv[3] + " HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n";
+    if (argc == 9)
+    {
+        g_postRatio = atof(argv[6]);
+        std::string body = std::string("username=") + argv[7] + "&password=" + argv[8];
+        g_post = "POST /login HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n"
+                 "Content-Type: application/x-www-form-urlencoded\r\n"
+                 "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    }
+
+    int epfd = epoll_create1(0);
+    std::vector<Client> clients(connNum);
+    for (auto &c : clients)
+    {
+        c.fd = -1;
+        reconnect(epfd, c);
+    }
+    g_reconnects = 0;
+
+    auto begin = std::chrono::steady_clock::now();
+    auto deadline = begin + std::chrono::seconds(seconds);
+    std::vector<struct epoll_event> events(1024);
+    char buff[65536];
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+        int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), 100);
+        for (int i = 0; i < n; i++)
+        {
+            Client &c = *static_cast<Client *>(events[i].data.ptr);
+            if (c.isConnecting)
+            {
+                onConnected(epfd, c, events[i].events);
+                continue;
+            }
+            ssize_t len = 0;
+            while ((len = recv(c.fd, buff, sizeof(buff), 0)) > 0)
+            {
+                c.in.append(buff, len);
+            }
+            bool isKeepAlive = false;
+            if (isComplete(c.in, isKeepAlive))
+            {
+                double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - c.start).count();
+                g_done++;
+                g_latencyUs += us;
+                if (c.isPost)
+                {
+                    g_posts++;
+                    g_postLatencyUs += us;
+                }
+                if (len == 0 || isKeepAlive == false || sendRequest(c) == false)
+                {
+                    reconnect(epfd, c);
+                }
+            }
+            else if (len == 0 || (len < 0 && errno != EAGAIN))
+            {
+                if (c.in.empty() == false || len < 0)
+                {
+                    g_errors++;
+                }
+                reconnect(epfd, c);
+            }
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    uint64_t gets = g_done - g_posts;
+    printf("requests: %lu in %.2f s, %.0f req/s, errors: %lu, reconnects: %lu\n",
+           g_done, elapsed, g_done / elapsed, g_errors, g_reconnects);
+    printf("GET  avg latency: %.0f us (%lu)\n", gets ? (g_latencyUs - g_postLatencyUs) / gets : 0.0, gets);
+    if (g_posts > 0)
+    {
+        printf("POST avg latency: %.0f us (%lu)\n", g_postLatencyUs / g_posts, g_posts);
+    }
+    for (auto &c : clients)
+    {
+        close(c.fd);
+    }
+    close(epfd);
+    return 0;
+}
@@ -0,0 +1,233 @@
+#include <mpmcqueue.hpp>
+#include <blockqueue.hpp>
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * MpmcQueue的吞吐测试，生产者数为1/4/16，消费者数固定
+ * 每个生产者入队相同个数的元素，全部出队后统计每秒传递的元素数，分两种模式：
+ * 1. 逐个：push_back/pop，与BlockQueue对比
+ * 2. 批量：生产者每次push_n一批，消费者阻塞取到一个后再pop_n取走剩余，与完成队列的用法一致，
+ *    与改用MpmcQueue之前的完成队列(互斥锁保护的容器，批量插入批量取出)对比
+ * 用法：MpmcBench [每个生产者的元素数] [消费者数] [队列容量] [批量大小]
+ */
+
+static const long STOP_ = -1;              /* 生产者全部结束后，给每个消费者放一个结束标记 */
+static const size_t POP_BATCH_ = 256;      /* 消费者一次最多取出的个数，与主循环取完成队列一致 */
+
+/*
+ * 互斥锁保护的无界队列，批量插入，队列由空变非空时唤醒一个消费者
+ */
+class LockedQueue
+{
+public:
+    explicit LockedQueue(size_t) {}
+
+    void push_n(const long *items, size_t count)
+    {
+        bool isEmpty = false;
+        {
+            std::lock_guard<std::mutex> locker(mtx_);
+            isEmpty = deq_.empty();
+            deq_.insert(deq_.end(), items, items + count);
+        }
+        if (isEmpty)
+        {
+            cond_.notify_one();
+        }
+    }
+
+    bool pop(long &item)
+    {
+        std::unique_lock<std::mutex> locker(mtx_);
+        cond_.wait(locker, [this]()
+                   { return deq_.empty() == false; });
+        item = deq_.front();
+        deq_.pop_front();
+        /* 只在由空变非空时唤醒，取走一个后还有剩余要传给下一个消费者 */
+        if (deq_.empty() == false)
+        {
+            cond_.notify_one();
+        }
+        return true;
+    }
+
+    size_t pop_n(long *items, size_t maxCount)
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        size_t n = std::min(maxCount, deq_.size());
+        std::copy(deq_.begin(), deq_.begin() + n, items);
+        deq_.erase(deq_.begin(), deq_.begin() + n);
+        return n;
+    }
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    std::deque<long> deq_;
+};
+
+/*
+ * 运行一轮，返回每秒传递的元素数(百万)
+ */
+template <typename Queue>
+static double runOnce(int producers, int consumers, long perProducer, size_t capacity)
+{
+    Queue queue(capacity);
+    std::vector<long> sums(consumers, 0);
+    auto begin = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < consumers; c++)
+    {
+        threads.emplace_back([&queue, &sums, c]()
+                             {
+                                 long item = 0;
+                                 while (queue.pop(item) && item != STOP_)
+                                 {
+                                     sums[c] += item;
+                                 } });
+    }
+    std::vector<std::thread> producerThreads;
+    for (int p = 0; p < producers; p++)
+    {
+        producerThreads.emplace_back([&queue, perProducer]()
+                                     {
+                                         for (long i = 1; i <= perProducer; i++)
+                                         {
+                                             queue.push_back(i);
+                                         } });
+    }
+    for (auto &t : producerThreads)
+    {
+        t.join();
+    }
+    for (int c = 0; c < consumers; c++)
+    {
+        queue.push_back(STOP_);
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    long total = 0;
+    for (long sum : sums)
+    {
+        total += sum;
+    }
+    if (total != producers * (perProducer * (perProducer + 1) / 2))
+    {
+        fprintf(stderr, "checksum mismatch: %ld\n", total);
+        exit(1);
+    }
+    return producers * perProducer / sec / 1e6;
+}
+
+/*
+ * 批量模式运行一轮，返回每秒传递的元素数(百万)
+ * 一次取出的多个结束标记只留一个，其余放回给别的消费者
+ */
+template <typename Queue>
+static double runBatch(int producers, int consumers, long perProducer, size_t capacity, size_t batch)
+{
+    Queue queue(capacity);
+    std::vector<long> sums(consumers, 0);
+    auto begin = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < consumers; c++)
+    {
+        threads.emplace_back([&queue, &sums, c]()
+                             {
+                                 std::vector<long> items(POP_BATCH_);
+                                 bool isStop = false;
+                                 while (isStop == false && queue.pop(items[0]))
+                                 {
+                                     size_t n = 1 + queue.pop_n(items.data() + 1, POP_BATCH_ - 1);
+                                     for (size_t i = 0; i < n; i++)
+                                     {
+                                         if (items[i] != STOP_)
+                                         {
+                                             sums[c] += items[i];
+                                         }
+                                         else if (isStop)
+                                         {
+                                             queue.push_n(&STOP_, 1);
+                                         }
+                                         else
+                                         {
+                                             isStop = true;
+                                         }
+                                     }
+                                 } });
+    }
+    std::vector<std::thread> producerThreads;
+    for (int p = 0; p < producers; p++)
+    {
+        producerThreads.emplace_back([&queue, perProducer, batch]()
+                                     {
+                                         std::vector<long> items(batch);
+                                         for (long i = 1; i <= perProducer;)
+                                         {
+                                             size_t n = 0;
+                                             for (; n < batch && i <= perProducer; n++, i++)
+                                             {
+                                                 items[n] = i;
+                                             }
+                                             queue.push_n(items.data(), n);
+                                         } });
+    }
+    for (auto &t : producerThreads)
+    {
+        t.join();
+    }
+    for (int c = 0; c < consumers; c++)
+    {
+        queue.push_n(&STOP_, 1);
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    long total = 0;
+    for (long sum : sums)
+    {
+        total += sum;
+    }
+    if (total != producers * (perProducer * (perProducer + 1) / 2))
+    {
+        fprintf(stderr, "checksum mismatch: %ld\n", total);
+        exit(1);
+    }
+    return producers * perProducer / sec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    long perProducer = argc > 1 ? atol(argv[1]) : 1000000;
+    int consumers = argc > 2 ? atoi(argv[2]) : 4;
+    size_t capacity = argc > 3 ? static_cast<size_t>(atol(argv[3])) : 1024;
+    size_t batch = argc > 4 ? static_cast<size_t>(atol(argv[4])) : 32;
+    printf("items per producer: %ld, consumers: %d, capacity: %zu, batch: %zu\n", perProducer, consumers, capacity, batch);
+    printf("%-10s %16s %16s %16s %16s\n", "producers", "MpmcQueue Mops", "BlockQueue Mops",
+           "Mpmc batch Mops", "Locked batch Mops");
+    for (int producers : {1, 4, 16})
+    {
+        double mpmc = runOnce<MpmcQueue<long>>(producers, consumers, perProducer, capacity);
+        double block = runOnce<BlockQueue<long>>(producers, consumers, perProducer, capacity);
+        double mpmcBatch = runBatch<MpmcQueue<long>>(producers, consumers, perProducer, capacity, batch);
+        double lockedBatch = runBatch<LockedQueue>(producers, consumers, perProducer, capacity, batch);
+        printf("%-10d %16.2f %16.2f %16.2f %16.2f\n", producers, mpmc, block, mpmcBatch, lockedBatch);
+    }
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include <mpmcqueue.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+/*
+ * MpmcQueue压力测试，失败时返回非零
+ * 1. 小容量队列上用不同长度的push_n/pop_n反复绕圈，检查每个元素恰好收到一次，
+ *    且同一消费者看到的同一生产者的元素保持入队顺序
+ * 2. close()能唤醒阻塞在满队列上的生产者和空队列上的消费者
+ * 用法：MpmcStress [每个生产者的元素数]
+ */
+
+static const int PRODUCERS_ = 8;
+static const int CONSUMERS_ = 8;
+static const size_t CAPACITY_ = 64;  /* 小容量让批量操作频繁跨过环形缓冲的结尾 */
+static const size_t MAX_BATCH_ = 37; /* 与容量互质，批量的起点落在各个槽位上 */
+static const int WATCHDOG_S_ = 60;   /* 超过该时间没结束按死锁处理 */
+
+/* 元素编码：高16位为生产者编号，低位为该生产者内的序号 */
+static uint64_t encode(int producer, uint64_t seq)
+{
+    return (static_cast<uint64_t>(producer) << 48) | seq;
+}
+
+static std::atomic<bool> g_failed(false);
+
+static void fail(const char *msg)
+{
+    fprintf(stderr, "FAILED: %s\n", msg);
+    g_failed = true;
+}
+
+/*
+ * 批量绕圈测试
+ */
+static void wrapTest(uint64_t perProducer)
+{
+    MpmcQueue<uint64_t> queue(CAPACITY_);
+    std::vector<std::atomic<uint8_t>> seen(PRODUCERS_ * perProducer);
+    for (auto &s : seen)
+    {
+        s.store(0);
+    }
+    std::atomic<uint64_t> received(0);
+    uint64_t total = PRODUCERS_ * perProducer;
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < CONSUMERS_; c++)
+    {
+        threads.emplace_back([&, c]()
+                             {
+                                 std::vector<uint64_t> last(PRODUCERS_, 0);
+                                 std::vector<uint64_t> items(MAX_BATCH_);
+                                 unsigned int rnd = c + 1;
+                                 while (received.load() < total)
+                                 {
+                                     size_t want = rand_r(&rnd) % MAX_BATCH_ + 1;
+                                     size_t n = queue.pop_n(items.data(), want);
+                                     if (n == 0)
+                                     {
+                                         /* 没有可读元素时阻塞等待一个，关闭后退出 */
+                                         if (queue.pop(items[0], 1) == false)
+                                         {
+                                             continue;
+                                         }
+                                         n = 1;
+                                     }
+                                     for (size_t i = 0; i < n; i++)
+                                     {
+                                         int p = static_cast<int>(items[i] >> 48);
+                                         uint64_t seq = items[i] & ((1ULL << 48) - 1);
+                                         if (p >= PRODUCERS_ || seq == 0 || seq > perProducer)
+                                         {
+                                             fail("corrupted item");
+                                             continue;
+                                         }
+                                         if (seq <= last[p])
+                                         {
+                                             fail("items of one producer out of order");
+                                         }
+                                         last[p] = seq;
+                                         if (seen[p * perProducer + seq - 1].fetch_add(1) != 0)
+                                         {
+                                             fail("item received twice");
+                                         }
+                                     }
+                                     received.fetch_add(n);
+                                 } });
+    }
+    for (int p = 0; p < PRODUCERS_; p++)
+    {
+        threads.emplace_back([&, p]()
+                             {
+                                 std::vector<uint64_t> items(MAX_BATCH_);
+                                 unsigned int rnd = 1000 + p;
+                                 uint64_t seq = 1;
+                                 while (seq <= perProducer)
+                                 {
+                                     size_t n = std::min<uint64_t>(rand_r(&rnd) % MAX_BATCH_ + 1, perProducer - seq + 1);
+                                     for (size_t i = 0; i < n; i++)
+                                     {
+                                         items[i] = encode(p, seq + i);
+                                     }
+                                     /* 一半用阻塞的push_n，一半用try_push_n，只前进实际入队的部分 */
+                                     if (rand_r(&rnd) % 2 == 0)
+                                     {
+                                         queue.push_n(items.data(), n);
+                                     }
+                                     else
+                                     {
+                                         n = queue.try_push_n(items.data(), n);
+                                     }
+                                     seq += n;
+                                 } });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    for (auto &s : seen)
+    {
+        if (s.load() != 1)
+        {
+            fail("item lost");
+            break;
+        }
+    }
+    if (queue.empty() == false)
+    {
+        fail("queue not empty after all items received");
+    }
+    printf("wrap-around: %lu items through capacity %zu\n", received.load(), queue.capacity());
+}
+
+/*
+ * close()唤醒测试：生产者阻塞在满队列上，消费者阻塞在另一个空队列上
+ */
+static void closeTest()
+{
+    MpmcQueue<uint64_t> full(CAPACITY_);
+    MpmcQueue<uint64_t> empty(CAPACITY_);
+    while (full.try_push(1))
+    {
+    }
+    std::atomic<int> returned(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++)
+    {
+        threads.emplace_back([&]()
+                             {
+                                 uint64_t items[8] = {0};
+                                 full.push_n(items, 8);
+                                 returned++; });
+        threads.emplace_back([&]()
+                             {
+                                 uint64_t item = 0;
+                                 if (empty.pop(item))
+                                 {
+                                     fail("pop returned an item from an empty queue");
+                                 }
+                                 returned++; });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    if (returned.load() != 0)
+    {
+        fail("blocked threads returned before close");
+    }
+    full.close();
+    empty.close();
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    if (full.empty() == false)
+    {
+        fail("close did not drop remaining items");
+    }
+    uint64_t item = 0;
+    if (empty.pop(item))
+    {
+        fail("closed queue returned an item");
+    }
+    printf("close: %d blocked threads woken\n", returned.load());
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t perProducer = argc > 1 ? strtoull(argv[1], nullptr, 10) : 200000;
+    std::thread([]()
+                {
+                    std::this_thread::sleep_for(std::chrono::seconds(WATCHDOG_S_));
+                    fprintf(stderr, "FAILED: timeout, deadlock suspected\n");
+                    _exit(2); })
+        .detach();
+    wrapTest(perProducer);
+    closeTest();
+    printf(g_failed ? "FAILED\n" : "OK\n");
+    return g_failed ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+#include <sqlconnpool.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/*
+ * 数据库连接池取用开销测试：每个线程反复取连接、取缓存的预处理语句、归还连接，
+ * 不执行语句，统计每轮的平均耗时，对比共享池和工作线程独占连接
+ * 独占连接的槽位在线程退出后仍保留，一次运行只测一种线程数和模式
+ * 用法：PoolBench host port user password db 线程数 是否独占(0/1) [每个线程的取用次数]
+ * 例如：PoolBench localhost 3306 root 123456 mydb 16 1
+ */
+
+static const int ACQUIRE_TIMEOUT_MS_ = 1000;
+static const size_t SPARE_CONN_ = 4; /* 共享池在线程数之外多留的连接，与服务器的最多连接数配置一致 */
+
+int main(int argc, char *argv[])
+{
+    if (argc != 8 && argc != 9)
+    {
+        fprintf(stderr, "usage: %s host port user password db threads affine(0/1) [perThread]\n", argv[0]);
+        return 1;
+    }
+    int threadNum = atoi(argv[6]);
+    bool isAffine = atoi(argv[7]) != 0;
+    long perThread = argc == 9 ? atol(argv[8]) : 500000;
+    if (threadNum <= 0 || perThread <= 0)
+    {
+        fprintf(stderr, "threads and perThread must be positive\n");
+        return 1;
+    }
+
+    SqlConnPool *pool = SqlConnPool::instance();
+    size_t connNum = threadNum + SPARE_CONN_;
+    pool->init(argv[1], atoi(argv[2]), argv[3], argv[4], argv[5], connNum);
+    pool->setLimits(threadNum, connNum, ACQUIRE_TIMEOUT_MS_);
+    pool->setThreadAffine(isAffine);
+    if (pool->getFreeConnCount() == 0)
+    {
+        fprintf(stderr, "no database connection\n");
+        return 1;
+    }
+
+    std::atomic<long> failed(0);
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadNum; i++)
+    {
+        threads.emplace_back([pool, perThread, &failed]()
+                             {
+                                 for (long j = 0; j < perThread; j++)
+                                 {
+                                     MYSQL *sql = pool->getConn();
+                                     if (sql == nullptr)
+                                     {
+                                         failed++;
+                                         continue;
+                                     }
+                                     if (pool->getStmt(sql, "SELECT 1") == nullptr)
+                                     {
+                                         failed++;
+                                     }
+                                     pool->freeConn(sql);
+                                 } });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+    printf("threads: %d, %s, %.0f ns per get+stmt+free, failed: %ld\n",
+           threadNum, isAffine ? "affine" : "shared", ns / (static_cast<double>(perThread) * threadNum), failed.load());
+    printf("pool: %s\n", pool->report().data());
+    pool->closePool();
+    return failed.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <cstdint>
+#include <condition_variable>
+#include <netinet/in.h>
+#include <sys/types.h>
+
+/*
+ * 访问日志的一条记录，固定256字节，外部采集程序直接按该布局读取共享内存
+ * seq为2 * 序号 + 2时记录完整，写入过程中为奇数
+ */
+struct AccessRecord
+{
+    std::atomic<uint64_t> seq;
+    int64_t timeNs;      /* 响应发送完成的实际时间(纳秒) */
+    uint64_t bytes;      /* 响应报文字节数，含响应头 */
+    uint32_t latencyUs;  /* 收到请求到响应发送完成 */
+    uint32_t upstreamUs; /* 其中访问数据库的时间 */
+    uint32_t addr;       /* 客户端地址，网络字节序 */
+    uint16_t port;       /* 客户端端口，主机字节序 */
+    uint16_t status;
+    char method[8];
+    uint16_t pathLen;
+    uint16_t flags;
+    uint32_t reserved;
+    char path[200]; /* 不以'\0'结尾，超长截断并置FLAG_TRUNCATED */
+
+    static const uint16_t FLAG_TRUNCATED = 1;
+};
+
+/*
+ * 共享内存环形缓冲的头部，之后紧跟capacity个AccessRecord
+ */
+struct AccessRingHeader
+{
+    char magic[8];               /* "WSACLOG1" */
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;           /* 2的幂 */
+    int64_t startNs;             /* 创建时间，采集程序据此发现服务重启 */
+    char pad0[32];
+    std::atomic<uint64_t> head;  /* 下一个要分配的序号 */
+    std::atomic<uint64_t> sampledOut; /* 被采样丢弃的请求数 */
+    char pad1[48];
+};
+
+/*
+ * 访问日志，每个请求一条定长记录，按采样率写入内存映射的环形缓冲
+ * 写入方只做一次fetch_add和一次定长拷贝，不加锁、不格式化，写满后覆盖最旧的记录
+ * 环形缓冲映射自文件(如/dev/shm下)时外部程序可以直接映射读取；
+ * 配置了文本文件时由后台线程读取环形缓冲，格式化后批量写入文件
+ */
+class AccessLog
+{
+public:
+    static AccessLog *instance();
+
+    bool init(const char *ringPath, const char *textPath, size_t capacity, double sampleRate, double errorSampleRate);
+    bool isOpen() const;
+    void unlinkOnExit();
+    void append(const std::string &method, const std::string &path, int status, size_t bytes,
+                int64_t latencyUs, int64_t upstreamUs, const sockaddr_in &addr);
+    uint64_t lost() const;
+
+    static const uint32_t VERSION_ = 1;
+    static const char MAGIC_[8];
+
+private:
+    AccessLog();
+    ~AccessLog();
+
+    bool sample(int status);
+    void textWrite();
+    size_t drain(std::string &out);
+    void writeFile(const std::string &out);
+
+    static const size_t HEADER_SIZE_ = sizeof(AccessRingHeader);
+    static const int FLUSH_INTERVAL_MS_ = 100; /* 文本模式下后台线程每隔这么久写一次文件 */
+    static const int STALL_MS_ = 200;          /* 槽位等这么久仍未写完，按丢失跳过 */
+    static const size_t TEXT_BUFF_SIZE_ = 64 * 1024;
+    static const mode_t FILE_MODE_ = 0640; /* 记录里有客户端地址和请求路径，不给其他用户读 */
+
+    AccessRingHeader *header_;
+    AccessRecord *records_;
+    size_t mapSize_;
+    std::string ringPath_;
+    bool isUnlinkOnExit_; /* 退出时删除环形缓冲文件 */
+    uint64_t mask_;
+    uint64_t sampleThreshold_; /* 随机数小于该值的正常请求被记录 */
+    uint64_t errorThreshold_;  /* 状态码不小于400的请求 */
+    bool sampleAll_;
+    bool errorAll_;
+    std::atomic<bool> isOpen_;
+
+    /* 文本模式 */
+    int fd_;
+    uint64_t tail_;               /* 后台线程下一条要读取的序号 */
+    uint64_t stallTail_;          /* 上一次因未写完而停下的序号 */
+    std::chrono::steady_clock::time_point stallTime_; /* 开始在stallTail_上等待的时间 */
+    std::atomic<uint64_t> lost_;  /* 来不及写入文本文件就被覆盖的记录数 */
+    bool isStop_;
+    std::unique_ptr<std::thread> thread_;
+    std::mutex mtx_;
+    std::condition_variable cond_;
+};
@@ -40,7 +40,7 @@ private:
 };
 
 template <typename T>
-BlockQueue<T>::BlockQueue(size_t maxCapacity) : capacity_(maxCapacity)
+BlockQueue<T>::BlockQueue(size_t maxCapacity) : isClose_(false), capacity_(maxCapacity)
 {
     assert(maxCapacity > 0);
 }
@@ -1,7 +1,7 @@
 #pragma once
 
-#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <sys/uio.h>
@@ -18,6 +18,8 @@ public:
     size_t readableBytes() const;
     size_t writableBytes() const;
     size_t prependableBytes() const;
+    size_t capacity() const;
+    void shrink(size_t size);
 
     const char *beginPtr() const;
     char *beginPtr();
@@ -40,11 +42,12 @@ public:
     void append(const void *data, size_t len);
     void append(const Buffer &buffer);
 
-    ssize_t readFd(int fd, int *retError);
+    ssize_t readFd(int fd, int *retError, size_t maxLen = SIZE_MAX);
     ssize_t writeFd(int fd, int *retError);
 
 private:
+    /* 同一时刻只有一个线程持有连接，所有权经由任务队列和完成队列的锁交接，无需原子量 */
     std::vector<char> buffer_;
-    std::atomic<std::size_t> readPos_;
-    std::atomic<std::size_t> writePos_;
+    std::size_t readPos_;
+    std::size_t writePos_;
 };
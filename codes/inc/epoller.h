@@ -1,30 +1,50 @@
 #pragma once
 
 #include <vector>
+#include <chrono>
 #include <cassert>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
 
+/*
+ * epoll_event.data.u64的低32位为fd，高32位为调用方给的标签(连接代数)，
+ * 事件取出时带回注册时的标签，调用方据此丢弃fd已被关闭或复用之前注册的事件
+ */
 class Epoller
 {
 public:
     explicit Epoller(int maxEvent = 1024);
     ~Epoller();
 
-    bool addFd(int fd, uint32_t events);
-    bool modFd(int fd, uint32_t events);
+    bool addFd(int fd, uint32_t events, uint32_t tag = 0);
+    bool modFd(int fd, uint32_t events, uint32_t tag = 0);
     bool delFd(int fd);
 
     int wait(int timeoutMs = -1);
 
+    void setBusyPoll(int maxSpinUs);
+    void getSpinStat(uint64_t &spinUs, uint64_t &hits, uint64_t &misses);
+
     int getEventFd(size_t i) const;
 
+    uint32_t getEventTag(size_t i) const;
+
     uint32_t getEvents(size_t i) const;
 
 private:
     int epollFd_;
 
     std::vector<struct epoll_event> events_;
+
+    /*
+     * 自适应忙等：阻塞前先以非阻塞方式轮询一段时间，
+     * 窗口取最近事件到达间隔的两倍，超过上限时直接阻塞
+     */
+    int spinMaxUs_;    /* 忙等窗口上限，0为关闭 */
+    double gapUs_;     /* 事件到达间隔的指数滑动平均 */
+    uint64_t spinUs_;  /* 忙等消耗的总时间 */
+    uint64_t hits_;    /* 忙等期间等到事件的次数 */
+    uint64_t misses_;  /* 忙等落空转为阻塞的次数 */
 };
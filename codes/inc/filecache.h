@@ -0,0 +1,55 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <chrono>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#include <memgovernor.h>
+
+/*
+ * 小静态文件的内存缓存，按总字节数做LRU淘汰
+ * 命中时不需要stat/open/mmap，主线程可以直接生成响应
+ */
+class FileCache
+{
+public:
+    typedef std::shared_ptr<const std::string> Content;
+
+    static FileCache *instance();
+
+    void init(size_t capacity);
+    Content get(const std::string &path, struct stat *st);
+    Content load(const std::string &path, const struct stat &st);
+    size_t size();
+    size_t shrink(size_t bytes);
+
+    static const size_t MAX_FILE_SIZE_ = 64 * 1024; /* 超过该大小的文件仍走mmap */
+
+private:
+    struct Entry
+    {
+        std::string path;
+        Content content;
+        struct stat st;
+        std::chrono::steady_clock::time_point checked; /* 上次与磁盘核对的时间 */
+    };
+
+    FileCache();
+    ~FileCache() = default;
+
+    void evict();
+    void removeBack();
+
+    size_t capacity_;
+    size_t size_;
+
+    std::mutex mtx_;
+    std::list<Entry> lru_; /* 表头为最近使用 */
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+
+    static const int REVALIDATE_MS_ = 1000; /* 命中超过该间隔后重新stat，发现文件变化则失效 */
+};
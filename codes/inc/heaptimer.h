@@ -39,6 +39,8 @@ public:
 
     void add(int fd, int timeout, const std::function<void()> &cb);
 
+    void cancel(int fd);
+
     void clear();
 
     void tick();
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <errno.h>
+#include <atomic>
 #include <cstdlib>
 #include <cassert>
+#include <chrono>
+#include <vector>
 #include <sys/uio.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -12,6 +15,9 @@
 #include <sqlconnRAII.hpp>
 #include <httpresponse.h>
 #include <httprequest.h>
+#include <memgovernor.h>
+#include <accesslog.h>
+#include <sessionstore.h>
 
 class HttpConn
 {
@@ -28,22 +34,119 @@ public:
     const char *getIP() const;
     sockaddr_in getAddr() const;
     bool process();
+    void reject(int code, const char *info);
+    bool isQueryPending() const;
+    void getQuery(std::string &name, std::string &pwd, bool &isLogin) const;
+    void resumeQuery(bool isVerified, int64_t upstreamUs);
     size_t toWriteBytes();
+    size_t toReadBytes() const;
     bool isKeepAlive() const;
+    bool isIdle() const;
+    bool hasZeroCopyPending() const;
+    bool isCacheHit();
+    bool mayBlock() const;
+    bool isCachedResponse() const;
+    void startTiming();
+    int64_t stopTiming();
+    void logAccess(int64_t latencyUs);
+    uint32_t generation() const;
+    bool isClosed() const;
+    bool isBusy() const;
+    void setBusy(bool busy);
+    bool isClosing() const;
+    void setClosing();
+    int throttleMs() const;
+    bool isReadPaused() const;
+    void shrinkBuffers();
+
+    static void addWritePolicy(const std::string &prefix, int weight, size_t rate);
 
     static const char *srcDir_;
     static std::atomic<int> userCount_;
+    static size_t zeroCopyThreshold_;
+    static size_t writeQuantum_;
+    static size_t readHighWater_;            /* 单个连接读缓冲的上限，也是请求报文的最大长度 */
+    static size_t readBudget_;               /* 所有连接读缓冲合计的上限 */
+    static std::atomic<size_t> readUsage_;   /* 所有连接读缓冲中未解析的字节数 */
 
 private:
+    /*
+     * 按请求路径前缀匹配的发送策略：每轮配额为 writeQuantum_ * weight，
+     * rate 为令牌桶限速(字节/秒)，0 为不限速
+     */
+    struct WritePolicy
+    {
+        std::string prefix;
+        int weight;
+        size_t rate;
+    };
+
+    /*
+     * MSG_ZEROCOPY 发送后被内核引用的映射区，
+     * 完成通知序号到达 seq 之前不能解除映射
+     */
+    struct ZeroCopyPin
+    {
+        char *addr;
+        size_t len;
+        uint32_t seq;
+    };
+
+    ssize_t sendZeroCopy(size_t maxLen);
+    void reapZeroCopy();
+    void pinZeroCopy();
+    void unpinZeroCopy(bool force);
+    void respond(bool isOk);
+    void applyWritePolicy(const std::string &path);
+    void updateUsage();
+    size_t writeBudget();
+
     int fd_;
     bool isClose_;
+    /*
+     * 以下三项只在主线程读写：连接交给工作线程前置busy，完成队列交回后清除
+     * busy期间需要关闭时只置closing，由完成队列交回时关闭；关闭后代数加一，旧句柄随之失效
+     */
+    uint32_t generation_;
+    bool isBusy_;
+    bool isClosing_;
+    bool isKeepAlive_;  /* 本次响应后是否保持连接 */
+    int requestCount_;  /* 该连接上已经处理的请求数 */
+    bool isTiming_;     /* 是否正在统计请求处理时延 */
+    std::chrono::steady_clock::time_point startTime_;
+    size_t responseBytes_; /* 当前响应报文的字节数，含响应头 */
     int iovCount_;
     struct sockaddr_in addr_;
     struct iovec iov[2];
 
+    /* isCacheHit命中时持有的缓存内容，主线程随后生成响应时直接使用，不会再被核对淘汰 */
+    FileCache::Content pinned_;
+    struct stat pinnedStat_;
+    std::string pinnedPath_;
+
+    bool zeroCopy_;                     /* socket 是否开启了 SO_ZEROCOPY */
+    bool useZeroCopy_;                  /* 当前响应的载荷是否走零拷贝发送 */
+    /* 工作线程写，主线程按EPOLLERR判断是否为完成通知时读 */
+    std::atomic<uint32_t> zcSent_;      /* 已发出的零拷贝 send 次数 */
+    std::atomic<uint32_t> zcDone_;      /* 已收到完成通知的 send 次数 */
+    std::vector<ZeroCopyPin> zcPinned_; /* 等待完成通知的映射区 */
+
+    size_t quantum_;    /* 每轮最多发送的字节数，0为不限，超过后让出工作线程 */
+    size_t rate_;       /* 令牌桶速率(字节/秒)，0为不限速 */
+    double tokens_;     /* 令牌桶当前可发送的字节数 */
+    std::chrono::steady_clock::time_point refillTime_;
+    int throttleMs_;    /* 令牌不足时需要等待的毫秒数，0表示未被限速 */
+    size_t readHeld_;   /* 本连接计入readUsage_的字节数 */
+    size_t memHeld_;    /* 本连接读写缓冲计入MemoryGovernor的字节数 */
+    bool isReadPaused_; /* 全局接收预算用完，本轮没有读socket */
+
     Buffer readBuff_;
     Buffer writeBuff_;
 
     HttpRequest request_;
     HttpResponse response_;
+
+    static std::vector<WritePolicy> writePolicies_;
+    static const size_t MIN_BURST_ = 16 * 1024; /* 令牌桶容量下限，容量取速率的1/4 */
+    static const size_t BUFFER_INIT_SIZE_ = 1024; /* 缓冲区收缩后保留的大小 */
 };
\ No newline at end of file
@@ -3,8 +3,12 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
+#include <functional>
+#include <cstdint>
 #include <buffer.h>
 
+class SqlAsync;
+
 class HttpRequest
 {
 public:
@@ -26,6 +30,8 @@ public:
         FILE_REQUEST,
         INTERNAL_ERROR,
         CLOSED_CONNECTION,
+        DB_REQUEST, /* 请求已解析，等待异步数据库验证用户后再生成响应 */
+        HEADER_TOO_LARGE, /* 请求头条数或总字节数超过上限 */
     };
 
     HttpRequest();
@@ -41,9 +47,25 @@ public:
     std::string getPost(const std::string &key) const;
     std::string getPost(const char *key) const;
     bool iskeepAlive() const;
+    int64_t upstreamUs() const;
+    bool isVerifyPending() const;
+    void getVerify(std::string &name, std::string &pwd, bool &isLogin) const;
+    void finishVerify(bool isVerified, int64_t upstreamUs);
+    const std::string &sessionUser() const;
+    const std::string &newSession() const;
+
+    static bool peekGet(const Buffer &buff, std::string &path);
+    static void userVerifyAsync(SqlAsync *sql, const std::string &name, const std::string &pwd, bool isLogin,
+                                const std::function<void(bool)> &done);
+
+    static bool asyncVerify_; /* 登录注册交给主线程的异步数据库客户端，不在工作线程中阻塞查询 */
 
 private:
     static int convertHex(char ch);
+    void authenticate();
+    void startSession(const std::string &name);
+    static void defaultPath(std::string &path);
+    static bool canonicalPath(std::string &path);
 
     static bool userVerify(const std::string &name, const std::string &pwd, bool isLogin);
 
@@ -51,7 +73,7 @@ private:
     bool parseBody(const std::string &line);
     bool parsePost();
     void parseHeader(const std::string &line);
-    void parsePath();
+    bool parsePath();
     void parseFromUrlencode();
 
     PARSE_STATE state_;
@@ -60,8 +82,20 @@ private:
     std::string version_;
     std::string body_;
     std::unordered_map<std::string, std::string> header_;
+    size_t headerBytes_; /* 已解析的请求头字节数 */
     std::unordered_map<std::string, std::string> post_;
+    int64_t upstreamUs_; /* 本次请求访问数据库的耗时(微秒) */
+    bool isVerifyPending_; /* 异步验证模式下，用户名密码已取出，等待验证结果 */
+    bool verifyIsLogin_;
+    std::string verifyName_;
+    std::string verifyPwd_;
+    std::string sessionUser_; /* 凭会话cookie确认的用户，未登录为空 */
+    std::string newSession_;  /* 需要随响应下发的会话id：本次登录新建的或需要续期的 */
 
     static const std::unordered_set<std::string> DEFAULT_HTML_;
     static const std::unordered_map<std::string, int> DEFAULT_HTML_TAG_;
+    static const std::unordered_set<std::string> AUTH_HTML_;
+
+    static const size_t MAX_HEADER_NUM_ = 64;          /* 请求头条数上限 */
+    static const size_t MAX_HEADER_BYTES_ = 16 * 1024; /* 请求头总字节数上限 */
 };
\ No newline at end of file
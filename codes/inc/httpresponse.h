@@ -8,6 +8,7 @@
 
 #include <log.h>
 #include <buffer.h>
+#include <filecache.h>
 
 class HttpResponse
 {
@@ -16,13 +17,21 @@ public:
     ~HttpResponse();
 
     void init(const std::string srcDir, const std::string &path, bool isKeepAlive, int code = -1);
+    void setCookie(const std::string &cookie);
+    void pin(const FileCache::Content &content, const struct stat &st);
     void makeResponse(Buffer &buff);
+    void makeError(Buffer &buff, int code, const std::string &message);
     void unmapFile();
+    void releaseFile();
     char *file();
     size_t fileLen() const;
+    bool isCached() const;
     void errorContent(Buffer &buff, std::string message);
     int code() const;
 
+    static const int KEEP_ALIVE_MAX_ = 6; /* 一个长连接上最多处理的请求数 */
+    static const int RETRY_AFTER_S_ = 1;  /* 503响应建议客户端重试的秒数 */
+
 private:
     void addStateLine(Buffer &buff);
     void addHeader(Buffer &buff);
@@ -33,9 +42,11 @@ private:
     int code_;
     bool isKeepAlive_;
     char *mmFile_;
+    FileCache::Content cached_; /* 缓存命中时载荷指向缓存内容，不做映射 */
     struct stat mmFileStat_;
     std::string path_;
     std::string srcDir_;
+    std::string cookie_; /* 非空时随响应头下发Set-Cookie */
 
     static const std::unordered_map<std::string, std::string> SUFFIX_TYPE_;
     static const std::unordered_map<int, std::string> CODE_STATUS_;
@@ -1,11 +1,33 @@
 #pragma once
 
+#include <ctime>
 #include <thread>
 #include <string>
+#include <vector>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <unordered_set>
+#include <sys/types.h>
+#include <condition_variable>
 
-#include <buffer.h>
-#include <blockqueue.hpp>
+#include <memgovernor.h>
+#include <logrecord.h>
+
+/*
+ * 编译期日志等级下限，低于该等级的LOG_XXX整条语句被编译器删除，参数也不会求值
+ * 0 DEBUG，1 INFO，2 WARN，3 ERROR；未指定时Release构建(NDEBUG)去掉DEBUG
+ */
+#ifndef LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define LOG_MIN_LEVEL 1
+#else
+#define LOG_MIN_LEVEL 0
+#endif
+#endif
+
+class LogLimiter;
 
 class Log
 {
@@ -19,60 +41,309 @@ public:
         ERROR
     };
 
+    /* 格式化方式，延迟格式化和二进制模式只在异步日志下生效 */
+    enum LOG_MODE
+    {
+        MODE_TEXT,     /* 调用线程格式化 */
+        MODE_DEFERRED, /* 调用线程只记录格式串地址、时钟计数和参数，后台线程格式化为文本 */
+        MODE_BINARY,   /* 后台线程直接写二进制记录，由LogDecoder离线解码 */
+    };
+
     void init(LOG_LEVEL level = INFO,
               int maxQueueSize = 1024,
               const char *path = "./log",
               const char *suffix = ".log");
     static Log *instance();
 
+    void setMode(LOG_MODE mode);
+
+    void setPerProcess();
+
+    void setRotate(size_t maxBytes, int periodS);
+
+    void setRetention(int maxFiles, int maxDays, bool compress);
+
+    bool isDeferred();
+
+    void setRateLimit(int perSecond);
+
+    int rateLimit() const;
+
+    void registerLimiter(LogLimiter *limiter, int level, const char *file, int line, const char *format);
+
+    void writeRepeated(int level, const char *file, int line, const char *format, uint32_t count, long seconds);
+
+    void reportSuppressed(time_t sec);
+
     LOG_LEVEL getLevel();
 
     void setLevel(LOG_LEVEL level);
 
     void flush();
 
+    bool setAffinity(const std::vector<int> &cpus);
+
     void write(LOG_LEVEL level, const char *format, ...);
 
+    template <typename... Args>
+    void writeDeferred(LOG_LEVEL level, const char *format, Args... args);
+
     bool isOpen();
 
 private:
+    /*
+     * 单生产者单消费者的字节环形缓冲，每个写日志的线程一个
+     * 生产者只推进head_，后台写线程只推进tail_，不需要加锁
+     */
+    struct Ring
+    {
+        explicit Ring(size_t size);
+
+        bool push(const char *data, size_t len, size_t &used);
+        size_t used() const;
+
+        std::unique_ptr<char[]> data_;
+        size_t size_; /* 2的幂 */
+        char pad0_[64];
+        std::atomic<size_t> head_;
+        size_t cachedTail_; /* 生产者看到的tail_，空间不够时才重新读取，避免每次访问消费者的缓存行 */
+        char pad1_[64];
+        std::atomic<size_t> tail_;
+        std::atomic<bool> retired_; /* 所属线程已退出，取空后由后台线程释放 */
+    };
+
+    /* 线程退出时标记自己的环形缓冲 */
+    struct RingHolder
+    {
+        Ring *ring = nullptr;
+        ~RingHolder();
+    };
+
     Log();
 
     ~Log();
 
-    void appendLogLevelTitle(LOG_LEVEL level);
+    Ring *localRing();
+
+    void pushRecord(LOG_LEVEL level, const char *record, size_t len);
+
+    void openFile(const char *fileName);
+
+    const char *fileSuffix() const;
+
+    void appendRecord(const char *record, const LogRecord::Header &header);
 
     void asyncWrite();
 
+    void drain();
+
+    void writeFile(const char *data, size_t len);
+
+    void makeFileName(char *buff, time_t sec, int part) const;
+
+    long period(time_t sec) const;
+
+    int openLogFile(const char *fileName) const;
+
+    void checkRotate(time_t sec);
+
+    void startMaintainer();
+
+    void maintain();
+    void resetTaskSync();
+
+    void rotateFile();
+
+    void compressFile(const std::string &fileName);
+
+    void applyRetention();
+
     static const size_t LOG_NAME_LEN = 256;
-    static const int LOG_MAX_LEN = 50000;
+    static const size_t ROTATE_BYTES_ = 64 * 1024 * 1024; /* 默认单个日志文件的大小上限 */
+    static const int ROTATE_PERIOD_S_ = 86400;           /* 默认按天切换日志文件 */
+    static const int ROTATE_RETRY_S_ = 10;               /* 新文件打开失败后重试切换的间隔 */
+    static const int LINE_MAX_LEN_ = 1024;     /* 单条日志正文的最大长度 */
+    static const size_t LINE_AVG_LEN_ = 128;   /* 按队列容量估算环形缓冲大小时每条日志的平均长度 */
+    static const int FLUSH_INTERVAL_MS_ = 50;  /* 后台线程至少每隔这么久写一次文件 */
+    static const size_t RECORD_MAX_LEN_ = 2048; /* 延迟格式化的单条记录上限，超过的退回文本格式化 */
+    static constexpr const char *BINARY_SUFFIX_ = ".blog";
 
     const char *path_;
     const char *suffix_;
 
-    int lineCount_;
-    int today_;
-    bool isOpen_;
-    LOG_LEVEL level_;
+    std::atomic<bool> isOpen_;
+    std::atomic<int> level_;
     bool isAsync_;
 
-    FILE *fp_;
-    Buffer buffer_;
+    int fd_;
+    std::string fileName_; /* 当前日志文件 */
+    size_t fileBytes_;     /* 当前日志文件已写入的字节数 */
+    long period_;          /* 当前日志文件所属的时间周期 */
+    int part_;             /* 同一周期内按大小切分的序号 */
+    pid_t fileTag_;        /* 多进程模式下文件名中带的进程号，0为不带 */
+    long gmtOff_;          /* 本地时区相对UTC的秒数，按本地时间划分周期 */
+    bool isRotating_;      /* 已请求切换，等待维护线程打开新文件 */
+    time_t rotateRetry_;   /* 新文件打开失败后，到该时间前不再请求切换 */
+    size_t maxBytes_;      /* 0为不按大小切换 */
+    int periodS_;          /* 0为不按时间切换 */
+    int mode_;
+    std::atomic<bool> isDeferred_;
+    LogClock clock_;                       /* 后台线程用于把时钟计数换算为实际时间 */
+    std::unordered_set<uint64_t> formats_; /* 当前二进制文件中已经写过的格式串 */
+    std::string scratch_;                  /* 后台线程从环形缓冲中拷出的记录 */
+    std::string out_;                      /* 后台线程本轮要写入文件的内容 */
+
+    size_t ringSize_;
+    std::vector<Ring *> rings_; /* 所有线程的环形缓冲，注册和释放时加ringMtx_ */
+    std::mutex ringMtx_;
+    std::atomic<uint64_t> dropped_; /* 环形缓冲满时丢弃的日志条数 */
+
+    std::atomic<int> rateLimit_;          /* 每个调用点每秒最多输出的条数，0为不限 */
+    std::vector<LogLimiter *> limiters_;  /* 发生过抑制的调用点，定期补写被抑制的条数 */
+    std::mutex limiterMtx_;
+    std::atomic<time_t> reportSec_;       /* 上一次检查被抑制条数的时间 */
 
-    std::unique_ptr<BlockQueue<std::string>> queue_;
+    bool isStop_;
+    std::atomic<bool> isWake_;
+    std::condition_variable cond_;
     std::unique_ptr<std::thread> thread_;
-    std::mutex mtx_;
+    std::mutex mtx_; /* 保护日志文件和后台线程的启停 */
+
+    /* 维护线程：打开新文件、压缩切换下来的文件、按保留策略删除旧文件，以最低优先级运行 */
+    int maxFiles_; /* 0为不限 */
+    int maxDays_;  /* 0为不限 */
+    bool compress_;
+    bool isRotateRequested_;
+    bool isMaintainStop_;
+    pid_t maintainerPid_; /* fork出的子进程中没有这个线程，需要重新创建 */
+    std::deque<std::string> rotated_;
+    std::unique_ptr<std::thread> maintainer_;
+    std::mutex taskMtx_;
+    std::condition_variable taskCond_;
+};
+
+/*
+ * 每个LOG_XXX调用点一个限流器，按秒计数，超过Log::rateLimit()的部分丢弃，
+ * 被丢弃的条数在下一秒该调用点再次输出时、或后台检查时补写一条汇总
+ * 只含原子变量且构造函数为constexpr，作为函数内静态变量时在编译期完成初始化，没有初始化守卫的开销
+ */
+class LogLimiter
+{
+public:
+    constexpr LogLimiter() : window_(0), count_(0), suppressed_(0), isRegistered_(false),
+                             level_(0), file_(nullptr), line_(0), format_(nullptr)
+    {
+    }
+
+    /* 被抑制时只有一次取时间、两次读和一次原子加，不求值参数也不格式化 */
+    bool allow(int level, const char *file, int line, const char *format)
+    {
+        int limit = Log::instance()->rateLimit();
+        if (limit <= 0)
+        {
+            return true;
+        }
+        time_t sec = time(nullptr);
+        if (sec != window_.load(std::memory_order_relaxed))
+        {
+            this->roll(sec, level, file, line, format);
+        }
+        if (count_.load(std::memory_order_relaxed) < static_cast<uint32_t>(limit) &&
+            count_.fetch_add(1, std::memory_order_relaxed) < static_cast<uint32_t>(limit))
+        {
+            return true;
+        }
+        if (suppressed_.fetch_add(1, std::memory_order_relaxed) == 0 &&
+            isRegistered_.load(std::memory_order_acquire) == false)
+        {
+            Log::instance()->registerLimiter(this, level, file, line, format);
+        }
+        return false;
+    }
+
+    /* 进入新的一秒，由抢到窗口的线程补写上一个窗口被抑制的条数 */
+    void roll(time_t sec, int level, const char *file, int line, const char *format)
+    {
+        time_t window = window_.load(std::memory_order_relaxed);
+        if (window == sec || window_.compare_exchange_strong(window, sec, std::memory_order_relaxed) == false)
+        {
+            return;
+        }
+        count_.store(0, std::memory_order_relaxed);
+        uint32_t suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+        if (suppressed > 0)
+        {
+            Log::instance()->writeRepeated(level, file, line, format, suppressed, static_cast<long>(sec - window));
+        }
+    }
+
+    /* 后台检查：窗口已经过去、之后没有再输出的调用点 */
+    void report(time_t sec)
+    {
+        time_t window = window_.load(std::memory_order_relaxed);
+        if (window != sec && suppressed_.load(std::memory_order_relaxed) > 0)
+        {
+            this->roll(sec, level_, file_, line_, format_);
+        }
+    }
+
+private:
+    friend class Log;
+
+    std::atomic<time_t> window_;      /* 当前计数窗口(秒) */
+    std::atomic<uint32_t> count_;      /* 当前窗口已放行的条数 */
+    std::atomic<uint32_t> suppressed_; /* 当前窗口被抑制的条数 */
+    std::atomic<bool> isRegistered_;
+    /* 以下由registerLimiter在limiterMtx_下写入一次 */
+    int level_;
+    const char *file_;
+    int line_;
+    const char *format_;
 };
 
-#define LOG_BASE(level, format, ...)                                                       \
-    do                                                                                     \
-    {                                                                                      \
-        Log *log = Log::instance();                                                        \
-        if (log->isOpen() && static_cast<int>(log->getLevel()) <= static_cast<int>(level)) \
-        {                                                                                  \
-            log->write(level, format, ##__VA_ARGS__);                                      \
-            log->flush();                                                                  \
-        }                                                                                  \
+/*
+ * 延迟格式化，只编码参数放入本线程的环形缓冲，format必须是字符串字面量
+ * 记录过长或同步模式下退回普通格式化
+ */
+template <typename... Args>
+void Log::writeDeferred(LOG_LEVEL level, const char *format, Args... args)
+{
+    static thread_local char record[RECORD_MAX_LEN_];
+    size_t len = LogRecord::LOG_HEADER_LEN_ + LogRecord::argSize(args...);
+    if (len > RECORD_MAX_LEN_)
+    {
+        this->write(level, format, args...);
+        return;
+    }
+    uint64_t tick = LogClock::now();
+    uint64_t fmt = reinterpret_cast<uintptr_t>(format);
+    LogRecord::putHeader(record, len, LogRecord::TYPE_LOG, level, sizeof...(args));
+    memcpy(record + LogRecord::HEADER_LEN_, &tick, 8);
+    memcpy(record + LogRecord::HEADER_LEN_ + 8, &fmt, 8);
+    LogRecord::putArgs(record + LogRecord::LOG_HEADER_LEN_, args...);
+    this->pushRecord(level, record, len);
+}
+
+#define LOG_BASE(level, format, ...)                                                             \
+    do                                                                                           \
+    {                                                                                            \
+        if (static_cast<int>(level) >= LOG_MIN_LEVEL)                                            \
+        {                                                                                        \
+            Log *log = Log::instance();                                                          \
+            static LogLimiter limiter;                                                           \
+            if (log->isOpen() && static_cast<int>(log->getLevel()) <= static_cast<int>(level) && \
+                limiter.allow(level, __FILE__, __LINE__, format))                                \
+            {                                                                                    \
+                if (log->isDeferred())                                                           \
+                {                                                                                \
+                    log->writeDeferred(level, format, ##__VA_ARGS__);                            \
+                }                                                                                \
+                else                                                                             \
+                {                                                                                \
+                    log->write(level, format, ##__VA_ARGS__);                                    \
+                }                                                                                \
+            }                                                                                    \
+        }                                                                                        \
     } while (0);
 
 #define LOG_DEBUG(format, ...)                      \
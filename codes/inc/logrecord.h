@@ -0,0 +1,164 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+/*
+ * 二进制日志记录的编码和解码，异步日志线程和离线解码工具共用
+ * 记录以8字节头开始：长度(含头) 类型 等级 参数个数，之后按类型存放：
+ *   TEXT   已格式化好的一行文本
+ *   LOG    时钟计数 格式串地址 参数(1字节类型 + 值，字符串为2字节长度 + 内容)
+ *   FORMAT 格式串地址 格式串内容，二进制文件中每个格式串第一次出现前写一次
+ *   SYNC   时钟计数 对应的实际时间(纳秒) 每个计数的纳秒数
+ */
+class LogRecord
+{
+public:
+    enum TYPE
+    {
+        TYPE_TEXT = 1,
+        TYPE_LOG,
+        TYPE_FORMAT,
+        TYPE_SYNC,
+    };
+
+    struct Header
+    {
+        uint32_t len;
+        uint8_t type;
+        uint8_t level;
+        uint16_t argc;
+    };
+
+    static const size_t HEADER_LEN_ = sizeof(Header);
+    static const size_t LOG_HEADER_LEN_ = HEADER_LEN_ + 16;
+    static const size_t STR_MAX_LEN_ = 256; /* 字符串参数超过该长度被截断 */
+
+    /* 计算参数编码后的字节数 */
+    static size_t argSize()
+    {
+        return 0;
+    }
+    template <typename T, typename... Args>
+    static size_t argSize(T value, Args... args)
+    {
+        return LogRecord::sizeOf(value) + LogRecord::argSize(args...);
+    }
+
+    /* 依次编码参数，返回写入结束的位置 */
+    static char *putArgs(char *p)
+    {
+        return p;
+    }
+    template <typename T, typename... Args>
+    static char *putArgs(char *p, T value, Args... args)
+    {
+        return LogRecord::putArgs(LogRecord::put(p, value), args...);
+    }
+
+    static void putHeader(char *p, size_t len, TYPE type, int level, int argc);
+    static Header getHeader(const char *p);
+
+    static std::string format(const char *fmt, const char *args, const char *end, int argc);
+    static size_t formatTime(int64_t ns, char *buff, size_t size);
+    static const char *levelTitle(int level);
+
+    static const char MAGIC_[8]; /* 二进制日志文件头 */
+
+private:
+    static size_t strLen(const char *s)
+    {
+        return s == nullptr ? 6 : strnlen(s, STR_MAX_LEN_);
+    }
+
+    static size_t sizeOf(const char *s)
+    {
+        return 3 + LogRecord::strLen(s);
+    }
+    static size_t sizeOf(char *s)
+    {
+        return 3 + LogRecord::strLen(s);
+    }
+    template <typename T>
+    static size_t sizeOf(T *)
+    {
+        return 9;
+    }
+    template <typename T>
+    static typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value, size_t>::type sizeOf(T)
+    {
+        return 9;
+    }
+
+    static char *putValue(char *p, char tag, const void *value)
+    {
+        *p++ = tag;
+        memcpy(p, value, 8);
+        return p + 8;
+    }
+    static char *put(char *p, const char *s)
+    {
+        uint16_t len = static_cast<uint16_t>(LogRecord::strLen(s));
+        *p++ = 's';
+        memcpy(p, &len, 2);
+        memcpy(p + 2, s == nullptr ? "(null)" : s, len);
+        return p + 2 + len;
+    }
+    static char *put(char *p, char *s)
+    {
+        return LogRecord::put(p, static_cast<const char *>(s));
+    }
+    template <typename T>
+    static char *put(char *p, T *ptr)
+    {
+        uint64_t v = reinterpret_cast<uintptr_t>(ptr);
+        return LogRecord::putValue(p, 'p', &v);
+    }
+    template <typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value, char *>::type put(char *p, T value)
+    {
+        double v = value;
+        return LogRecord::putValue(p, 'f', &v);
+    }
+    template <typename T>
+    static typename std::enable_if<(std::is_integral<T>::value && std::is_signed<T>::value) || std::is_enum<T>::value, char *>::type
+    put(char *p, T value)
+    {
+        int64_t v = static_cast<int64_t>(value);
+        return LogRecord::putValue(p, 'i', &v);
+    }
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value, char *>::type put(char *p, T value)
+    {
+        uint64_t v = value;
+        return LogRecord::putValue(p, 'u', &v);
+    }
+};
+
+/*
+ * 日志时钟，热路径只读时钟计数(x86上为TSC)，后台线程定期用实际时间校准，换算为纳秒
+ * 依赖处理器提供恒定频率且各核同步的TSC(constant_tsc/nonstop_tsc)
+ */
+class LogClock
+{
+public:
+    LogClock();
+
+    static uint64_t now();
+    static int64_t realNs();
+
+    void sync(uint64_t tick, int64_t ns);
+    void set(uint64_t tick, int64_t ns, double nsPerTick);
+    int64_t toNs(uint64_t tick) const;
+    double nsPerTick() const;
+
+private:
+    bool hasBase_;
+    uint64_t baseTick_; /* 第一次校准，用于计算频率 */
+    int64_t baseNs_;
+    uint64_t lastTick_; /* 最近一次校准，作为换算的锚点 */
+    int64_t lastNs_;
+    double nsPerTick_;
+};
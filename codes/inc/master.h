@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <csignal>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <webserver.h>
+
+/*
+ * 多进程模式的master，负责创建共享监听socket并fork出worker进程
+ * worker崩溃后自动拉起，SIGHUP时平滑替换全部worker，
+ * 各worker的运行统计写在共享内存中，由master定期汇总输出；
+ * 统计槽位是worker数的两倍，重载时新worker使用空闲槽位，不与排空中的旧worker共用
+ * 开启绑核时每个worker独占一个核，并使用各自的SO_REUSEPORT监听socket，
+ * 通过SO_INCOMING_CPU让连接落在网卡中断所在核的worker上
+ */
+class Master
+{
+public:
+    typedef std::function<void(int listenFd, ServerStat *stat, int cpu)> WorkerFunc;
+
+    Master(int port, int workerNum, const WorkerFunc &worker, bool bindCpu = false);
+    ~Master();
+
+    int run();
+
+private:
+    struct Worker
+    {
+        pid_t pid;
+        time_t startTime;
+        time_t respawnTime; /* 启动即崩溃时延迟拉起的时间，0为没有等待中的拉起 */
+        size_t statSlot;    /* 使用的统计槽位 */
+        int cpu;            /* 绑定的核，-1为不绑核 */
+    };
+
+    void spawn(size_t slot);
+    void reap();
+    void respawn();
+    void reload();
+    void stopAll();
+    void report();
+    int nextTimeout(time_t nextReport) const;
+    bool findFreeStat(size_t &statSlot) const;
+
+    int port_;
+    bool bindCpu_;
+    bool isStop_;
+    WorkerFunc worker_;
+    ServerStat *stat_;            /* 共享内存统计区，statNum_个槽位 */
+    size_t statNum_;
+    std::vector<Worker> workers_;
+    std::vector<int> listenFds_;  /* 不绑核时只有一个共享监听socket，绑核时每个worker一个 */
+    std::vector<Worker> retired_; /* 平滑重启时被替换、正在排空的旧worker */
+    sigset_t oldMask_;
+
+    static const int REPORT_INTERVAL_S_ = 10; /* 统计汇总输出间隔 */
+    static const int RESPAWN_DELAY_S_ = 1;    /* worker启动即崩溃时的重启间隔，防止拉起风暴 */
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+/*
+ * 内存记账，各个缓冲池和缓存把自己占用的字节数报上来
+ * 合计超过软上限时依次收缩缓存、暂停读取；超过硬上限时拒绝新连接并淘汰空闲连接
+ */
+class MemoryGovernor
+{
+public:
+    enum SUBSYSTEM
+    {
+        CONN_BUFFER, /* 连接读写缓冲区 */
+        FILE_CACHE,  /* 小文件缓存 */
+        LOG_QUEUE,   /* 异步日志队列 */
+        SUBSYSTEM_NUM,
+    };
+
+    enum PRESSURE
+    {
+        PRESSURE_NONE,
+        PRESSURE_SOFT,
+        PRESSURE_HARD,
+    };
+
+    static MemoryGovernor *instance();
+
+    void init(size_t softLimit, size_t hardLimit);
+    void add(SUBSYSTEM sub, size_t bytes);
+    void sub(SUBSYSTEM sub, size_t bytes);
+    size_t usage(SUBSYSTEM sub) const;
+    size_t total() const;
+    size_t softLimit() const;
+    size_t hardLimit() const;
+    PRESSURE pressure() const;
+    std::string report() const;
+
+    static size_t cgroupLimit();
+
+private:
+    MemoryGovernor();
+    ~MemoryGovernor() = default;
+
+    std::atomic<size_t> usage_[SUBSYSTEM_NUM];
+    std::atomic<size_t> softLimit_; /* 0为不限 */
+    std::atomic<size_t> hardLimit_; /* 0为不限 */
+};
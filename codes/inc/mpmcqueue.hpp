@@ -0,0 +1,499 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cassert>
+#include <ctime>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * 无锁有界多生产者多消费者队列(Vyukov)，接口与BlockQueue一致
+ * 每个槽位带一个序号：序号等于入队位置时可写，等于入队位置+1时可读，出队后加上容量留给下一圈
+ * 生产者和消费者只在各自的位置上做CAS，互不加锁；只有队列空或满且需要等待时才进入futex睡眠，
+ * 对端只在有等待者时才发起唤醒系统调用，且同一时刻最多一个唤醒在途，
+ * 被唤醒的线程还没运行时，后续的入队出队不再重复唤醒
+ * T需要可默认构造和赋值
+ */
+template <typename T>
+class MpmcQueue
+{
+public:
+    explicit MpmcQueue(size_t maxCapacity = 1024);
+    ~MpmcQueue();
+
+    MpmcQueue(const MpmcQueue &) = delete;
+    MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+    void clear();
+    void close();
+    void flush();
+    bool empty();
+    bool full();
+    size_t size();
+    size_t capacity();
+    void push_back(const T &item);
+    bool try_push(const T &item);
+    void push_n(const T *items, size_t count);
+    size_t try_push_n(const T *items, size_t count);
+    bool pop(T &item);
+    bool pop(T &item, int timeout);
+    bool try_pop(T &item);
+    size_t pop_n(T *items, size_t maxCount);
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    /* 一侧(消费者或生产者)的等待状态 */
+    struct Waiters
+    {
+        std::atomic<uint32_t> word;  /* futex字，每次唤醒前加一 */
+        std::atomic<uint32_t> count; /* 已登记的等待者个数 */
+        std::atomic<bool> isWoken;   /* 已发出唤醒，被唤醒的线程还没复查队列 */
+    };
+
+    bool isReady(bool isConsumer, bool &isInFlight);
+    bool wait(Waiters &waiters, bool isConsumer, const std::chrono::steady_clock::time_point *deadline);
+    void wake(Waiters &waiters, bool isAll);
+
+    static const int SPIN_ = 64; /* 多核时进入futex睡眠前的自旋次数，单核上自旋只会占着对端的时间片 */
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    char pad0_[64];
+    std::atomic<size_t> enqueuePos_;
+    char pad1_[64];
+    std::atomic<size_t> dequeuePos_;
+    char pad2_[64];
+    Waiters notEmpty_; /* 等待元素的消费者 */
+    Waiters notFull_;  /* 等待空位的生产者 */
+    std::atomic<bool> isClose_;
+    int spin_;
+};
+
+template <typename T>
+MpmcQueue<T>::MpmcQueue(size_t maxCapacity) : mask_(0), enqueuePos_(0), dequeuePos_(0), isClose_(false),
+                                              spin_(std::thread::hardware_concurrency() > 1 ? SPIN_ : 0)
+{
+    assert(maxCapacity > 0);
+    for (Waiters *waiters : {&notEmpty_, &notFull_})
+    {
+        waiters->word.store(0, std::memory_order_relaxed);
+        waiters->count.store(0, std::memory_order_relaxed);
+        waiters->isWoken.store(false, std::memory_order_relaxed);
+    }
+    size_t cap = 2;
+    while (cap < maxCapacity)
+    {
+        cap <<= 1;
+    }
+    cells_.reset(new Cell[cap]);
+    for (size_t i = 0; i < cap; i++)
+    {
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    mask_ = cap - 1;
+}
+
+template <typename T>
+MpmcQueue<T>::~MpmcQueue()
+{
+    this->close();
+}
+
+/*
+ * 关闭队列，丢弃剩余元素，唤醒所有等待者
+ */
+template <typename T>
+void MpmcQueue<T>::close()
+{
+    isClose_.store(true, std::memory_order_seq_cst);
+    this->clear();
+    this->wake(notEmpty_, true);
+    this->wake(notFull_, true);
+}
+
+/*
+ * 唤醒一个消费者
+ */
+template <typename T>
+void MpmcQueue<T>::flush()
+{
+    this->wake(notEmpty_, false);
+}
+
+/*
+ * 清空队列
+ */
+template <typename T>
+void MpmcQueue<T>::clear()
+{
+    T item;
+    while (this->try_pop(item))
+    {
+    }
+}
+
+/*
+ * 获取队列容量，构造时向上取2的幂
+ */
+template <typename T>
+size_t MpmcQueue<T>::capacity()
+{
+    return mask_ + 1;
+}
+
+/*
+ * 获取队列大小，并发修改时为近似值
+ */
+template <typename T>
+size_t MpmcQueue<T>::size()
+{
+    size_t tail = dequeuePos_.load(std::memory_order_relaxed);
+    size_t head = enqueuePos_.load(std::memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+}
+
+/*
+ * 获取队列是否为空
+ */
+template <typename T>
+bool MpmcQueue<T>::empty()
+{
+    return this->size() == 0;
+}
+
+/*
+ * 获取队列是否为满
+ */
+template <typename T>
+bool MpmcQueue<T>::full()
+{
+    return this->size() >= this->capacity();
+}
+
+/*
+ * 尝试入队一个元素，队列满时返回false
+ */
+template <typename T>
+bool MpmcQueue<T>::try_push(const T &item)
+{
+    return this->try_push_n(&item, 1) == 1;
+}
+
+/*
+ * 尝试批量入队，一次CAS占下连续的若干空槽，返回实际入队的个数
+ */
+template <typename T>
+size_t MpmcQueue<T>::try_push_n(const T *items, size_t count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    size_t n = 0;
+    while (true)
+    {
+        /* 从pos开始数出连续可写的槽位 */
+        n = 0;
+        bool isStale = false;
+        while (n < count && n <= mask_)
+        {
+            size_t seq = cells_[(pos + n) & mask_].seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + n);
+            if (diff != 0)
+            {
+                /* diff < 0 为上一圈的元素还没被取走，diff > 0 为pos已经被其他生产者占用 */
+                isStale = diff > 0 && n == 0;
+                break;
+            }
+            n++;
+        }
+        if (n == 0 && isStale == false)
+        {
+            return 0;
+        }
+        /* 占位的CAS与等待者复查的位置读取同在全序中，见wait() */
+        if (n > 0 && enqueuePos_.compare_exchange_weak(pos, pos + n, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            break;
+        }
+        if (isStale)
+        {
+            pos = enqueuePos_.load(std::memory_order_relaxed);
+        }
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        Cell &cell = cells_[(pos + i) & mask_];
+        cell.data = items[i];
+        cell.seq.store(pos + i + 1, std::memory_order_release);
+    }
+    this->wake(notEmpty_, false);
+    /* 还有空位时把唤醒传给下一个等待的生产者，被唤醒的生产者可能只放一批就不再入队 */
+    if (notFull_.count.load(std::memory_order_seq_cst) > 0 &&
+        enqueuePos_.load(std::memory_order_seq_cst) - dequeuePos_.load(std::memory_order_seq_cst) <= mask_)
+    {
+        this->wake(notFull_, false);
+    }
+    return n;
+}
+
+/*
+ * 向队尾加入一个元素，队列满时阻塞
+ */
+template <typename T>
+void MpmcQueue<T>::push_back(const T &item)
+{
+    this->push_n(&item, 1);
+}
+
+/*
+ * 批量入队，放不下的部分等待消费者腾出空间，队列关闭后丢弃
+ */
+template <typename T>
+void MpmcQueue<T>::push_n(const T *items, size_t count)
+{
+    while (count > 0 && isClose_.load(std::memory_order_relaxed) == false)
+    {
+        size_t n = this->try_push_n(items, count);
+        items += n;
+        count -= n;
+        if (count > 0 && n == 0)
+        {
+            this->wait(notFull_, false, nullptr);
+        }
+    }
+}
+
+/*
+ * 尝试出队一个元素，队列空时返回false
+ */
+template <typename T>
+bool MpmcQueue<T>::try_pop(T &item)
+{
+    return this->pop_n(&item, 1) == 1;
+}
+
+/*
+ * 批量出队，一次CAS取走连续的若干可读槽位，返回实际出队的个数，不阻塞
+ */
+template <typename T>
+size_t MpmcQueue<T>::pop_n(T *items, size_t maxCount)
+{
+    if (maxCount == 0)
+    {
+        return 0;
+    }
+    size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+    size_t n = 0;
+    while (true)
+    {
+        n = 0;
+        bool isStale = false;
+        while (n < maxCount && n <= mask_)
+        {
+            size_t seq = cells_[(pos + n) & mask_].seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + n + 1);
+            if (diff != 0)
+            {
+                /* diff < 0 为还没有写入，diff > 0 为pos已经被其他消费者取走 */
+                isStale = diff > 0 && n == 0;
+                break;
+            }
+            n++;
+        }
+        if (n == 0 && isStale == false)
+        {
+            return 0;
+        }
+        if (n > 0 && dequeuePos_.compare_exchange_weak(pos, pos + n, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            break;
+        }
+        if (isStale)
+        {
+            pos = dequeuePos_.load(std::memory_order_relaxed);
+        }
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        Cell &cell = cells_[(pos + i) & mask_];
+        items[i] = std::move(cell.data);
+        cell.seq.store(pos + i + mask_ + 1, std::memory_order_release);
+    }
+    this->wake(notFull_, false);
+    /* 还有元素时把唤醒传给下一个等待的消费者，被唤醒的消费者可能只取一个就不再出队 */
+    if (notEmpty_.count.load(std::memory_order_seq_cst) > 0 &&
+        enqueuePos_.load(std::memory_order_seq_cst) != dequeuePos_.load(std::memory_order_seq_cst))
+    {
+        this->wake(notEmpty_, false);
+    }
+    return n;
+}
+
+/*
+ * 队头弹出一个元素，队列空时阻塞，队列关闭后返回false
+ */
+template <typename T>
+bool MpmcQueue<T>::pop(T &item)
+{
+    while (true)
+    {
+        if (this->try_pop(item))
+        {
+            return true;
+        }
+        if (isClose_.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+        this->wait(notEmpty_, true, nullptr);
+    }
+}
+
+/*
+ * 队头弹出一个元素，带超时(秒)返回
+ */
+template <typename T>
+bool MpmcQueue<T>::pop(T &item, int timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+    while (true)
+    {
+        if (this->try_pop(item))
+        {
+            return true;
+        }
+        if (isClose_.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+        if (this->wait(notEmpty_, true, &deadline) == false)
+        {
+            return this->try_pop(item);
+        }
+    }
+}
+
+/*
+ * 按两端位置判断队列对本侧是否可用：消费者看非空，生产者看未满
+ * 位置已被对端占下但槽位还没写完时也算可用，isInFlight置为true
+ */
+template <typename T>
+bool MpmcQueue<T>::isReady(bool isConsumer, bool &isInFlight)
+{
+    isInFlight = false;
+    if (isClose_.load(std::memory_order_seq_cst))
+    {
+        return true;
+    }
+    if (isConsumer)
+    {
+        size_t tail = dequeuePos_.load(std::memory_order_seq_cst);
+        size_t head = enqueuePos_.load(std::memory_order_seq_cst);
+        if (head == tail)
+        {
+            return false;
+        }
+        isInFlight = cells_[tail & mask_].seq.load(std::memory_order_acquire) != tail + 1;
+        return true;
+    }
+    size_t head = enqueuePos_.load(std::memory_order_seq_cst);
+    size_t tail = dequeuePos_.load(std::memory_order_seq_cst);
+    if (head - tail > mask_)
+    {
+        return false;
+    }
+    isInFlight = cells_[head & mask_].seq.load(std::memory_order_acquire) != head;
+    return true;
+}
+
+/*
+ * 队列空(消费者)或满(生产者)时等待，多核先自旋，再在futex字上睡眠，超时返回false
+ * 等待者先登记、清除isWoken，再按位置复查队列；对端先CAS推进位置，写完槽位后再读等待者个数。
+ * 这几步都是seq_cst操作，要么复查看到新位置，要么对端看到等待者，入队出队路径上不需要额外的屏障
+ * 返回后调用者总会重新尝试出队或入队，isWoken由返回的线程清除，保证在途的唤醒不会被丢掉
+ */
+template <typename T>
+bool MpmcQueue<T>::wait(Waiters &waiters, bool isConsumer, const std::chrono::steady_clock::time_point *deadline)
+{
+    bool isInFlight = false;
+    for (int i = 0; i < spin_; i++)
+    {
+        if (this->isReady(isConsumer, isInFlight) && isInFlight == false)
+        {
+            return true;
+        }
+    }
+
+    uint32_t val = waiters.word.load(std::memory_order_acquire);
+    waiters.count.fetch_add(1, std::memory_order_seq_cst);
+    waiters.isWoken.store(false, std::memory_order_seq_cst);
+    bool res = true;
+    if (this->isReady(isConsumer, isInFlight))
+    {
+        /* 对端占了位置还没写完，让出CPU等它写完，单核上原地重试只会空转一个时间片 */
+        if (isInFlight)
+        {
+            std::this_thread::yield();
+        }
+    }
+    else
+    {
+        struct timespec ts;
+        struct timespec *timeout = nullptr;
+        if (deadline != nullptr)
+        {
+            auto left = *deadline - std::chrono::steady_clock::now();
+            if (left <= std::chrono::steady_clock::duration::zero())
+            {
+                res = false;
+            }
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+            ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+            ts.tv_nsec = static_cast<long>(ns % 1000000000);
+            timeout = &ts;
+        }
+        if (res)
+        {
+            long ret = syscall(SYS_futex, reinterpret_cast<uint32_t *>(&waiters.word), FUTEX_WAIT_PRIVATE, val, timeout, nullptr, 0);
+            res = !(ret < 0 && errno == ETIMEDOUT);
+        }
+        waiters.isWoken.store(false, std::memory_order_seq_cst);
+    }
+    waiters.count.fetch_sub(1, std::memory_order_relaxed);
+    return res;
+}
+
+/*
+ * 有等待者时推进futex字并唤醒一个(关闭时唤醒全部)
+ * 已有唤醒在途时跳过：被唤醒的线程清除isWoken后会复查队列，能看到本次的元素或空位，
+ * 取走之后如果还有剩余，由它继续唤醒下一个等待者
+ * 没有等待者时只有一次普通读，入队出队的常见路径不进系统调用也不加屏障
+ */
+template <typename T>
+void MpmcQueue<T>::wake(Waiters &waiters, bool isAll)
+{
+    if (waiters.count.load(std::memory_order_seq_cst) == 0)
+    {
+        return;
+    }
+    if (isAll == false && waiters.isWoken.exchange(true, std::memory_order_seq_cst))
+    {
+        return;
+    }
+    waiters.word.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&waiters.word), FUTEX_WAKE_PRIVATE, isAll ? INT_MAX : 1, nullptr, nullptr, 0);
+}
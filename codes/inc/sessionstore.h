@@ -0,0 +1,69 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+
+/*
+ * 服务端会话表，登录成功后生成随机会话id通过Set-Cookie下发，
+ * 之后的请求凭cookie中的id查表即可确认用户，不必再访问数据库
+ * id取自getrandom的32字节随机数，按id首字符分片，每片一把锁
+ * 会话空闲超过有效期后失效，查询时按过期处理，主循环定期清理；分片满时按LRU淘汰，
+ * 有效期从最近一次使用算起，LRU表尾也就是最早过期的会话，清理只需从表尾扫到第一个未过期的为止；
+ * 有效期随使用顺延，cookie的Max-Age从下发时算起，使用时过了半个有效期就重新下发；
+ * 可选在退出时写入快照文件，下次启动时加载
+ */
+class SessionStore
+{
+public:
+    static SessionStore *instance();
+
+    void init(size_t capacity, int ttlS);
+    bool isOpen() const;
+    std::string create(const std::string &user);
+    bool lookup(const std::string &id, std::string &user, bool &isRenew);
+    void remove(const std::string &id);
+    size_t expire();
+    size_t size();
+    std::string cookie(const std::string &id) const;
+    bool save(const std::string &path);
+    size_t load(const std::string &path);
+
+    static const char COOKIE_NAME_[];
+
+private:
+    struct Session
+    {
+        std::string id;
+        std::string user;
+        int64_t expiresMs; /* 过期的实际时间(毫秒)，快照跨进程重启仍然有效 */
+        int64_t renewMs;   /* 到该时间后使用时重新下发cookie，0为下一次使用时下发 */
+    };
+
+    /* 对齐到缓存行，相邻分片的锁不会伪共享 */
+    struct alignas(64) Shard
+    {
+        std::mutex mtx;
+        std::list<Session> lru; /* 表头为最近使用 */
+        std::unordered_map<std::string, std::list<Session>::iterator> index;
+    };
+
+    SessionStore();
+    ~SessionStore() = default;
+
+    static bool isValidId(const std::string &id);
+    static int64_t nowMs();
+    Shard &shard(const std::string &id);
+    void insert(const Session &session);
+
+    static const size_t SHARD_NUM_ = 16;
+    static const size_t ID_BYTES_ = 32; /* 会话id的随机字节数，id为其十六进制 */
+
+    std::atomic<bool> isOpen_;
+    size_t shardCapacity_;
+    int ttlS_;
+    Shard shards_[SHARD_NUM_];
+};
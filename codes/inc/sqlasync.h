@@ -0,0 +1,99 @@
+#pragma once
+
+#include <deque>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <mysql/mysql.h>
+
+#include <epoller.h>
+#include <heaptimer.h>
+
+/*
+ * MariaDB客户端库提供非阻塞接口(mysql_real_query_start/_cont等)，
+ * 其他客户端库没有，此时SqlAsync::init返回false，上层退回阻塞连接池
+ */
+#if defined(LIBMARIADB) || defined(MARIADB_BASE_VERSION)
+#define SQL_ASYNC_SUPPORTED 1
+#else
+#define SQL_ASYNC_SUPPORTED 0
+#endif
+
+/*
+ * 异步数据库客户端，只在主线程使用
+ * 少量非阻塞连接的socket注册到主循环的Epoller，查询在连接间排队，
+ * 连接需要等待读写时返回主循环，就绪后继续，完成后在主线程调用回调
+ */
+class SqlAsync
+{
+public:
+    /* ok为false表示执行失败，res为查询结果，回调返回后释放，不返回结果集的语句为nullptr */
+    typedef std::function<void(bool ok, MYSQL_RES *res)> Callback;
+
+    explicit SqlAsync(Epoller *epoller);
+    ~SqlAsync();
+
+    static bool isSupported();
+
+    bool init(const char *host, int port, const char *user, const char *pwd, const char *db, size_t connNum);
+    bool query(const std::string &sql, const Callback &cb);
+    static std::string escape(const std::string &from);
+    unsigned int errNo() const;
+    bool owns(int fd) const;
+    void onEvent(int fd, uint32_t events);
+    int getNextTick();
+    size_t pending() const;
+
+private:
+    enum STATE
+    {
+        STATE_BROKEN,     /* 未连接，等待重连 */
+        STATE_CONNECTING,
+        STATE_IDLE,
+        STATE_QUERYING,
+        STATE_STORING,    /* 读取结果集 */
+    };
+
+    struct Conn
+    {
+        MYSQL *sql;
+        int fd;
+        STATE state;
+        std::string query; /* 执行中的语句，非阻塞接口在_cont阶段仍会读取，完成前不能释放 */
+        Callback cb;
+        std::chrono::steady_clock::time_point deadline; /* 本次连接或查询(含读取结果集)的截止时间 */
+    };
+
+    void connect(size_t i);
+    void proceed(size_t i, int status);
+    void wait(size_t i, int status);
+    void watch(size_t i, uint32_t events);
+    void onConnected(size_t i, MYSQL *ret);
+    void onQueried(size_t i, int err);
+    void complete(size_t i, bool ok, MYSQL_RES *res);
+    void setIdle(size_t i);
+    void reset(size_t i, unsigned int err = 0);
+    void schedule();
+
+    static const int RECONNECT_MS_ = 1000;    /* 连接失败后的重试间隔 */
+    static const unsigned int IO_TIMEOUT_S_ = 5; /* 连接、读、写超时，与阻塞连接池一致 */
+    static const int DEADLINE_MS_ = 10000;    /* 一次连接或查询的总时限，服务端失去响应时重连并以失败回调 */
+    static const size_t MAX_PENDING_ = 16384; /* 排队的查询上限，超过后直接失败 */
+    static constexpr const char *CHARSET_ = "utf8mb4"; /* 连接字符集，转义不依赖已建立的连接 */
+
+    Epoller *epoller_;
+    HeapTimer timer_; /* 按连接序号计时：等待超时、截止时间和重连 */
+    std::string host_;
+    int port_;
+    std::string user_;
+    std::string pwd_;
+    std::string db_;
+
+    std::vector<Conn> conns_;
+    std::unordered_map<int, size_t> fds_; /* socket到连接序号 */
+    std::vector<size_t> idle_;            /* 空闲连接的序号 */
+    std::deque<std::pair<std::string, Callback>> pending_;
+    unsigned int errNo_; /* 正在回调的查询的错误码，成功为0 */
+};
@@ -1,16 +1,28 @@
 #pragma once
 
-#include <queue>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <unordered_map>
 #include <mutex>
 #include <thread>
+#include <condition_variable>
 #include <mysql/mysql.h>
-#include <semaphore.h>
 
+/*
+ * 数据库连接池，连接数在[minConn, maxConn]之间伸缩
+ * 启动时并行建立minConn个连接，不够用时按需新建，空闲过久且多于minConn时关闭；
+ * 取连接有截止时间，超时返回nullptr而不是让工作线程一直阻塞；
+ * 空闲超过PING_IDLE_MS_的连接取出时先ping，断开的连接透明地重连
+ * 线程独占模式下，除初始化连接池的线程(主循环)外，每个线程第一次放回的连接留给该线程专用，
+ * 之后取放都不加锁，预处理语句缓存也一直跟着该线程；同一线程嵌套取连接时才走共享池
+ */
 class SqlConnPool
 {
 public:
     static SqlConnPool *instance();
-    MYSQL *getConn();
+    MYSQL *getConn(int timeoutMs = -1);
     void freeConn(MYSQL *sql);
     int getFreeConnCount();
     void init(const char *host,
@@ -19,15 +31,91 @@ public:
               const char *pwd,
               const char *db,
               size_t connSize);
+    void setLimits(size_t minConn, size_t maxConn, int acquireTimeoutMs);
+    void setThreadAffine(bool isAffine);
     void closePool();
+    std::string report();
+
+    MYSQL_STMT *getStmt(MYSQL *sql, const char *query);
+    void dropStmt(MYSQL *sql, const char *query);
 
 private:
-    SqlConnPool() = default;
+    /*
+     * 每个连接的预处理语句缓存，按SQL文本索引
+     * 语句句柄属于服务端会话，连接的线程id变化说明重连过，旧句柄全部作废
+     */
+    struct StmtCache
+    {
+        unsigned long threadId;
+        std::unordered_map<std::string, MYSQL_STMT *> stmts;
+    };
+
+    /* 空闲连接及其放回的时间 */
+    struct IdleConn
+    {
+        MYSQL *sql;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    /*
+     * 线程独占的连接，节点由连接池持有，线程通过thread_local指针访问
+     * inUse由所属线程取放，关闭连接池时以exchange抢占，抢到后连接归关闭方处理
+     */
+    struct AffineSlot
+    {
+        MYSQL *sql;
+        StmtCache *cache;
+        std::atomic<bool> inUse;
+        std::chrono::steady_clock::time_point since;
+        std::atomic<uint64_t> hits; /* 只由所属线程累加，统计时读取 */
+    };
+
+    SqlConnPool();
     ~SqlConnPool();
 
-    size_t MAX_CONN_;
+    MYSQL *getAffine();
+    bool freeAffine(MYSQL *sql, bool isLost);
+    void closeAffine();
+    MYSQL *connect();
+    void grow(size_t count);
+    void destroy(MYSQL *sql);
+    static void closeStmts(StmtCache &cache);
+
+    static const size_t MIN_CONN_ = 2;            /* 默认的最少连接数 */
+    static const int ACQUIRE_TIMEOUT_MS_ = 1000;  /* 默认的取连接超时 */
+    static const int PING_IDLE_MS_ = 30000;       /* 空闲超过该时间的连接取出时先ping */
+    static const int SHRINK_IDLE_MS_ = 60000;     /* 多于最少连接数时，空闲超过该时间的连接关闭 */
+    static const unsigned int IO_TIMEOUT_S_ = 5;  /* 连接、读、写超时，服务端失去响应时不会无限阻塞 */
+
+    std::string host_;
+    int port_;
+    std::string user_;
+    std::string pwd_;
+    std::string db_;
+    size_t minConn_;
+    size_t maxConn_;
+    int acquireTimeoutMs_;
 
     std::mutex mtx_;
-    sem_t sem_;
-    std::queue<MYSQL *> connQue_;
+    std::condition_variable cond_;
+    std::deque<IdleConn> connQue_; /* 尾部为最近放回的，优先取用，头部的连接逐渐空闲到可以关闭 */
+    size_t total_;                 /* 已建立和正在建立的连接数 */
+    bool isClosed_;
+    std::unordered_map<MYSQL *, StmtCache> stmtCaches_; /* 节点地址稳定，取出后由持有连接的线程独占使用 */
+
+    std::atomic<bool> isAffine_;
+    std::atomic<size_t> affine_;    /* 线程专用的连接数 */
+    std::thread::id ownerThread_;   /* 初始化连接池的线程，不独占连接 */
+    std::deque<AffineSlot> slots_;  /* 在mtx_下追加，节点地址稳定 */
+    static thread_local AffineSlot *slot_;
+
+    /* 统计，report输出后清零 */
+    std::atomic<uint64_t> acquired_;
+    std::atomic<uint64_t> waitUs_;
+    std::atomic<uint64_t> maxWaitUs_;
+    std::atomic<uint64_t> timeouts_;
+    std::atomic<uint64_t> errors_;
+    std::atomic<uint64_t> reconnects_;
+    std::atomic<size_t> peakBusy_;
+    uint64_t lastAffineHits_; /* 上次统计时独占连接的累计取用次数 */
 };
@@ -1,12 +1,22 @@
 #pragma once
 
-#include <queue>
+#include <deque>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <thread>
+#include <vector>
 #include <functional>
 #include <cassert>
+#include <pthread.h>
 
+/*
+ * 线程池，任务队列按CoDel思路统计排队时间(sojourn time)
+ * 一个INTERVAL_内最短的排队时间仍超过TARGET_时判定为过载，过载时改为LIFO出队，
+ * 让新到的请求优先满足时延，同时上层据此拒绝新连接
+ * 过载期间排队超过SHED_MS_的任务不再执行，改为执行提交时给出的丢弃回调(如回复503)
+ */
 class ThreadPool
 {
 
@@ -17,15 +27,32 @@ public:
         /* 创建threadCount个线程，并且线程分离 */
         for (size_t i = 0; i < threadCount; i++)
         {
-            std::thread([=]()
+            std::thread worker([=]()
                         {
                         std::unique_lock<std::mutex> locker(pool_->mtx);
                         while (true)
                         {
                             if (pool_->task.empty() != true)
                             {
-                                auto task = std::move(pool_->task.front());
-                                pool_->task.pop();
+                                taskItem item;
+                                /* 过载时从队尾取任务(LIFO)，但队头已经过期的任务先取出丢弃，否则从队头取 */
+                                if (pool_->isOverload && !this->isStale(pool_->task.front()))
+                                {
+                                    item = std::move(pool_->task.back());
+                                    pool_->task.pop_back();
+                                }
+                                else
+                                {
+                                    item = std::move(pool_->task.front());
+                                    pool_->task.pop_front();
+                                }
+                                this->codel(item.enqueue);
+                                auto task = std::move(item.func);
+                                if (this->isStale(item))
+                                {
+                                    task = std::move(item.shed);
+                                    pool_->shedCount++;
+                                }
                                 locker.unlock();
                                 /* 执行任务*/
                                 task();
@@ -37,11 +64,18 @@ public:
                             }
                             else
                             {
+                                /* 队列排空说明已经消化了积压，退出过载状态 */
+                                pool_->intervalEnd = clock::time_point();
+                                pool_->isOverload = false;
                                 /* 无任务则等待生产者唤醒 */
+                                pool_->idleCount++;
                                 pool_->cond.wait(locker);
+                                pool_->idleCount--;
                             }
-                        } })
-                .detach();
+                        } });
+            /* 保留线程句柄用于绑核，线程在线程池关闭前不会退出 */
+            threads_.push_back(worker.native_handle());
+            worker.detach();
         }
     }
     ~ThreadPool()
@@ -57,17 +91,87 @@ public:
     ThreadPool(ThreadPool &&) = default;
     template <typename F>
     void addTask(F &&task);
+    template <typename F>
+    void addTasks(std::vector<F> &tasks);
+    template <typename F>
+    void addTasks(std::vector<F> &tasks, std::vector<F> &sheds);
+
+    /*
+     * 将工作线程轮流绑定到cpus中的核上，绑核后线程首次访问的内存按默认策略从本地NUMA节点分配
+     */
+    bool setAffinity(const std::vector<int> &cpus)
+    {
+        bool res = true;
+        for (size_t i = 0; i < threads_.size() && cpus.empty() == false; i++)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % cpus.size()], &set);
+            res = pthread_setaffinity_np(threads_[i], sizeof(set), &set) == 0 && res;
+        }
+        return res;
+    }
+
+    /* 工作线程数 */
+    size_t size() const
+    {
+        return threads_.size();
+    }
+
+    /* 线程池是否处于过载状态 */
+    bool isOverload() const
+    {
+        return pool_->isOverload;
+    }
+
+    /* 正在等待任务的线程数，主线程据此决定把就绪连接拆成几批 */
+    size_t idleCount() const
+    {
+        return pool_->idleCount;
+    }
+
+    /* 累计因排队过久被丢弃的任务数 */
+    uint64_t shedCount() const
+    {
+        return pool_->shedCount;
+    }
 
 private:
+    typedef std::chrono::steady_clock clock;
+
+    struct taskItem
+    {
+        std::function<void()> func;
+        std::function<void()> shed; /* 过载时排队过久改为执行的回调，为空则照常执行func */
+        clock::time_point enqueue;  /* 入队时间，用于计算排队时间 */
+    };
+
     struct pool
     {
         std::mutex mtx;
         std::condition_variable cond;
-        std::queue<std::function<void()>> task; // 线程池任务队列
+        std::deque<taskItem> task;      // 线程池任务队列
         bool isClose;
+        clock::time_point intervalEnd;  // 当前统计间隔的结束时间，未开始统计时为零
+        clock::duration minSojourn;     // 当前统计间隔内最短的排队时间
+        std::atomic<bool> isOverload;   // 过载标志，主线程无锁读取
+        std::atomic<uint64_t> shedCount; // 累计丢弃的任务数
+        std::atomic<size_t> idleCount;   // 等待任务的线程数，主线程无锁读取
     };
 
+    /* 头文件中的类，用枚举避免chrono按引用传参时需要静态成员的定义 */
+    enum
+    {
+        TARGET_MS_ = 5,     /* 可接受的排队时间 */
+        INTERVAL_MS_ = 100, /* 统计最短排队时间的间隔 */
+        SHED_MS_ = 100,     /* 过载时排队超过该时间的任务丢弃 */
+    };
+
+    void codel(const clock::time_point &enqueue);
+    bool isStale(const taskItem &item) const;
+
     std::shared_ptr<pool> pool_;
+    std::vector<pthread_t> threads_;
 };
 
 /* 添加任务 */
@@ -76,7 +180,106 @@ void ThreadPool::addTask(F &&task)
 {
     {
         std::lock_guard<std::mutex> locker(pool_->mtx);
-        pool_->task.emplace(task);
+        pool_->task.push_back({std::forward<F>(task), nullptr, clock::now()});
     }
     pool_->cond.notify_one();
+}
+
+/*
+ * 批量添加任务，一次加锁入队，按任务数唤醒工作线程，tasks中的任务被移走
+ */
+template <typename F>
+void ThreadPool::addTasks(std::vector<F> &tasks)
+{
+    if (tasks.empty())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> locker(pool_->mtx);
+        clock::time_point now = clock::now();
+        for (auto &task : tasks)
+        {
+            pool_->task.push_back({std::move(task), nullptr, now});
+        }
+    }
+    if (tasks.size() >= threads_.size())
+    {
+        pool_->cond.notify_all();
+    }
+    else
+    {
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            pool_->cond.notify_one();
+        }
+    }
+    tasks.clear();
+}
+
+/*
+ * 批量添加任务，sheds[i]为tasks[i]在过载时排队过久改为执行的回调，两者被移走
+ */
+template <typename F>
+void ThreadPool::addTasks(std::vector<F> &tasks, std::vector<F> &sheds)
+{
+    assert(tasks.size() == sheds.size());
+    if (tasks.empty())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> locker(pool_->mtx);
+        clock::time_point now = clock::now();
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            pool_->task.push_back({std::move(tasks[i]), std::move(sheds[i]), now});
+        }
+    }
+    if (tasks.size() >= threads_.size())
+    {
+        pool_->cond.notify_all();
+    }
+    else
+    {
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            pool_->cond.notify_one();
+        }
+    }
+    tasks.clear();
+    sheds.clear();
+}
+
+/*
+ * CoDel判定，持锁调用
+ * 记录每个INTERVAL_内最短的排队时间，间隔结束时最短的也超过TARGET_则进入过载，否则恢复正常
+ * 只看单个任务会被LIFO下刚入队的任务误导，过载和正常状态来回切换
+ */
+inline void ThreadPool::codel(const clock::time_point &enqueue)
+{
+    clock::time_point now = clock::now();
+    clock::duration sojourn = now - enqueue;
+    if (pool_->intervalEnd == clock::time_point())
+    {
+        pool_->intervalEnd = now + std::chrono::milliseconds(INTERVAL_MS_);
+        pool_->minSojourn = sojourn;
+        return;
+    }
+    pool_->minSojourn = std::min(pool_->minSojourn, sojourn);
+    if (now >= pool_->intervalEnd)
+    {
+        pool_->isOverload = pool_->minSojourn > std::chrono::milliseconds(TARGET_MS_);
+        pool_->intervalEnd = now + std::chrono::milliseconds(INTERVAL_MS_);
+        pool_->minSojourn = clock::duration::max();
+    }
+}
+
+/*
+ * 过载期间排队超过SHED_MS_且提供了丢弃回调的任务，持锁调用
+ */
+inline bool ThreadPool::isStale(const taskItem &item) const
+{
+    return pool_->isOverload && item.shed &&
+           clock::now() - item.enqueue > std::chrono::milliseconds(SHED_MS_);
 }
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <mysql/mysql.h>
+
+/*
+ * 用户验证缓存，放在数据库前面，同一用户短时间内重复登录注册不必每次查询
+ * 缓存用户名到密码校验值(带随机密钥的SipHash，不保存明文)，也缓存"用户不存在"，
+ * 两者各有过期时间，过期后重新查库；按用户名哈希分片，每片一把锁，分片满时按LRU淘汰
+ * 另有一个全部已注册用户名的布隆过滤器，启动时从数据库加载，
+ * 注册时判定"一定不存在"的用户名可以跳过查询直接插入
+ */
+class UserCache
+{
+public:
+    enum RESULT
+    {
+        UNKNOWN,  /* 未缓存或已过期，需要查库 */
+        ABSENT,   /* 用户不存在 */
+        MATCH,    /* 用户存在且密码一致 */
+        MISMATCH, /* 用户存在但密码不一致 */
+    };
+
+    static UserCache *instance();
+
+    void init(size_t capacity, int ttlS, int negativeTtlS, size_t expectedUsers);
+    bool isOpen() const;
+    RESULT lookup(const std::string &name, const std::string &pwd);
+    void putUser(const std::string &name, const std::string &pwd);
+    void putAbsent(const std::string &name);
+    void erase(const std::string &name);
+    bool mayExist(const std::string &name) const;
+    void addName(const std::string &name);
+    bool loadNames(MYSQL *sql);
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+private:
+    struct Entry
+    {
+        std::string name;
+        bool exists;
+        uint64_t verifier; /* 密码的校验值，用户不存在时为0 */
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    /* 对齐到缓存行，相邻分片的锁不会伪共享 */
+    struct alignas(64) Shard
+    {
+        std::mutex mtx;
+        std::list<Entry> lru; /* 表头为最近使用 */
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    };
+
+    UserCache();
+    ~UserCache() = default;
+
+    void put(const std::string &name, bool exists, uint64_t verifier, int ttlS);
+    Shard &shard(const std::string &name);
+    uint64_t digest(const std::string &data, int keyIdx) const;
+
+    static const size_t SHARD_NUM_ = 16;
+    static const int BLOOM_HASH_NUM_ = 7; /* 每个位数组10倍用户数时误判率约1% */
+    static const size_t BLOOM_BITS_PER_USER_ = 10;
+
+    std::atomic<bool> isOpen_;
+    size_t shardCapacity_;
+    int ttlS_;
+    int negativeTtlS_;
+    uint64_t key_[2][2]; /* 0:密码校验值 1:分片和布隆过滤器 */
+    Shard shards_[SHARD_NUM_];
+
+    /* 布隆过滤器，加载完成前不作判断，之后只增不减 */
+    std::vector<std::atomic<uint64_t>> bloom_;
+    uint64_t bloomBits_;
+    std::atomic<bool> isBloomReady_;
+
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+};
@@ -1,60 +1,212 @@
 #pragma once
 
 #include <unordered_map>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <cassert>
+#include <cstring>
+#include <csignal>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 
 #include <log.h>
 #include <epoller.h>
 #include <httpconn.h>
+#include <filecache.h>
+#include <memgovernor.h>
+#include <accesslog.h>
 #include <heaptimer.h>
 #include <threadpool.hpp>
+#include <mpmcqueue.hpp>
 #include <sqlconnRAII.hpp>
 #include <sqlconnpool.h>
+#include <sqlasync.h>
+#include <usercache.h>
+#include <sessionstore.h>
+
+/*
+ * 服务器运行统计，多进程模式下放在共享内存中由master汇总
+ * 字段均为无锁原子量，可以跨进程读写
+ */
+struct ServerStat
+{
+    std::atomic<int> pid;
+    int slot;                         /* 槽位序号，worker按槽位命名自己的访问日志环形缓冲 */
+    std::atomic<int> connections;     /* 当前连接数 */
+    std::atomic<uint64_t> accepted;   /* 累计接受的连接数 */
+    std::atomic<uint64_t> requests;   /* 累计处理的请求数 */
+    std::atomic<uint64_t> shed;       /* 累计回复503拒绝的连接数 */
+};
 
 class Webserver
 {
 public:
     Webserver(int port, int timeoutMs,
               int sqlPort, const char *sqlUser, const char *sqlPwd, const char *dbName,
-              int connPoolNum, int threadNum, bool openLog, Log::LOG_LEVEL logLevel, int logQueSize);
+              int connPoolNum, int threadNum, bool openLog, Log::LOG_LEVEL logLevel, int logQueSize,
+              int listenFd = -1);
     ~Webserver();
 
     void start();
+    void stop();
+    void setStat(ServerStat *stat);
+    void setZeroCopy(size_t threshold);
+    bool setAffinity(int cpu);
+    void setBusyPoll(int spinUs);
+    void setFileCache(size_t capacity);
+    void setWriteQuantum(size_t bytes);
+    void setReadLimit(size_t highWater, size_t budget);
+    void setMemoryLimit(size_t softLimit, size_t hardLimit);
+    void setLogMode(Log::LOG_MODE mode);
+    void setLogRotate(size_t maxBytes, int periodS, int maxFiles, int maxDays, bool compress);
+    void setLogRateLimit(int perSecond);
+    void setAccessLog(const char *ringPath, const char *textPath, size_t capacity, double sampleRate, double errorSampleRate);
+    void setAsyncSql(int connNum);
+    void setSqlPool(size_t minConn, size_t maxConn, int acquireTimeoutMs, bool isThreadAffine);
+    void setUserCache(size_t capacity, int ttlS, int negativeTtlS, size_t expectedUsers);
+    void setSessions(size_t capacity, int ttlS, const char *snapshotPath);
+    void addWritePolicy(const std::string &prefix, int weight, size_t rate);
+
+    static int listenSocket(int port, int incomingCpu = -1);
+    static std::vector<int> nodeCpus(int cpu);
 
 private:
+    /* 请求处理结束后连接的下一步动作，工作线程通过完成队列交回主线程执行 */
+    enum CONN_ACTION
+    {
+        ACTION_READ,    /* 重新注册EPOLLIN，等待下一个请求 */
+        ACTION_WRITE,   /* 发送缓冲区满，注册EPOLLOUT等待续写 */
+        ACTION_PROCESS, /* 响应已发完，继续处理读缓冲中剩余的请求 */
+        ACTION_THROTTLE, /* 超出限速，等令牌攒够后再注册EPOLLOUT */
+        ACTION_QUERY,   /* 请求需要访问数据库，由主线程交给异步数据库客户端 */
+        ACTION_CLOSE,   /* 关闭连接 */
+    };
+
+    /*
+     * 连接句柄及其动作，派发给工作线程时ACTION_WRITE表示续写、ACTION_PROCESS表示处理请求
+     * gen为派发时连接的代数，交回时不一致说明连接已被关闭复用，丢弃
+     */
+    struct ConnAction
+    {
+        HttpConn *client;
+        uint32_t gen;
+        CONN_ACTION action;
+    };
+
     static int setFdNonBlock(int fd);
 
-    bool initSocket();
+    bool initSocket(int listenFd);
+    int inheritListenFd();
+    bool initUpgradeSocket();
+    void dealUpgrade();
+    void stopListen();
+    void startDrain();
     void initEventMode();
     void addClient(int fd, sockaddr_in addr);
     void dealListen();
+    void dealFdExhausted();
     void dealWrite(HttpConn *client);
     void dealRead(HttpConn *client);
     void sendError(int fd, const char *info);
     void extentTime(HttpConn *client);
     void closeConn(HttpConn *client);
-    void onRead(HttpConn *client);
-    void onWrite(HttpConn *client);
-    void onProcess(HttpConn *client);
+    void onTimeout(HttpConn *client, uint32_t gen);
+    void onThrottle(HttpConn *client, uint32_t gen);
+    void submit(HttpConn *client, CONN_ACTION action);
+    void onBatch(std::vector<ConnAction> &batch);
+    void onShed(std::vector<ConnAction> &batch);
+    CONN_ACTION doWrite(HttpConn *client);
+    CONN_ACTION doProcess(HttpConn *client);
+    void dispatch(HttpConn *client);
+    void applyAction(HttpConn *client, CONN_ACTION action);
+    void startQuery(HttpConn *client);
+    void onQueryDone(HttpConn *client, uint32_t gen, bool isVerified, int64_t upstreamUs);
+    void postActions(std::vector<ConnAction> &done);
+    void dealComplete();
+    void flushPending();
+    void markIdle(int fd);
+    void unmarkIdle(int fd);
+    bool evictIdle();
+    void checkMemory();
+    void recordLatency(int64_t us);
+    void reportStats();
 
     int port_;
     int timeoutMs_;
     int listenFd_;
+    int reserveFd_;
+    int upgradeFd_;  /* 热升级用的unix监听socket，新进程连上来取走监听fd */
+    int stopFd_;     /* 信号处理函数通过eventfd通知主循环优雅退出 */
+    int completeFd_; /* 工作线程放入完成队列后通过eventfd唤醒主循环 */
     volatile bool isClose_;
+    std::atomic<bool> isDraining_; /* 已停止accept，等待存量连接处理完 */
+    std::chrono::steady_clock::time_point drainDeadline_;
+    ServerStat *stat_;
+    int busyPollUs_; /* 连接socket的SO_BUSY_POLL，0为不设置 */
+
+    /* 请求时延直方图，第i个桶统计[2^i, 2^(i+1))微秒，工作线程写，主线程定期汇总 */
+    std::atomic<uint64_t> latency_[32];
+    std::chrono::steady_clock::time_point nextReport_;
+    std::chrono::steady_clock::time_point nextReclaim_; /* 内存紧张时两次回收之间的最小间隔 */
+    std::chrono::steady_clock::time_point nextSweep_;   /* 下一次清理过期会话的时间 */
+    std::string sessionSnapshot_;                       /* 退出时写入会话快照的路径，空为不写 */
+    struct rusage lastUsage_;
     char *srcDir_;
     uint32_t listenEvent_;
     uint32_t connEvent_;
 
     std::unique_ptr<HeapTimer> timer_;
+    std::unique_ptr<HeapTimer> throttle_; /* 被限速或暂停读的连接，到期后重新注册事件 */
     std::unique_ptr<ThreadPool> threadPool_;
     std::unique_ptr<Epoller> epoller_;
     std::unordered_map<int, HttpConn> users_;
 
+    /* 异步数据库客户端，socket注册在epoller_上，只在主线程使用；未开启时登录注册走阻塞连接池 */
+    std::unique_ptr<SqlAsync> sqlAsync_;
+    int sqlPort_;
+    std::string sqlUser_;
+    std::string sqlPwd_;
+    std::string dbName_;
+
+    /* 工作线程处理完的连接，由主线程统一重新注册或关闭 */
+    MpmcQueue<ConnAction> completions_;
+    std::atomic<bool> isCompleteNotified_; /* 已写eventfd、主线程还没取队列，期间放入的结果不必再写 */
+
+    /* 本轮epoll_wait中要交给工作线程的连接，处理完所有就绪事件后分批提交 */
+    std::vector<ConnAction> pending_;
+    uint64_t batchTasks_; /* 统计周期内派发的连接数 */
+    uint64_t batches_;    /* 统计周期内提交的批次数 */
+
+    /* 空闲长连接的LRU链表，表头最久未活动，只在主线程访问 */
+    std::list<int> idleList_;
+    std::unordered_map<int, std::list<int>::iterator> idleRef_;
+    int maxConn_;       /* 受MAX_FD_CNT_和RLIMIT_NOFILE共同限制的连接上限 */
+    int idleWatermark_; /* 连接数超过该水位后开始淘汰最久的空闲长连接 */
+
     static const size_t MAX_FD_CNT_ = 65536;
+    static const int RETRY_AFTER_S_ = 1;
+    static const int FD_RESERVED_ = 64;      /* 留给监听、日志、数据库等的fd */
+    static const int IDLE_WATERMARK_ = 90;   /* 空闲连接淘汰水位，连接上限的百分比 */
+    static const int DRAIN_TIMEOUT_MS_ = 30000; /* 优雅退出时等待存量连接的最长时间 */
+    static const int REPORT_INTERVAL_S_ = 10;   /* 运行统计输出间隔 */
+    static const size_t COMPLETE_BATCH_ = 256;  /* 主线程每次从完成队列批量取出的个数 */
+    static const size_t BATCH_MIN_ = 8;         /* 空闲线程不足时每批至少的连接数 */
+    static const int READ_RETRY_MS_ = 10;       /* 接收预算用完时，暂停读的连接隔多久重试 */
+    static const int RECLAIM_INTERVAL_MS_ = 100; /* 内存紧张时回收的最小间隔 */
+    static const int SESSION_SWEEP_S_ = 10;     /* 清理过期会话的间隔 */
+    static const int MEM_SOFT_PERCENT_ = 50;    /* 未指定内存上限时，软上限取cgroup上限的百分比 */
+    static const int MEM_HARD_PERCENT_ = 75;    /* 未指定内存上限时，硬上限取cgroup上限的百分比 */
+    static const int MPOL_LOCAL_ = 4;           /* set_mempolicy的本地节点策略，与<numaif.h>中的MPOL_LOCAL相同 */
 };
\ No newline at end of file
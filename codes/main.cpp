@@ -1,19 +1,68 @@
 #include <webserver.h>
+#include <master.h>
 #include <signal.h>
 
 typedef void (*sighandler_t)(int);
 
+static const int PORT = 1316;
+static Webserver *g_server = nullptr;
+
+/*
+ * 收到SIGINT/SIGTERM后停止accept，处理完存量连接再退出
+ */
 void myexit(int s)
 {
-    exit(0);
+    if (g_server == nullptr)
+    {
+        exit(0);
+    }
+    g_server->stop();
 }
 
-int main()
+/*
+ * 运行一个服务器实例，listenFd为-1时自己监听端口，否则使用master传入的监听socket
+ * cpu不为-1时事件循环绑定到该核，线程池绑定到该核所在的NUMA节点
+ */
+void runServer(int listenFd, ServerStat *stat, int cpu)
 {
     signal(SIGINT, myexit);
+    signal(SIGTERM, myexit);
     Webserver server(
-        1316, 60000,                                          /* 端口 timeoutMs  */
+        PORT, 60000,                                          /* 端口 timeoutMs  */
         3306, "debian-sys-maint", "Xs2MbM94SgMsraFP", "mydb", /* Mysql配置 */
-        12, 12, true, Log::DEBUG, 0);                      /* 连接池数量 线程池数量 日志开关 日志等级 日志异步队列容量 */
+        12, 12, true, Log::DEBUG, 0,                       /* 连接池数量 线程池数量 日志开关 日志等级 日志异步队列容量 */
+        listenFd);
+    g_server = &server;
+    server.setStat(stat);
+    server.setAffinity(cpu);
+    server.setZeroCopy(0);                                    /* 零拷贝发送阈值(字节)，0为关闭 */
+    server.setBusyPoll(0);                                    /* 忙等窗口上限(微秒)，0为关闭 */
+    server.setFileCache(16 * 1024 * 1024);                    /* 小文件缓存容量(字节)，0为关闭 */
+    server.setWriteQuantum(256 * 1024);                       /* 每轮发送配额(字节)，0为不限 */
+    server.setReadLimit(64 * 1024, 64 * 1024 * 1024);         /* 单连接读缓冲上限 全部连接读缓冲上限(字节) */
+    server.setMemoryLimit(0, 0);                              /* 内存软上限 硬上限(字节)，0按cgroup上限取比例 */
+    server.setLogMode(Log::MODE_TEXT);                        /* 日志格式化方式，异步日志下可选延迟格式化或二进制 */
+    server.setLogRotate(64 * 1024 * 1024, 86400, 30, 7, true); /* 日志切换大小 周期(秒) 保留文件数 保留天数 是否压缩 */
+    server.setLogRateLimit(100);                              /* 每个日志调用点每秒最多输出的条数，0为不限 */
+    server.setSqlPool(4, 16, 500, true);                      /* 数据库连接池最少 最多连接数 取连接超时(毫秒) 工作线程独占连接 */
+    server.setUserCache(65536, 300, 30, 1000000);             /* 用户缓存条目数 有效期 不存在用户的有效期(秒) 预计用户数(布隆过滤器) */
+    server.setSessions(65536, 1800, "./log/sessions.snapshot"); /* 会话数上限 空闲有效期(秒) 快照文件，空为不写 */
+    server.setAsyncSql(4);                                    /* 异步数据库连接数，0为关闭，登录注册在工作线程中阻塞查询 */
+    server.setAccessLog("/dev/shm/webserver_access", "", 16384, 1.0, 1.0); /* 访问日志共享内存 文本文件(空为不写) 记录条数 采样率 出错请求采样率 */
+    server.addWritePolicy("/video/", 1, 0);                   /* 路径前缀 发送权重 限速(字节/秒，0为不限) */
     server.start();
+    g_server = nullptr;
+}
+
+int main()
+{
+    const int workerNum = 0;    /* 多进程模式的worker进程数，0为单进程模式 */
+    const bool bindCpu = false; /* 多进程模式下每个worker绑定一个核，并按SO_INCOMING_CPU分配连接 */
+    const int serverCpu = -1;   /* 单进程模式下事件循环绑定的核，-1为不绑核 */
+    if (workerNum > 0)
+    {
+        Master master(PORT, workerNum, runServer, bindCpu);
+        return master.run();
+    }
+    runServer(-1, nullptr, serverCpu);
 }
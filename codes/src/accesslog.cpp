@@ -0,0 +1,396 @@
+#include <accesslog.h>
+#include <memgovernor.h>
+
+#include <ctime>
+#include <cerrno>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+const uint32_t AccessLog::VERSION_;
+const size_t AccessLog::HEADER_SIZE_;
+const int AccessLog::FLUSH_INTERVAL_MS_;
+const int AccessLog::STALL_MS_;
+const size_t AccessLog::TEXT_BUFF_SIZE_;
+const uint16_t AccessRecord::FLAG_TRUNCATED;
+const char AccessLog::MAGIC_[8] = {'W', 'S', 'A', 'C', 'L', 'O', 'G', '1'};
+
+static_assert(sizeof(AccessRecord) == 256, "AccessRecord layout is shared with external readers");
+static_assert(sizeof(AccessRingHeader) == 128, "AccessRingHeader layout is shared with external readers");
+
+/*
+ * 私有化构造函数，单例模式，init之前append直接返回
+ */
+AccessLog::AccessLog() : header_(nullptr), records_(nullptr), mapSize_(0), isUnlinkOnExit_(false), mask_(0),
+                         sampleThreshold_(0), errorThreshold_(0), sampleAll_(false), errorAll_(false),
+                         isOpen_(false), fd_(-1), tail_(0), stallTail_(UINT64_MAX), lost_(0), isStop_(false), thread_(nullptr)
+{
+}
+
+/*
+ * 停止后台线程，写出剩余记录，解除映射
+ */
+AccessLog::~AccessLog()
+{
+    isOpen_ = false;
+    if (thread_ != nullptr && thread_->joinable())
+    {
+        {
+            std::lock_guard<std::mutex> locker(mtx_);
+            isStop_ = true;
+        }
+        cond_.notify_one();
+        thread_->join();
+    }
+    if (fd_ >= 0)
+    {
+        close(fd_);
+    }
+    if (header_ != nullptr)
+    {
+        munmap(header_, mapSize_);
+        MemoryGovernor::instance()->sub(MemoryGovernor::LOG_QUEUE, mapSize_);
+    }
+    if (isUnlinkOnExit_ && ringPath_.empty() == false)
+    {
+        unlink(ringPath_.data());
+    }
+}
+
+/*
+ * 单例模式，获取访问日志实例
+ */
+AccessLog *AccessLog::instance()
+{
+    static AccessLog accessLog;
+    return &accessLog;
+}
+
+/*
+ * 采样率换算为随机数阈值，1及以上全部记录
+ */
+static uint64_t sampleThreshold(double rate, bool &all)
+{
+    all = rate >= 1.0;
+    if (all || rate <= 0)
+    {
+        return 0;
+    }
+    return static_cast<uint64_t>(rate * 18446744073709551616.0);
+}
+
+/*
+ * 初始化访问日志
+ * ringPath 环形缓冲映射的文件，如/dev/shm/webserver_access，为空时使用匿名内存，只供文本模式读取
+ * textPath 文本日志文件，为空时不写文本
+ * capacity 环形缓冲的记录条数，向上取2的幂
+ * sampleRate/errorSampleRate 正常请求和出错请求(状态码不小于400)的采样率
+ */
+bool AccessLog::init(const char *ringPath, const char *textPath, size_t capacity, double sampleRate, double errorSampleRate)
+{
+    if (header_ != nullptr)
+    {
+        return false;
+    }
+    size_t cap = 64;
+    while (cap < capacity)
+    {
+        cap <<= 1;
+    }
+    size_t mapSize = HEADER_SIZE_ + cap * sizeof(AccessRecord);
+
+    void *addr = MAP_FAILED;
+    if (ringPath != nullptr && *ringPath != '\0')
+    {
+        /* 截断重建，旧的记录和头部都作废；文件已存在时权限沿用旧值，重新设置 */
+        int fd = open(ringPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, FILE_MODE_);
+        if (fd < 0)
+        {
+            return false;
+        }
+        if (fchmod(fd, FILE_MODE_) == 0 && ftruncate(fd, static_cast<off_t>(mapSize)) == 0)
+        {
+            addr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    else
+    {
+        addr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (addr == MAP_FAILED)
+    {
+        return false;
+    }
+
+    if (textPath != nullptr && *textPath != '\0')
+    {
+        fd_ = open(textPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, FILE_MODE_);
+        if (fd_ < 0)
+        {
+            munmap(addr, mapSize);
+            return false;
+        }
+    }
+
+    header_ = static_cast<AccessRingHeader *>(addr);
+    ringPath_ = ringPath != nullptr ? ringPath : "";
+    records_ = reinterpret_cast<AccessRecord *>(static_cast<char *>(addr) + HEADER_SIZE_);
+    mapSize_ = mapSize;
+    mask_ = cap - 1;
+    sampleThreshold_ = sampleThreshold(sampleRate, sampleAll_);
+    errorThreshold_ = sampleThreshold(errorSampleRate, errorAll_);
+    MemoryGovernor::instance()->add(MemoryGovernor::LOG_QUEUE, mapSize_);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header_->version = VERSION_;
+    header_->recordSize = sizeof(AccessRecord);
+    header_->capacity = cap;
+    header_->startNs = static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    header_->head.store(0, std::memory_order_relaxed);
+    header_->sampledOut.store(0, std::memory_order_relaxed);
+    /* magic最后写入，采集程序看到magic后头部其他字段都已就绪 */
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header_->magic, MAGIC_, sizeof(MAGIC_));
+
+    tail_ = 0;
+    isOpen_ = true;
+    if (fd_ >= 0)
+    {
+        std::unique_ptr<std::thread> thread_ptr(new std::thread([]()
+                                                                { AccessLog::instance()->textWrite(); }));
+        thread_ = std::move(thread_ptr);
+    }
+    return true;
+}
+
+bool AccessLog::isOpen() const
+{
+    return isOpen_.load(std::memory_order_relaxed);
+}
+
+/*
+ * 进程正常退出时删除环形缓冲文件，用于多进程模式下worker各自的文件，
+ * 异常退出留下的文件由拉起到同一槽位的worker截断复用
+ */
+void AccessLog::unlinkOnExit()
+{
+    isUnlinkOnExit_ = true;
+}
+
+/*
+ * 来不及写入文本文件就被覆盖的记录数
+ */
+uint64_t AccessLog::lost() const
+{
+    return lost_.load(std::memory_order_relaxed);
+}
+
+/*
+ * 按状态码对应的采样率决定是否记录，随机数为线程局部的xorshift，不需要同步
+ */
+bool AccessLog::sample(int status)
+{
+    bool isError = status >= 400;
+    if (isError ? errorAll_ : sampleAll_)
+    {
+        return true;
+    }
+    static thread_local uint64_t state = 0;
+    if (state == 0)
+    {
+        state = (reinterpret_cast<uintptr_t>(&state) ^ static_cast<uint64_t>(clock())) | 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL < (isError ? errorThreshold_ : sampleThreshold_);
+}
+
+/*
+ * 记录一个已完成的请求，工作线程和主线程都会调用
+ * 先把槽位的seq置为奇数，写完字段后置为2 * 序号 + 2，读者前后两次读到相同的完整seq才采用该记录
+ */
+void AccessLog::append(const std::string &method, const std::string &path, int status, size_t bytes,
+                       int64_t latencyUs, int64_t upstreamUs, const sockaddr_in &addr)
+{
+    if (isOpen_.load(std::memory_order_relaxed) == false)
+    {
+        return;
+    }
+    if (this->sample(status) == false)
+    {
+        header_->sampledOut.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t n = header_->head.fetch_add(1, std::memory_order_relaxed);
+    AccessRecord *record = &records_[n & mask_];
+    record->seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    record->timeNs = static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    record->bytes = bytes;
+    record->latencyUs = latencyUs < 0 ? 0 : static_cast<uint32_t>(std::min<int64_t>(latencyUs, UINT32_MAX));
+    record->upstreamUs = upstreamUs < 0 ? 0 : static_cast<uint32_t>(std::min<int64_t>(upstreamUs, UINT32_MAX));
+    record->addr = addr.sin_addr.s_addr;
+    record->port = ntohs(addr.sin_port);
+    record->status = static_cast<uint16_t>(status);
+    memset(record->method, 0, sizeof(record->method));
+    memcpy(record->method, method.data(), std::min(method.size(), sizeof(record->method)));
+    size_t pathLen = std::min(path.size(), sizeof(record->path));
+    memcpy(record->path, path.data(), pathLen);
+    record->pathLen = static_cast<uint16_t>(pathLen);
+    record->flags = path.size() > pathLen ? AccessRecord::FLAG_TRUNCATED : 0;
+
+    record->seq.store(2 * n + 2, std::memory_order_release);
+}
+
+/*
+ * 文本模式的后台线程，定期读取环形缓冲写入文件，退出前写完剩余记录
+ */
+void AccessLog::textWrite()
+{
+    std::string out;
+    out.reserve(TEXT_BUFF_SIZE_);
+    while (true)
+    {
+        bool isStop = false;
+        {
+            std::unique_lock<std::mutex> locker(mtx_);
+            cond_.wait_for(locker, std::chrono::milliseconds(FLUSH_INTERVAL_MS_), [this]()
+                           { return isStop_; });
+            isStop = isStop_;
+        }
+        /* 一轮读不完时接着读，每攒够TEXT_BUFF_SIZE_写一次 */
+        while (this->drain(out) > 0)
+        {
+        }
+        if (isStop)
+        {
+            break;
+        }
+    }
+}
+
+/*
+ * 读取新完成的记录并格式化追加到out，攒够后写入文件，返回本轮读到的记录数
+ * 被写入方追上覆盖的记录、长时间没有写完的槽位计入lost_
+ */
+size_t AccessLog::drain(std::string &out)
+{
+    uint64_t cap = mask_ + 1;
+    uint64_t head = header_->head.load(std::memory_order_acquire);
+    if (head - tail_ > cap)
+    {
+        lost_.fetch_add(head - cap - tail_, std::memory_order_relaxed);
+        tail_ = head - cap;
+    }
+
+    size_t count = 0;
+    time_t lastSec = 0;
+    char timeStr[32] = {0};
+    char line[512];
+    while (tail_ < head && out.size() < TEXT_BUFF_SIZE_)
+    {
+        const AccessRecord *record = &records_[tail_ & mask_];
+        uint64_t expect = 2 * tail_ + 2;
+        uint64_t seq = record->seq.load(std::memory_order_acquire);
+        if (seq < expect)
+        {
+            /*
+             * 槽位已分配但还没写完(仍是上一圈的seq，或本圈的奇数seq)，通常下一轮就能读到；
+             * 写入方在分配序号后被长时间挂起时，超过STALL_MS_按丢失跳过，不让之后的记录一直等待
+             */
+            auto now = std::chrono::steady_clock::now();
+            if (stallTail_ != tail_)
+            {
+                stallTail_ = tail_;
+                stallTime_ = now;
+                break;
+            }
+            if (now - stallTime_ < std::chrono::milliseconds(STALL_MS_))
+            {
+                break;
+            }
+            lost_.fetch_add(1, std::memory_order_relaxed);
+            tail_++;
+            continue;
+        }
+        int64_t timeNs = record->timeNs;
+        uint64_t bytes = record->bytes;
+        uint32_t latencyUs = record->latencyUs;
+        uint32_t upstreamUs = record->upstreamUs;
+        uint32_t addr = record->addr;
+        uint16_t port = record->port;
+        uint16_t status = record->status;
+        char method[sizeof(record->method) + 1] = {0};
+        memcpy(method, record->method, sizeof(record->method));
+        char path[sizeof(record->path)];
+        size_t pathLen = std::min<size_t>(record->pathLen, sizeof(path));
+        memcpy(path, record->path, pathLen);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq != expect || record->seq.load(std::memory_order_relaxed) != seq)
+        {
+            lost_.fetch_add(1, std::memory_order_relaxed);
+            tail_++;
+            continue;
+        }
+        tail_++;
+        count++;
+
+        time_t sec = static_cast<time_t>(timeNs / 1000000000);
+        if (sec != lastSec)
+        {
+            struct tm systime;
+            localtime_r(&sec, &systime);
+            strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", &systime);
+            lastSec = sec;
+        }
+        char ip[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        int n = snprintf(line, sizeof(line), "%s:%u [%s.%06ld] \"%s %.*s\" %u %lu %uus %uus\n",
+                         ip, port, timeStr, static_cast<long>(timeNs % 1000000000 / 1000),
+                         method, static_cast<int>(pathLen), path, status,
+                         static_cast<unsigned long>(bytes), latencyUs, upstreamUs);
+        if (n > 0)
+        {
+            out.append(line, std::min(static_cast<size_t>(n), sizeof(line) - 1));
+        }
+    }
+    if (out.size() >= TEXT_BUFF_SIZE_ || (count == 0 && !out.empty()))
+    {
+        this->writeFile(out);
+        out.clear();
+    }
+    return count;
+}
+
+/*
+ * 写入文本日志文件
+ */
+void AccessLog::writeFile(const std::string &out)
+{
+    size_t off = 0;
+    while (off < out.size())
+    {
+        ssize_t len = ::write(fd_, out.data() + off, out.size() - off);
+        if (len <= 0)
+        {
+            if (len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        off += static_cast<size_t>(len);
+    }
+}
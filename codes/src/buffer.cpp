@@ -179,20 +179,41 @@ void Buffer::makeSpace(size_t len)
 }
 
 /*
- * 从socket中读取数据存入到buff
+ * 缓冲区实际占用的字节数
  */
-ssize_t Buffer::readFd(int fd, int *retError)
+size_t Buffer::capacity() const
+{
+    return buffer_.capacity();
+}
+
+/*
+ * 缓冲区为空时释放多余空间，缩回size字节
+ */
+void Buffer::shrink(size_t size)
+{
+    if (this->readableBytes() == 0 && buffer_.capacity() > size)
+    {
+        std::vector<char>(size).swap(buffer_);
+        readPos_ = 0;
+        writePos_ = 0;
+    }
+}
+
+/*
+ * 从socket中读取最多maxLen字节数据存入到buff
+ */
+ssize_t Buffer::readFd(int fd, int *retError, size_t maxLen)
 {
     /* 聚集读，尽量一次读完http请求报文，减少性能损耗 */
     char buff[1024 * 128];
     struct iovec iov[2] = {0};
 
-    size_t writable = this->writableBytes();
+    size_t writable = std::min(this->writableBytes(), maxLen);
     /* iov[0]指向vector iov[1]指向char buff */
     iov[0].iov_base = this->beginPtr() + writePos_;
     iov[0].iov_len = writable;
     iov[1].iov_base = buff;
-    iov[1].iov_len = sizeof(buff);
+    iov[1].iov_len = std::min(sizeof(buff), maxLen - writable);
 
     /* ET模式下，无数据可读数据返回-1，errno = EAGAIN */
     const ssize_t len = readv(fd, iov, sizeof(iov) / sizeof(struct iovec));
@@ -206,7 +227,7 @@ ssize_t Buffer::readFd(int fd, int *retError)
     }
     else
     {
-        writePos_ = buffer_.size();
+        writePos_ += writable;
         append(buff, len - writable);
     }
     return len;
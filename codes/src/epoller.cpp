@@ -1,9 +1,12 @@
 #include <epoller.h>
 
+#include <algorithm>
+
 /*
  * 初始化 epollfd 和 events
  */
-Epoller::Epoller(int maxEvent) : epollFd_(epoll_create(512)), events_(maxEvent)
+Epoller::Epoller(int maxEvent) : epollFd_(epoll_create(512)), events_(maxEvent),
+                                 spinMaxUs_(0), gapUs_(0), spinUs_(0), hits_(0), misses_(0)
 {
     assert(epollFd_ >= 0 && events_.size() > 0);
 }
@@ -17,13 +20,13 @@ Epoller::~Epoller()
 }
 
 /*
- * 向 epoll 树上添加一个 fd 和事件
+ * 向 epoll 树上添加一个 fd 和事件，tag随事件带回
  */
-bool Epoller::addFd(int fd, uint32_t events)
+bool Epoller::addFd(int fd, uint32_t events, uint32_t tag)
 {
     assert(fd >= 0);
     struct epoll_event ev = {0};
-    ev.data.fd = fd;
+    ev.data.u64 = static_cast<uint32_t>(fd) | static_cast<uint64_t>(tag) << 32;
     ev.events = events;
 
     if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) == 0)
@@ -33,13 +36,13 @@ bool Epoller::addFd(int fd, uint32_t events)
 }
 
 /*
- * 向 epoll 树上修改一个 fd 和事件
+ * 向 epoll 树上修改一个 fd 和事件，tag随事件带回
  */
-bool Epoller::modFd(int fd, uint32_t events)
+bool Epoller::modFd(int fd, uint32_t events, uint32_t tag)
 {
     assert(fd >= 0);
     struct epoll_event ev = {0};
-    ev.data.fd = fd;
+    ev.data.u64 = static_cast<uint32_t>(fd) | static_cast<uint64_t>(tag) << 32;
     ev.events = events;
     if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev) == 0)
         return true;
@@ -62,11 +65,70 @@ bool Epoller::delFd(int fd)
 }
 
 /*
- * 封装wait
+ * 封装wait，开启忙等时先在窗口内非阻塞轮询，窗口内没有事件再阻塞等待
  */
 int Epoller::wait(int timeoutMs)
 {
-    return epoll_wait(epollFd_, &*events_.begin(), static_cast<int>(events_.size()), timeoutMs);
+    typedef std::chrono::steady_clock clock;
+    if (spinMaxUs_ <= 0 || timeoutMs == 0)
+    {
+        return epoll_wait(epollFd_, &*events_.begin(), static_cast<int>(events_.size()), timeoutMs);
+    }
+
+    clock::time_point start = clock::now();
+    int64_t windowUs = gapUs_ * 2 < spinMaxUs_ ? static_cast<int64_t>(gapUs_ * 2) : 0;
+    if (timeoutMs > 0 && windowUs > timeoutMs * 1000)
+    {
+        windowUs = timeoutMs * 1000;
+    }
+    int count = 0;
+    int64_t elapsedUs = 0;
+    do
+    {
+        count = epoll_wait(epollFd_, &*events_.begin(), static_cast<int>(events_.size()), 0);
+        elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+    } while (count == 0 && elapsedUs < windowUs);
+    spinUs_ += elapsedUs;
+
+    if (count != 0)
+    {
+        hits_++;
+    }
+    else
+    {
+        if (windowUs > 0)
+        {
+            misses_++;
+        }
+        /* 窗口内没有事件，扣除已经忙等的时间后阻塞等待 */
+        int remainMs = timeoutMs < 0 ? -1 : std::max<int>(timeoutMs - static_cast<int>(elapsedUs / 1000), 0);
+        count = epoll_wait(epollFd_, &*events_.begin(), static_cast<int>(events_.size()), remainMs);
+        elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+    }
+    /* 只用真正等到事件的间隔更新滑动平均，超时返回不代表到达率 */
+    if (count > 0)
+    {
+        gapUs_ = gapUs_ * 0.875 + elapsedUs * 0.125;
+    }
+    return count;
+}
+
+/*
+ * 设置忙等窗口上限(微秒)，0为关闭忙等
+ */
+void Epoller::setBusyPoll(int maxSpinUs)
+{
+    spinMaxUs_ = maxSpinUs;
+}
+
+/*
+ * 获取忙等统计：忙等总耗时(微秒)、命中次数、落空次数
+ */
+void Epoller::getSpinStat(uint64_t &spinUs, uint64_t &hits, uint64_t &misses)
+{
+    spinUs = spinUs_;
+    hits = hits_;
+    misses = misses_;
 }
 
 /*
@@ -75,7 +137,16 @@ int Epoller::wait(int timeoutMs)
 int Epoller::getEventFd(size_t i) const
 {
     assert(i < events_.size() && i >= 0);
-    return events_.at(i).data.fd;
+    return static_cast<int>(events_.at(i).data.u64 & 0xffffffff);
+}
+
+/*
+ * 按下标获取注册时的标签
+ */
+uint32_t Epoller::getEventTag(size_t i) const
+{
+    assert(i < events_.size() && i >= 0);
+    return static_cast<uint32_t>(events_.at(i).data.u64 >> 32);
 }
 
 /*
@@ -0,0 +1,169 @@
+#include <filecache.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+const int FileCache::REVALIDATE_MS_;
+
+/*
+ * 私有化构造函数，单例模式，默认容量为0即不缓存
+ */
+FileCache::FileCache() : capacity_(0), size_(0)
+{
+}
+
+/*
+ * 单例模式，获取缓存实例
+ */
+FileCache *FileCache::instance()
+{
+    static FileCache cache;
+    return &cache;
+}
+
+/*
+ * 设置缓存容量(字节)，0为关闭缓存
+ */
+void FileCache::init(size_t capacity)
+{
+    std::lock_guard<std::mutex> locker(mtx_);
+    capacity_ = capacity;
+    this->evict();
+}
+
+/*
+ * 查询缓存，命中返回文件内容并填充文件信息，未命中返回nullptr
+ * 距上次核对超过REVALIDATE_MS_时重新stat，修改时间或大小变化则淘汰
+ */
+FileCache::Content FileCache::get(const std::string &path, struct stat *st)
+{
+    std::lock_guard<std::mutex> locker(mtx_);
+    auto it = index_.find(path);
+    if (it == index_.end())
+    {
+        return nullptr;
+    }
+    auto entry = it->second;
+    auto now = std::chrono::steady_clock::now();
+    if (now - entry->checked >= std::chrono::milliseconds(REVALIDATE_MS_))
+    {
+        struct stat cur;
+        if (stat(path.data(), &cur) < 0 || cur.st_mtime != entry->st.st_mtime ||
+            cur.st_size != entry->st.st_size || !(cur.st_mode & S_IROTH))
+        {
+            size_ -= entry->content->size();
+            MemoryGovernor::instance()->sub(MemoryGovernor::FILE_CACHE, entry->content->size());
+            index_.erase(it);
+            lru_.erase(entry);
+            return nullptr;
+        }
+        entry->checked = now;
+    }
+    /* 移到表头 */
+    lru_.splice(lru_.begin(), lru_, entry);
+    if (st != nullptr)
+    {
+        *st = entry->st;
+    }
+    return entry->content;
+}
+
+/*
+ * 读入文件并放入缓存，文件过大、缓存关闭或读取失败返回nullptr
+ */
+FileCache::Content FileCache::load(const std::string &path, const struct stat &st)
+{
+    size_t len = static_cast<size_t>(st.st_size);
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        if (len > MAX_FILE_SIZE_ || len > capacity_)
+        {
+            return nullptr;
+        }
+    }
+    int fd = open(path.data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    std::shared_ptr<std::string> content = std::make_shared<std::string>(len, '\0');
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = read(fd, &(*content)[done], len - done);
+        if (n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    /* 读取期间文件被截断，不缓存 */
+    if (done != len)
+    {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> locker(mtx_);
+    auto it = index_.find(path);
+    if (it != index_.end())
+    {
+        /* 其他线程已经放入，替换为最新内容 */
+        size_ -= it->second->content->size();
+        MemoryGovernor::instance()->sub(MemoryGovernor::FILE_CACHE, it->second->content->size());
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+    lru_.push_front({path, content, st, std::chrono::steady_clock::now()});
+    index_[path] = lru_.begin();
+    size_ += len;
+    MemoryGovernor::instance()->add(MemoryGovernor::FILE_CACHE, len);
+    this->evict();
+    return content;
+}
+
+/*
+ * 缓存占用的总字节数
+ */
+size_t FileCache::size()
+{
+    std::lock_guard<std::mutex> locker(mtx_);
+    return size_;
+}
+
+/*
+ * 内存紧张时从表尾淘汰至少bytes字节，返回实际释放的字节数
+ */
+size_t FileCache::shrink(size_t bytes)
+{
+    std::lock_guard<std::mutex> locker(mtx_);
+    size_t before = size_;
+    while (before - size_ < bytes && !lru_.empty())
+    {
+        this->removeBack();
+    }
+    return before - size_;
+}
+
+/*
+ * 从表尾淘汰直到不超过容量，调用者持有锁
+ * 正在发送中的响应持有shared_ptr，淘汰不会影响它们
+ */
+void FileCache::evict()
+{
+    while (size_ > capacity_ && !lru_.empty())
+    {
+        this->removeBack();
+    }
+}
+
+/*
+ * 淘汰表尾一项，调用者持有锁
+ */
+void FileCache::removeBack()
+{
+    size_ -= lru_.back().content->size();
+    MemoryGovernor::instance()->sub(MemoryGovernor::FILE_CACHE, lru_.back().content->size());
+    index_.erase(lru_.back().path);
+    lru_.pop_back();
+}
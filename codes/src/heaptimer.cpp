@@ -26,11 +26,11 @@ HeapTimer::~HeapTimer()
 void HeapTimer::siftParent(size_t i)
 {
     assert(i >= 0 && i < heap_.size());
-    /* j为i节点的父节点 */
-    size_t j = (i - 1) / 2;
-    LOG_DEBUG("i == %d, j == %d", i, j);
-    while (j >= 0)
+    /* 下标无符号，到根节点为止，不能用 j >= 0 判断 */
+    while (i > 0)
     {
+        /* j为i节点的父节点 */
+        size_t j = (i - 1) / 2;
         if (heap_[j] < heap_[i])
         {
             break;
@@ -38,8 +38,6 @@ void HeapTimer::siftParent(size_t i)
         this->swapNode(i, j);
         /* 更新当前节点的下标 */
         i = j;
-        /* 选择新的父节点进行比较 */
-        j = (i - 1) / 2;
     }
 }
 
@@ -122,6 +120,18 @@ void HeapTimer::add(int fd, int timeout, const std::function<void()> &cb)
     }
 }
 
+/*
+ * 取消指定文件描述符的定时器，不调用回调，没有定时器时什么都不做
+ */
+void HeapTimer::cancel(int fd)
+{
+    auto it = ref_.find(fd);
+    if (it != ref_.end())
+    {
+        this->del(it->second);
+    }
+}
+
 /*
  * 删除指定节点
  */
@@ -177,9 +187,9 @@ void HeapTimer::tick()
         {
             break;
         }
-        /* 超时调用回调函数 */
-        node.timeoutCb();
+        /* 先出堆再调用回调，回调中cancel同一个fd或重新add都不会误删其他节点 */
         this->pop();
+        node.timeoutCb();
     }
 }
 
@@ -1,12 +1,34 @@
 #include <httpconn.h>
 
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
 const char *HttpConn::srcDir_;
 std::atomic<int> HttpConn::userCount_;
+size_t HttpConn::zeroCopyThreshold_ = 0;
+size_t HttpConn::writeQuantum_ = 0;
+size_t HttpConn::readHighWater_ = 64 * 1024;
+size_t HttpConn::readBudget_ = 64 * 1024 * 1024;
+std::atomic<size_t> HttpConn::readUsage_;
+std::vector<HttpConn::WritePolicy> HttpConn::writePolicies_;
+const size_t HttpConn::MIN_BURST_;
+const size_t HttpConn::BUFFER_INIT_SIZE_;
 
 /*
  * 构造函数。
  */
-HttpConn::HttpConn() : fd_(-1), isClose_(false), addr_{0}
+HttpConn::HttpConn() : fd_(-1), isClose_(false), generation_(0), isBusy_(false), isClosing_(false), isKeepAlive_(false), requestCount_(0), isTiming_(false), responseBytes_(0), addr_{0},
+                       zeroCopy_(false), useZeroCopy_(false), zcSent_(0), zcDone_(0),
+                       quantum_(0), rate_(0), tokens_(0), throttleMs_(0), readHeld_(0), memHeld_(0), isReadPaused_(false)
 {
 }
 
@@ -29,7 +51,37 @@ void HttpConn::init(int sockfd, const sockaddr_in &addr)
     fd_ = sockfd;
     writeBuff_.retrieveAll();
     readBuff_.retrieveAll();
+    /* fd被复用时上一个连接可能停在解析中途，必须重置解析状态 */
+    request_.init();
     isClose_ = false;
+    isBusy_ = false;
+    isClosing_ = false;
+    isKeepAlive_ = false;
+    requestCount_ = 0;
+    isTiming_ = false;
+    iov[0].iov_len = 0;
+    iov[1].iov_len = 0;
+    iovCount_ = 0;
+    responseBytes_ = 0;
+    quantum_ = writeQuantum_;
+    rate_ = 0;
+    tokens_ = 0;
+    throttleMs_ = 0;
+    readHeld_ = 0;
+    isReadPaused_ = false;
+    /* 缓冲区重新计入内存占用 */
+    this->updateUsage();
+
+    /* 开启零拷贝发送，内核低于4.14会设置失败，退回普通writev */
+    zeroCopy_ = false;
+    useZeroCopy_ = false;
+    zcSent_ = 0;
+    zcDone_ = 0;
+    if (zeroCopyThreshold_ > 0)
+    {
+        int optVal = 1;
+        zeroCopy_ = setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &optVal, sizeof(optVal)) == 0;
+    }
     LOG_INFO("Client[%d](%s:%d) in, userCount: %d", sockfd, getIP(), getPort(), (int)userCount_);
 }
 
@@ -38,16 +90,43 @@ void HttpConn::init(int sockfd, const sockaddr_in &addr)
  */
 ssize_t HttpConn::read(int *retErrno)
 {
-    ssize_t len;
+    ssize_t len = -1;
+    isReadPaused_ = false;
     while (1)
     {
+        /* 全局接收预算用完，数据留在内核缓冲区里，由TCP流控反压客户端 */
+        if (readUsage_ >= readBudget_)
+        {
+            isReadPaused_ = true;
+            *retErrno = EAGAIN;
+            break;
+        }
+        /* 读缓冲到达高水位，等解析消费后重新注册EPOLLIN再读 */
+        size_t room = readHighWater_ - std::min(readHighWater_, readBuff_.readableBytes());
+        if (room == 0)
+        {
+            *retErrno = EAGAIN;
+            break;
+        }
+        /* 内存超过软上限时只用缓冲区现有的空间，不再扩容 */
+        if (MemoryGovernor::instance()->pressure() != MemoryGovernor::PRESSURE_NONE)
+        {
+            room = std::min(room, readBuff_.writableBytes());
+            if (room == 0)
+            {
+                isReadPaused_ = true;
+                *retErrno = EAGAIN;
+                break;
+            }
+        }
         /* 因为是ET模式，当读取不到数据时会返回-1，errno = EAGAIN */
-        len = readBuff_.readFd(fd_, retErrno);
+        len = readBuff_.readFd(fd_, retErrno, room);
         if (len <= 0)
         {
             *retErrno = errno;
             break;
         }
+        this->updateUsage();
     }
     return len;
 }
@@ -57,16 +136,40 @@ ssize_t HttpConn::read(int *retErrno)
  */
 ssize_t HttpConn::write(int *retErrno)
 {
-    ssize_t len;
-    while (1)
+    ssize_t len = 0;
+    /* 先回收已经完成的零拷贝发送 */
+    if (zcSent_ != zcDone_)
+    {
+        this->reapZeroCopy();
+    }
+    /* 本轮可发送的字节数，用完后返回已发送的长度，上层重新注册EPOLLOUT让出线程 */
+    size_t budget = this->writeBudget();
+    while (budget > 0)
     {
-        /* ET模式，当发送缓冲区满无法发送时，会返回-1，errno = EAGAIN */
-        len = writev(fd_, iov, iovCount_);
+        /* 按配额截断本次发送的长度 */
+        struct iovec vec[2] = {iov[0], iov[1]};
+        vec[0].iov_len = std::min(vec[0].iov_len, budget);
+        vec[1].iov_len = std::min(vec[1].iov_len, budget - vec[0].iov_len);
+        /* 响应头发完后，大文件载荷走MSG_ZEROCOPY，其余情况照常writev */
+        if (useZeroCopy_ && iov[0].iov_len == 0 && iov[1].iov_len > 0)
+        {
+            len = this->sendZeroCopy(vec[1].iov_len);
+        }
+        else
+        {
+            /* ET模式，当发送缓冲区满无法发送时，会返回-1，errno = EAGAIN */
+            len = writev(fd_, vec, iovCount_);
+        }
         if (len <= 0)
         {
             *retErrno = errno;
             break;
         }
+        budget -= len;
+        if (rate_ > 0)
+        {
+            tokens_ -= len;
+        }
         /* 长度均为0，发送完成 */
         if (iov[0].iov_len + iov[1].iov_len == 0)
         {
@@ -93,21 +196,135 @@ ssize_t HttpConn::write(int *retErrno)
             writeBuff_.retrieve(len);
         }
     }
+    /* 令牌不足导致配额为0，计算攒够一次发送量需要等待的时间 */
+    if (rate_ > 0 && this->toWriteBytes() > 0 && tokens_ < 1)
+    {
+        double want = std::min(static_cast<double>(this->toWriteBytes()), static_cast<double>(std::max(rate_ / 4, MIN_BURST_)));
+        throttleMs_ = std::max(1, static_cast<int>((want - tokens_) * 1000 / rate_));
+    }
+    /* 载荷已全部交给内核，但零拷贝尚未完成，映射区转交给连接保管 */
+    if (useZeroCopy_ && iov[1].iov_len == 0 && zcSent_ != zcDone_)
+    {
+        this->pinZeroCopy();
+    }
+    return len;
+}
+
+/*
+ * 以MSG_ZEROCOPY发送最多maxLen字节的文件载荷，内核来不及分配通知时(ENOBUFS)本次响应退回普通发送
+ */
+ssize_t HttpConn::sendZeroCopy(size_t maxLen)
+{
+    ssize_t len = send(fd_, iov[1].iov_base, std::min(iov[1].iov_len, maxLen), MSG_ZEROCOPY);
+    if (len >= 0)
+    {
+        zcSent_++;
+    }
+    else if (errno == ENOBUFS)
+    {
+        useZeroCopy_ = false;
+        len = ::write(fd_, iov[1].iov_base, std::min(iov[1].iov_len, maxLen));
+    }
     return len;
 }
 
+/*
+ * 从socket错误队列中读取零拷贝完成通知，释放已完成的映射区
+ * 若内核报告实际仍进行了拷贝，则该连接后续不再使用零拷贝
+ */
+void HttpConn::reapZeroCopy()
+{
+    char control[128];
+    struct msghdr msg;
+    while (1)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd_, &msg, MSG_ERRQUEUE) < 0)
+        {
+            break;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+            struct sock_extended_err *serr = reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(cm));
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+            /* [ee_info, ee_data] 区间内的send已经完成 */
+            zcDone_.store(std::max(zcDone_.load(std::memory_order_relaxed), serr->ee_data + 1), std::memory_order_release);
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                zeroCopy_ = false;
+            }
+        }
+    }
+    this->unpinZeroCopy(false);
+}
+
+/*
+ * 将当前响应的映射区转交给连接，等待完成通知后再解除映射
+ */
+void HttpConn::pinZeroCopy()
+{
+    zcPinned_.push_back({response_.file(), response_.fileLen(), zcSent_.load(std::memory_order_relaxed)});
+    response_.releaseFile();
+    useZeroCopy_ = false;
+}
+
+/*
+ * 解除已完成零拷贝的映射区，force为真时全部解除
+ * force只在socket关闭之后使用，此时未确认的发送已随socket终止，不会再读映射区
+ */
+void HttpConn::unpinZeroCopy(bool force)
+{
+    auto it = zcPinned_.begin();
+    while (it != zcPinned_.end())
+    {
+        if (force || static_cast<int32_t>(zcDone_ - it->seq) >= 0)
+        {
+            munmap(it->addr, it->len);
+            it = zcPinned_.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
 /*
  * 关闭http连接
  */
 void HttpConn::close()
 {
     response_.unmapFile();
+    pinned_.reset();
+    readBuff_.retrieveAll();
+    writeBuff_.retrieveAll();
+    /* 连接对象留在users_中等待复用，只保留初始大小的缓冲区，且不再计入内存占用 */
+    this->shrinkBuffers();
+    MemoryGovernor::instance()->sub(MemoryGovernor::CONN_BUFFER, memHeld_);
+    memHeld_ = 0;
+    /* 先回收已经完成的发送，仍未确认的映射区等socket关闭后再解除 */
+    if (zcSent_ != zcDone_)
+    {
+        this->reapZeroCopy();
+    }
     if (isClose_ == false)
     {
         isClose_ = true;
+        generation_++;
         userCount_--;
         ::close(fd_);
     }
+    this->unpinZeroCopy(true);
 }
 
 /*
@@ -162,22 +379,108 @@ bool HttpConn::process()
     /* 请求解析返回GET_REQUEST表示解析完成，可以正常生成响应报文 */
     /* 请求解析返回NO_REQUEST表示解析未完成，可能是报文没有完全收到，返回false */
     HttpRequest::HTTP_CODE processStatus = request_.parse(readBuff_);
-    if (processStatus == HttpRequest::GET_REQUEST)
+    /* 读缓冲已满仍解析不出完整请求，报文超过上限，按坏请求回复后关闭 */
+    if (processStatus == HttpRequest::NO_REQUEST && readBuff_.readableBytes() >= readHighWater_)
     {
-        LOG_DEBUG("request path %s", request_.path().data());
-        /* 传递资源目录，请求路径，长连接及状态码200 */
-        response_.init(srcDir_, request_.path(), request_.iskeepAlive(), 200);
+        LOG_WARN("Client[%d] request exceeds %zu bytes", fd_, readHighWater_);
+        readBuff_.retrieveAll();
+        processStatus = HttpRequest::BAD_REQUEST;
     }
-    else if (processStatus == HttpRequest::NO_REQUEST)
+    this->updateUsage();
+    if (processStatus == HttpRequest::NO_REQUEST)
     {
         return false;
     }
+    if (processStatus == HttpRequest::HEADER_TOO_LARGE)
+    {
+        LOG_WARN("Client[%d] request header too large", fd_);
+        this->reject(431, "Request header too large");
+        return true;
+    }
+    /* 需要访问数据库，由主线程交给异步数据库客户端，结果到达后调用resumeQuery生成响应 */
+    if (processStatus == HttpRequest::DB_REQUEST)
+    {
+        return false;
+    }
+    this->respond(processStatus == HttpRequest::GET_REQUEST);
+    return true;
+}
+
+/*
+ * 不处理读缓冲中的请求，直接回复错误码并在发送完后关闭连接
+ */
+void HttpConn::reject(int code, const char *info)
+{
+    readBuff_.retrieveAll();
+    writeBuff_.retrieveAll();
+    request_.init();
+    isKeepAlive_ = false;
+    response_.makeError(writeBuff_, code, info);
+    iov[0].iov_base = const_cast<char *>(writeBuff_.peek());
+    iov[0].iov_len = writeBuff_.readableBytes();
+    iov[1].iov_len = 0;
+    iovCount_ = 1;
+    responseBytes_ = iov[0].iov_len;
+    useZeroCopy_ = false;
+    this->updateUsage();
+}
+
+/*
+ * 是否有请求在等待异步数据库验证
+ */
+bool HttpConn::isQueryPending() const
+{
+    return request_.isVerifyPending();
+}
+
+/*
+ * 取出等待验证的用户名、密码及是否为登录
+ */
+void HttpConn::getQuery(std::string &name, std::string &pwd, bool &isLogin) const
+{
+    request_.getVerify(name, pwd, isLogin);
+}
+
+/*
+ * 主线程：异步验证结果到达，生成响应报文
+ */
+void HttpConn::resumeQuery(bool isVerified, int64_t upstreamUs)
+{
+    assert(request_.isVerifyPending());
+    request_.finishVerify(isVerified, upstreamUs);
+    this->respond(true);
+}
+
+/*
+ * 按解析结果生成响应报文，isOk为false时按坏请求回复并关闭连接
+ */
+void HttpConn::respond(bool isOk)
+{
+    if (isOk)
+    {
+        LOG_DEBUG("request path %s", request_.path().data());
+        /* 兑现响应头中声明的keep-alive: max，达到上限的这次响应后关闭连接 */
+        isKeepAlive_ = request_.iskeepAlive() && ++requestCount_ < HttpResponse::KEEP_ALIVE_MAX_;
+        /* 传递资源目录，请求路径，长连接及状态码200 */
+        response_.init(srcDir_, request_.path(), isKeepAlive_, 200);
+        if (pinned_ != nullptr && pinnedPath_ == request_.path())
+        {
+            response_.pin(pinned_, pinnedStat_);
+        }
+        if (request_.newSession().empty() == false)
+        {
+            response_.setCookie(SessionStore::instance()->cookie(request_.newSession()));
+        }
+        this->applyWritePolicy(request_.path());
+    }
     else
     {
+        isKeepAlive_ = false;
         response_.init(srcDir_, request_.path(), false, 400);
     }
     /* 向writebuff中写入http响应报文，等待发送 */
     response_.makeResponse(writeBuff_);
+    pinned_.reset();
 
     /* iov[0]指向响应头 */
     iov[0].iov_base = const_cast<char *>(writeBuff_.peek());
@@ -190,9 +493,11 @@ bool HttpConn::process()
         iov[1].iov_len = response_.fileLen();
         iovCount_ = 2;
     }
+    responseBytes_ = iov[0].iov_len + (iovCount_ == 2 ? iov[1].iov_len : 0);
+    /* 超过阈值的载荷走零拷贝发送 */
+    useZeroCopy_ = zeroCopy_ && iovCount_ == 2 && !response_.isCached() && response_.fileLen() >= zeroCopyThreshold_;
     LOG_DEBUG("filesize == %d, iovcnt == %d, total == %d", response_.fileLen(), iovCount_, this->toWriteBytes());
-
-    return true;
+    this->updateUsage();
 }
 
 /*
@@ -203,10 +508,279 @@ size_t HttpConn::toWriteBytes()
     return iov[0].iov_len + iov[1].iov_len;
 }
 
+/*
+ * http连接读缓冲中尚未解析的字节数
+ */
+size_t HttpConn::toReadBytes() const
+{
+    return readBuff_.readableBytes();
+}
+
 /*
  * 获取http是否为长连接
  */
 bool HttpConn::isKeepAlive() const
 {
-    return request_.iskeepAlive();
+    return isKeepAlive_;
+}
+
+/*
+ * 是否为空闲的长连接：已经处理过请求，当前没有待解析和待发送的数据
+ */
+bool HttpConn::isIdle() const
+{
+    return requestCount_ > 0 && request_.state() == HttpRequest::REQUEST_LINE &&
+           readBuff_.readableBytes() == 0 && iov[0].iov_len + iov[1].iov_len == 0;
+}
+
+/*
+ * 是否还有零拷贝发送等待完成通知，完成通知会以EPOLLERR的形式到达
+ */
+bool HttpConn::hasZeroCopyPending() const
+{
+    return zcSent_ != zcDone_;
+}
+
+/*
+ * 读缓冲中是否为一个完整的GET请求且请求的文件在缓存中，可以在主线程直接处理
+ * 命中的缓存内容由连接持有到生成响应，期间缓存核对淘汰该文件也不会让主线程去读磁盘
+ */
+bool HttpConn::isCacheHit()
+{
+    pinned_.reset();
+    if (request_.state() != HttpRequest::REQUEST_LINE && request_.state() != HttpRequest::FINISH)
+    {
+        return false;
+    }
+    std::string path;
+    if (HttpRequest::peekGet(readBuff_, path) == false)
+    {
+        return false;
+    }
+    pinned_ = FileCache::instance()->get(srcDir_ + path, &pinnedStat_);
+    if (pinned_ == nullptr)
+    {
+        return false;
+    }
+    pinnedPath_ = path;
+    return true;
+}
+
+/*
+ * 交给工作线程后是否可能长时间阻塞：未开启异步数据库验证时，登录注册的POST在工作线程中同步查询数据库
+ */
+bool HttpConn::mayBlock() const
+{
+    if (HttpRequest::asyncVerify_)
+    {
+        return false;
+    }
+    if (request_.state() == HttpRequest::HEADER || request_.state() == HttpRequest::BODY)
+    {
+        return request_.method() != "GET";
+    }
+    const char GET[] = "GET ";
+    return readBuff_.readableBytes() >= sizeof(GET) - 1 && memcmp(readBuff_.peek(), GET, sizeof(GET) - 1) != 0;
+}
+
+/*
+ * 待发送的响应载荷是否来自缓存，续写不会触发磁盘读
+ */
+bool HttpConn::isCachedResponse() const
+{
+    return iovCount_ < 2 || response_.isCached();
+}
+
+/*
+ * 连接代数，每次关闭加一，用于识别指向已关闭或被复用连接的旧句柄
+ */
+uint32_t HttpConn::generation() const
+{
+    return generation_;
+}
+
+/*
+ * 连接是否已经关闭，users_中的对象在fd被复用前一直保留
+ */
+bool HttpConn::isClosed() const
+{
+    return isClose_;
+}
+
+/*
+ * 连接是否正在工作线程中处理
+ */
+bool HttpConn::isBusy() const
+{
+    return isBusy_;
+}
+
+/*
+ * 标记连接交给或离开工作线程
+ */
+void HttpConn::setBusy(bool busy)
+{
+    isBusy_ = busy;
+}
+
+/*
+ * 是否有延迟到工作线程处理完后执行的关闭
+ */
+bool HttpConn::isClosing() const
+{
+    return isClosing_;
+}
+
+/*
+ * 连接在工作线程中时请求关闭
+ */
+void HttpConn::setClosing()
+{
+    isClosing_ = true;
+}
+
+/*
+ * 上一次write因令牌不足停止时需要等待的毫秒数，0表示未被限速
+ */
+int HttpConn::throttleMs() const
+{
+    return throttleMs_;
+}
+
+/*
+ * 本轮读是否因为全局接收预算用完而暂停
+ */
+bool HttpConn::isReadPaused() const
+{
+    return isReadPaused_;
+}
+
+/*
+ * 将读缓冲中未解析字节数、读写缓冲占用空间的变化同步到全局计数
+ */
+void HttpConn::updateUsage()
+{
+    size_t held = readBuff_.readableBytes();
+    if (held > readHeld_)
+    {
+        readUsage_ += held - readHeld_;
+    }
+    else
+    {
+        readUsage_ -= readHeld_ - held;
+    }
+    readHeld_ = held;
+
+    size_t mem = readBuff_.capacity() + writeBuff_.capacity();
+    if (mem > memHeld_)
+    {
+        MemoryGovernor::instance()->add(MemoryGovernor::CONN_BUFFER, mem - memHeld_);
+    }
+    else
+    {
+        MemoryGovernor::instance()->sub(MemoryGovernor::CONN_BUFFER, memHeld_ - mem);
+    }
+    memHeld_ = mem;
+}
+
+/*
+ * 释放空闲缓冲区多余的空间，连接关闭或内存紧张时对空闲连接调用
+ */
+void HttpConn::shrinkBuffers()
+{
+    readBuff_.shrink(BUFFER_INIT_SIZE_);
+    writeBuff_.shrink(BUFFER_INIT_SIZE_);
+    this->updateUsage();
+}
+
+/*
+ * 添加按路径前缀匹配的发送策略，先添加的优先匹配，服务启动前调用
+ */
+void HttpConn::addWritePolicy(const std::string &prefix, int weight, size_t rate)
+{
+    assert(weight > 0);
+    writePolicies_.push_back({prefix, weight, rate});
+}
+
+/*
+ * 按请求路径设置本次响应的每轮配额和限速，没有匹配的策略时权重为1不限速
+ * 限速变化时令牌桶重新装满
+ */
+void HttpConn::applyWritePolicy(const std::string &path)
+{
+    int weight = 1;
+    size_t rate = 0;
+    for (auto &policy : writePolicies_)
+    {
+        if (path.compare(0, policy.prefix.size(), policy.prefix) == 0)
+        {
+            weight = policy.weight;
+            rate = policy.rate;
+            break;
+        }
+    }
+    quantum_ = writeQuantum_ * weight;
+    if (rate != rate_)
+    {
+        rate_ = rate;
+        tokens_ = static_cast<double>(std::max(rate_ / 4, MIN_BURST_));
+        refillTime_ = std::chrono::steady_clock::now();
+    }
+}
+
+/*
+ * 计算本轮可发送的字节数：每轮配额与令牌桶余量中较小者
+ */
+size_t HttpConn::writeBudget()
+{
+    throttleMs_ = 0;
+    size_t budget = quantum_ > 0 ? quantum_ : SIZE_MAX;
+    if (rate_ > 0)
+    {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - refillTime_).count();
+        refillTime_ = now;
+        tokens_ = std::min(tokens_ + elapsed * rate_, static_cast<double>(std::max(rate_ / 4, MIN_BURST_)));
+        budget = tokens_ >= 1 ? std::min(budget, static_cast<size_t>(tokens_)) : 0;
+    }
+    return budget;
+}
+
+/*
+ * 请求的第一个读事件到达时开始计时
+ */
+void HttpConn::startTiming()
+{
+    if (isTiming_ == false)
+    {
+        isTiming_ = true;
+        startTime_ = std::chrono::steady_clock::now();
+    }
+}
+
+/*
+ * 响应发送完成时结束计时，返回请求处理时延(微秒)，未在计时返回-1
+ */
+int64_t HttpConn::stopTiming()
+{
+    if (isTiming_ == false)
+    {
+        return -1;
+    }
+    isTiming_ = false;
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime_).count();
+}
+
+/*
+ * 响应发送完成后写一条访问日志，未开启访问日志时直接返回
+ */
+void HttpConn::logAccess(int64_t latencyUs)
+{
+    AccessLog *accessLog = AccessLog::instance();
+    if (accessLog->isOpen() == false)
+    {
+        return;
+    }
+    accessLog->append(request_.method(), request_.path(), response_.code(), responseBytes_,
+                      latencyUs, request_.upstreamUs(), addr_);
 }
\ No newline at end of file
@@ -1,10 +1,17 @@
 #include <httprequest.h>
 
 #include <regex>
+#include <chrono>
+#include <vector>
+#include <algorithm>
 #include <log.h>
 #include <mysql/mysql.h>
+#include <mysql/mysqld_error.h>
 #include <sqlconnRAII.hpp>
 #include <sqlconnpool.h>
+#include <sqlasync.h>
+#include <usercache.h>
+#include <sessionstore.h>
 
 /*
  * 保存默认界面名字的静态变量，所有对以下界面的请求都会加上 .html 后缀
@@ -26,6 +33,15 @@ const std::unordered_map<std::string, int> HttpRequest::DEFAULT_HTML_TAG_{
     {"/login.html", 1},
 };
 
+/*
+ * 需要登录才能访问的页面，开启会话后没有有效会话的请求改为返回登录页
+ */
+const std::unordered_set<std::string> HttpRequest::AUTH_HTML_{
+    "/welcome.html",
+};
+
+bool HttpRequest::asyncVerify_ = false;
+
 HttpRequest::HttpRequest()
 {
     this->init();
@@ -42,7 +58,15 @@ void HttpRequest::init()
     body_ = "";
     state_ = REQUEST_LINE;
     header_.clear();
+    headerBytes_ = 0;
     post_.clear();
+    upstreamUs_ = 0;
+    isVerifyPending_ = false;
+    verifyIsLogin_ = false;
+    verifyName_.clear();
+    verifyPwd_.clear();
+    sessionUser_.clear();
+    newSession_.clear();
 }
 
 //  请求报文示例
@@ -87,12 +111,26 @@ HttpRequest::HTTP_CODE HttpRequest::parse(Buffer &buff)
                 /* 解析失败，返回损坏的请求 */
                 return BAD_REQUEST;
             }
-            /* 成功则解析请求的文件路径 */
-            this->parsePath();
+            /* 成功则解析请求的文件路径，越过资源根目录的路径按坏请求处理 */
+            if (this->parsePath() == false)
+            {
+                return BAD_REQUEST;
+            }
             break;
         case HEADER:
+            /* 请求头已经从buff中取走，单独限制条数和总字节数，防止header_无限增长 */
+            headerBytes_ += line.size() + 2;
+            if (headerBytes_ > MAX_HEADER_BYTES_ || (line.empty() == false && header_.size() >= MAX_HEADER_NUM_))
+            {
+                return HEADER_TOO_LARGE;
+            }
             /* 解析请求头 */
             this->parseHeader(line);
+            /* 请求头解析完成，凭会话cookie确认用户 */
+            if (state_ == BODY)
+            {
+                this->authenticate();
+            }
             /* 如果状态解析到BODY说明请求头解析完成，方法同时为GET，无需解析BODY，直接返回即可 */
             if (state_ == BODY && method_ == "GET")
             {
@@ -109,7 +147,7 @@ HttpRequest::HTTP_CODE HttpRequest::parse(Buffer &buff)
                 return NO_REQUEST;
             }
             buff.retrieveAll();
-            return GET_REQUEST;
+            return isVerifyPending_ ? DB_REQUEST : GET_REQUEST;
             break;
         default:
             return INTERNAL_ERROR;
@@ -154,6 +192,124 @@ std::string HttpRequest::method() const
     return method_;
 }
 
+/*
+ * 返回本次请求访问数据库的耗时(微秒)，供访问日志记录
+ */
+int64_t HttpRequest::upstreamUs() const
+{
+    return upstreamUs_;
+}
+
+/*
+ * 是否在等待异步用户验证的结果
+ */
+bool HttpRequest::isVerifyPending() const
+{
+    return isVerifyPending_;
+}
+
+/*
+ * 取出等待验证的用户名、密码及是否为登录
+ */
+void HttpRequest::getVerify(std::string &name, std::string &pwd, bool &isLogin) const
+{
+    name = verifyName_;
+    pwd = verifyPwd_;
+    isLogin = verifyIsLogin_;
+}
+
+/*
+ * 异步验证结果到达，按结果设置响应页面
+ */
+void HttpRequest::finishVerify(bool isVerified, int64_t upstreamUs)
+{
+    path_ = isVerified ? "/welcome.html" : "/error.html";
+    upstreamUs_ += upstreamUs;
+    isVerifyPending_ = false;
+    verifyPwd_.clear();
+    if (isVerified)
+    {
+        this->startSession(verifyName_);
+    }
+}
+
+/*
+ * 凭会话cookie确认的用户名，未登录为空
+ */
+const std::string &HttpRequest::sessionUser() const
+{
+    return sessionUser_;
+}
+
+/*
+ * 需要通过Set-Cookie下发的会话id，本次登录新建或顺延后需要续期，没有时为空
+ */
+const std::string &HttpRequest::newSession() const
+{
+    return newSession_;
+}
+
+/*
+ * 从Cookie头取出会话id查会话表，只是一次哈希查找，不访问数据库
+ * 已登录的用户访问登录页直接进入欢迎页，未登录访问需要登录的页面返回登录页
+ */
+void HttpRequest::authenticate()
+{
+    SessionStore *store = SessionStore::instance();
+    if (store->isOpen() == false)
+    {
+        return;
+    }
+    auto it = header_.find("Cookie");
+    if (it != header_.end())
+    {
+        /* Cookie: a=1; sid=xxx */
+        const std::string &cookie = it->second;
+        std::string key = std::string(SessionStore::COOKIE_NAME_) + "=";
+        size_t pos = 0;
+        while ((pos = cookie.find(key, pos)) != std::string::npos)
+        {
+            if (pos == 0 || cookie[pos - 1] == ' ' || cookie[pos - 1] == ';')
+            {
+                size_t begin = pos + key.size();
+                size_t end = cookie.find(';', begin);
+                std::string id = cookie.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+                bool isRenew = false;
+                if (store->lookup(id, sessionUser_, isRenew) && isRenew)
+                {
+                    newSession_ = id;
+                }
+                break;
+            }
+            pos += key.size();
+        }
+    }
+    if (method_ != "GET")
+    {
+        return;
+    }
+    if (sessionUser_.empty() == false && path_ == "/login.html")
+    {
+        path_ = "/welcome.html";
+    }
+    else if (sessionUser_.empty() && AUTH_HTML_.count(path_) == 1)
+    {
+        path_ = "/login.html";
+    }
+}
+
+/*
+ * 验证成功，为用户新建会话
+ */
+void HttpRequest::startSession(const std::string &name)
+{
+    newSession_ = SessionStore::instance()->create(name);
+    if (newSession_.empty() == false)
+    {
+        sessionUser_ = name;
+    }
+}
+
 /*
  * 返回http版本
  */
@@ -217,73 +373,206 @@ int HttpRequest::convertHex(char ch)
 }
 
 /*
- * 用户验证
+ * 执行预处理语句，params为nullptr表示没有参数，成功返回语句句柄，失败时errNo带回错误码
+ * 语句失效(服务端要求重新预处理、语句不存在)时重新预处理并重试一次；
+ * 连接断开时不在这里重试，归还时连接池按mysql_errno发现断开并关闭该连接，之后的请求使用重建的连接
+ */
+static MYSQL_STMT *execStmt(MYSQL *sql, const char *query, MYSQL_BIND *params, unsigned int *errNo = nullptr)
+{
+    SqlConnPool *pool = SqlConnPool::instance();
+    for (int retry = 0; retry < 2; retry++)
+    {
+        MYSQL_STMT *stmt = pool->getStmt(sql, query);
+        if (stmt == nullptr)
+        {
+            return nullptr;
+        }
+        if ((params == nullptr || mysql_stmt_bind_param(stmt, params) == 0) && mysql_stmt_execute(stmt) == 0)
+        {
+            return stmt;
+        }
+        unsigned int err = mysql_stmt_errno(stmt);
+        LOG_WARN("MySQL execute error %u: %s [%s]", err, mysql_stmt_error(stmt), query);
+        pool->dropStmt(sql, query);
+        if (errNo != nullptr)
+        {
+            *errNo = err;
+        }
+        if (err != ER_NEED_REPREPARE && err != ER_UNKNOWN_STMT_HANDLER)
+        {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * 绑定一个字符串参数
+ */
+static void bindString(MYSQL_BIND &bind, const std::string &value, unsigned long &length)
+{
+    length = value.size();
+    bind.buffer_type = MYSQL_TYPE_STRING;
+    bind.buffer = const_cast<char *>(value.data());
+    bind.buffer_length = length;
+    bind.length = &length;
+}
+
+/*
+ * 先查用户缓存，能直接得出结果时返回true，结果由isVerified带回
+ * 注册时缓存或布隆过滤器确定用户名不存在，needSelect置为false，跳过查询直接插入；
+ * 缓存和布隆过滤器是进程内的，多进程模式下其它worker刚注册的用户名这里看不到，
+ * 重名由user表username上的UNIQUE约束兜底，插入返回ER_DUP_ENTRY按用户已存在处理
+ */
+static bool verifyByCache(const std::string &name, const std::string &pwd, bool isLogin, bool &isVerified, bool &needSelect)
+{
+    UserCache *cache = UserCache::instance();
+    needSelect = true;
+    switch (cache->lookup(name, pwd))
+    {
+    case UserCache::MATCH:
+        isVerified = isLogin;
+        LOG_INFO("%s (cached)", isLogin ? "Login Success !!" : "User has been exits !!");
+        return true;
+    case UserCache::MISMATCH:
+        isVerified = false;
+        LOG_INFO("%s (cached)", isLogin ? "Password error !!" : "User has been exits !!");
+        return true;
+    case UserCache::ABSENT:
+        if (isLogin)
+        {
+            isVerified = false;
+            LOG_INFO("user not exits !! (cached)");
+            return true;
+        }
+        needSelect = false;
+        return false;
+    default:
+        needSelect = isLogin || cache->mayExist(name);
+        return false;
+    }
+}
+
+/*
+ * 注册结束：成功时缓存新用户并加入布隆过滤器，失败时删除缓存
+ * 重名(用户名已被其它进程或并发请求注册)时把用户名加入布隆过滤器，之后的注册先查询
+ */
+static void finishRegister(const std::string &name, const std::string &pwd, bool isOk, bool isDup)
+{
+    UserCache *cache = UserCache::instance();
+    if (isOk)
+    {
+        cache->addName(name);
+        cache->putUser(name, pwd);
+        return;
+    }
+    if (isDup)
+    {
+        cache->addName(name);
+    }
+    cache->erase(name);
+}
+
+/*
+ * 用户验证，用户名和密码都通过预处理语句的参数传入，不拼接SQL
+ * 查询结果写入用户缓存，缓存命中时不访问数据库
  */
 bool HttpRequest::userVerify(const std::string &name, const std::string &pwd, bool isLogin)
 {
     if (name == "" || pwd == "")
         return false;
-    LOG_INFO("Verify name == %s, pwd == %s", name.data(), pwd.data());
+    LOG_INFO("Verify name == %s", name.data());
+
+    bool isVerified = false;
+    bool needSelect = true;
+    if (verifyByCache(name, pwd, isLogin, isVerified, needSelect))
+    {
+        return isVerified;
+    }
 
     /* RAII获取连接 */
     MYSQL *sql = nullptr;
     SqlConnRAII sqlConn(&sql, SqlConnPool::instance());
-    assert(sql != nullptr);
+    /* 连接池超时或数据库不可用，按验证失败返回错误页，不让工作线程一直等待 */
+    if (sql == nullptr)
+    {
+        LOG_WARN("Verify %s: no database connection", name.data());
+        return false;
+    }
 
+    MYSQL_BIND param[2];
+    unsigned long paramLen[2] = {0};
+    memset(param, 0, sizeof(param));
+    bindString(param[0], name, paramLen[0]);
+    bool hasUser = false;
+    char password[256] = {0};
+    unsigned long passwordLen = 0;
     /* 按照用户名查询数据库 */
-    MYSQL_RES *res = nullptr;
-    char SQL_Qurey[1024] = {0};
-    snprintf(SQL_Qurey, sizeof(SQL_Qurey) - 1, "SELECT username, password FROM user WHERE username='%s' LIMIT 1", name.data());
-    LOG_DEBUG("%s", SQL_Qurey);
-
-    if (mysql_query(sql, SQL_Qurey))
+    if (needSelect)
     {
-        return false;
+        MYSQL_STMT *stmt = execStmt(sql, "SELECT password FROM user WHERE username = ? LIMIT 1", param);
+        if (stmt == nullptr)
+        {
+            return false;
+        }
+
+        MYSQL_BIND result;
+        memset(&result, 0, sizeof(result));
+        result.buffer_type = MYSQL_TYPE_STRING;
+        result.buffer = password;
+        result.buffer_length = sizeof(password);
+        result.length = &passwordLen;
+        bool isFetched = false;
+        if (mysql_stmt_bind_result(stmt, &result) == 0 && mysql_stmt_store_result(stmt) == 0)
+        {
+            int ret = mysql_stmt_fetch(stmt);
+            hasUser = ret == 0 || ret == MYSQL_DATA_TRUNCATED;
+            isFetched = hasUser || ret == MYSQL_NO_DATA;
+        }
+        mysql_stmt_free_result(stmt);
+        /* 截断的密码无法缓存校验值，只缓存能完整比较的结果 */
+        if (isFetched && hasUser == false)
+        {
+            UserCache::instance()->putAbsent(name);
+        }
+        else if (hasUser && passwordLen <= sizeof(password))
+        {
+            UserCache::instance()->putUser(name, std::string(password, passwordLen));
+        }
     }
-    res = mysql_store_result(sql);
 
-    /* 从结果中取出一行遍历 */
-    while (MYSQL_ROW row = mysql_fetch_row(res))
+    if (hasUser)
     {
-        LOG_DEBUG("MYSQL name == %s, pwd == %s", row[0], row[1]);
         /* 是登录则验证是否账号密码正确 */
         if (isLogin)
         {
-            std::string password(row[1]);
-            if (password == pwd)
+            if (passwordLen == pwd.size() && passwordLen <= sizeof(password) && memcmp(password, pwd.data(), passwordLen) == 0)
             {
-                mysql_free_result(res);
                 LOG_INFO("Login Success !!");
                 return true;
             }
-            else
-            {
-                mysql_free_result(res);
-                LOG_INFO("Password error !!");
-                return false;
-            }
-        }
-        /* 不是登录则用户名已经被占用 */
-        else
-        {
-            mysql_free_result(res);
-            LOG_WARN("User has been exits !!");
+            LOG_INFO("Password error !!");
             return false;
         }
+        /* 不是登录则用户名已经被占用 */
+        LOG_WARN("User has been exits !!");
+        return false;
     }
 
     /* 走到这里说明该用户名不在数据库中，若是注册行为则插入数据库 */
     if (isLogin == false)
     {
         LOG_DEBUG("regirster!");
-        memset(SQL_Qurey, 0, sizeof(SQL_Qurey));
-        snprintf(SQL_Qurey, sizeof(SQL_Qurey) - 1, "INSERT INTO user(username, password) VALUES('%s','%s')", name.data(), pwd.data());
-        if (mysql_query(sql, SQL_Qurey))
+        bindString(param[1], pwd, paramLen[1]);
+        unsigned int err = 0;
+        if (execStmt(sql, "INSERT INTO user(username, password) VALUES(?, ?)", param, &err) == nullptr)
         {
-            LOG_DEBUG("INSET error");
+            LOG_INFO("%s", err == ER_DUP_ENTRY ? "User has been exits !!" : "INSET error");
+            finishRegister(name, pwd, false, err == ER_DUP_ENTRY);
             return false;
         }
         LOG_INFO("regirster success !!");
+        finishRegister(name, pwd, true, false);
         return true;
     }
     /* 登录行为，用户不存在 */
@@ -291,6 +580,87 @@ bool HttpRequest::userVerify(const std::string &name, const std::string &pwd, bo
     return false;
 }
 
+/*
+ * 异步用户验证，在主线程中通过异步数据库客户端执行，结果由done返回
+ * 查询和插入分两步，前一步的结果回调里发起下一步；字符串按连接字符集转义
+ */
+void HttpRequest::userVerifyAsync(SqlAsync *sql, const std::string &name, const std::string &pwd, bool isLogin,
+                                  const std::function<void(bool)> &done)
+{
+    if (name == "" || pwd == "")
+    {
+        done(false);
+        return;
+    }
+    LOG_INFO("Verify name == %s", name.data());
+
+    bool isVerified = false;
+    bool needSelect = true;
+    if (verifyByCache(name, pwd, isLogin, isVerified, needSelect))
+    {
+        done(isVerified);
+        return;
+    }
+    std::string escName = SqlAsync::escape(name);
+    std::string escPwd = SqlAsync::escape(pwd);
+
+    /* 用户名不在数据库中，注册 */
+    std::string insert = "INSERT INTO user(username, password) VALUES('" + escName + "', '" + escPwd + "')";
+    auto doInsert = [sql, insert, name, pwd, done]()
+    {
+        bool isQueued = sql->query(insert, [sql, name, pwd, done](bool ok, MYSQL_RES *)
+                                   {
+                                       LOG_INFO("%s", ok ? "regirster success !!" : (sql->errNo() == ER_DUP_ENTRY ? "User has been exits !!" : "INSET error"));
+                                       finishRegister(name, pwd, ok, sql->errNo() == ER_DUP_ENTRY);
+                                       done(ok); });
+        if (isQueued == false)
+        {
+            done(false);
+        }
+    };
+    if (needSelect == false)
+    {
+        doInsert();
+        return;
+    }
+
+    std::string query = "SELECT password FROM user WHERE username = '" + escName + "' LIMIT 1";
+    auto onSelect = [name, pwd, isLogin, done, doInsert](bool ok, MYSQL_RES *res)
+    {
+        if (ok == false || res == nullptr)
+        {
+            done(false);
+            return;
+        }
+        MYSQL_ROW row = mysql_fetch_row(res);
+        if (row != nullptr)
+        {
+            unsigned long *lengths = mysql_fetch_lengths(res);
+            if (row[0] != nullptr)
+            {
+                UserCache::instance()->putUser(name, std::string(row[0], lengths[0]));
+            }
+            /* 是登录则验证是否账号密码正确，不是登录则用户名已经被占用 */
+            bool isVerified = isLogin && row[0] != nullptr && lengths[0] == pwd.size() && memcmp(row[0], pwd.data(), pwd.size()) == 0;
+            LOG_INFO("%s", isVerified ? "Login Success !!" : (isLogin ? "Password error !!" : "User has been exits !!"));
+            done(isVerified);
+            return;
+        }
+        UserCache::instance()->putAbsent(name);
+        if (isLogin)
+        {
+            LOG_INFO("user not exits !!");
+            done(false);
+            return;
+        }
+        doInsert();
+    };
+    if (sql->query(query, onSelect) == false)
+    {
+        done(false);
+    }
+}
+
 /*
  * 请求头示例
  * POST / HTTP1.1
@@ -356,27 +726,127 @@ bool HttpRequest::parseBody(const std::string &line)
 }
 
 /*
- * 给html请求加上文件扩展名.html
+ * 规范化请求路径后给html请求加上文件扩展名.html，路径越过根目录时返回false
+ */
+bool HttpRequest::parsePath()
+{
+    if (canonicalPath(path_) == false)
+    {
+        return false;
+    }
+    defaultPath(path_);
+    return true;
+}
+
+/*
+ * 合并连续的'/'，去掉"."，".."回退一级，保留结尾的'/'
+ * 访问控制按规范化后的路径匹配，"//welcome.html"、"/./welcome.html"不能绕过登录检查
+ * 不以'/'开头或".."越过根目录时返回false
+ */
+bool HttpRequest::canonicalPath(std::string &path)
+{
+    if (path.empty() || path[0] != '/')
+    {
+        return false;
+    }
+    std::vector<std::string> parts;
+    size_t pos = 1;
+    while (pos <= path.size())
+    {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos)
+        {
+            end = path.size();
+        }
+        std::string part = path.substr(pos, end - pos);
+        if (part == "..")
+        {
+            if (parts.empty())
+            {
+                return false;
+            }
+            parts.pop_back();
+        }
+        else if (part.empty() == false && part != ".")
+        {
+            parts.push_back(part);
+        }
+        pos = end + 1;
+    }
+    std::string canonical;
+    for (auto &part : parts)
+    {
+        canonical += "/" + part;
+    }
+    if (canonical.empty() || path.back() == '/')
+    {
+        canonical += "/";
+    }
+    path.swap(canonical);
+    return true;
+}
+
+/*
+ * 将默认界面名字补全为对应的html文件路径
  */
-void HttpRequest::parsePath()
+void HttpRequest::defaultPath(std::string &path)
 {
-    if (path_ == "/")
+    if (path == "/")
     {
-        path_ = "/index.html";
+        path = "/index.html";
     }
     else
     {
         for (auto &item : DEFAULT_HTML_)
         {
-            if (item == path_)
+            if (item == path)
             {
-                path_ += ".html";
+                path += ".html";
                 break;
             }
         }
     }
 }
 
+/*
+ * 不消费buff，预判其中是否为一个完整的GET请求，是则取出补全后的请求路径
+ * 主线程据此判断能否不经过线程池直接处理，判断失败的请求照常交给工作线程解析
+ * 开启会话时登录页和需要登录的页面可能被改写成别的路径，这些请求也交给工作线程；
+ * 路径与工作线程一样先规范化再匹配
+ */
+bool HttpRequest::peekGet(const Buffer &buff, std::string &path)
+{
+    const char GET[] = "GET ";
+    const char END[] = "\r\n\r\n";
+    const char *begin = buff.peek();
+    const char *end = buff.beginWriteConst();
+    if (buff.readableBytes() < sizeof(GET) - 1 || memcmp(begin, GET, sizeof(GET) - 1) != 0)
+    {
+        return false;
+    }
+    if (std::search(begin, end, END, END + 4) == end)
+    {
+        return false;
+    }
+    const char *pathBegin = begin + sizeof(GET) - 1;
+    const char *pathEnd = std::find(pathBegin, end, ' ');
+    if (pathEnd == end || pathBegin == pathEnd || *pathBegin != '/')
+    {
+        return false;
+    }
+    path.assign(pathBegin, pathEnd);
+    if (canonicalPath(path) == false)
+    {
+        return false;
+    }
+    defaultPath(path);
+    if (SessionStore::instance()->isOpen() && (path == "/login.html" || AUTH_HTML_.count(path) == 1))
+    {
+        return false;
+    }
+    return true;
+}
+
 /*
  * 解析post 传递过来的内容，取出用户名密码及登陆验证等
  */
@@ -394,9 +864,24 @@ bool HttpRequest::parsePost()
         {
             /* 判断是登陆还是注册 */
             bool isLogin = static_cast<bool>(DEFAULT_HTML_TAG_.find(path_)->second);
-            if (this->userVerify(post_.find("username")->second, post_.find("password")->second, isLogin))
+            auto name = post_.find("username");
+            auto pwd = post_.find("password");
+            /* 异步模式只记下用户名密码，由主线程发起查询，结果到达后调用finishVerify */
+            if (asyncVerify_ && name != post_.end() && pwd != post_.end())
+            {
+                isVerifyPending_ = true;
+                verifyIsLogin_ = isLogin;
+                verifyName_ = name->second;
+                verifyPwd_ = pwd->second;
+                return true;
+            }
+            auto start = std::chrono::steady_clock::now();
+            bool isVerified = name != post_.end() && pwd != post_.end() && this->userVerify(name->second, pwd->second, isLogin);
+            upstreamUs_ += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            if (isVerified)
             {
                 path_ = "/welcome.html";
+                this->startSession(name->second);
             }
             else
             {
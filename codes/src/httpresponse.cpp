@@ -34,6 +34,8 @@ const std::unordered_map<int, std::string> HttpResponse::CODE_STATUS_ = {
     {400, "Bad Request"},
     {403, "Forbidden"},
     {404, "Not Found"},
+    {431, "Request Header Fields Too Large"},
+    {503, "Service Unavailable"},
 };
 
 /*
@@ -76,7 +78,26 @@ void HttpResponse::init(const std::string srcDir, const std::string &path, bool
     code_ = code;
     isKeepAlive_ = isKeepAlive;
     mmFile_ = nullptr;
+    cached_.reset();
     mmFileStat_ = {0};
+    cookie_.clear();
+}
+
+/*
+ * 设置本次响应的Set-Cookie
+ */
+void HttpResponse::setCookie(const std::string &cookie)
+{
+    cookie_ = cookie;
+}
+
+/*
+ * 使用调用方已经从缓存取出的文件内容，生成响应时不再查询缓存
+ */
+void HttpResponse::pin(const FileCache::Content &content, const struct stat &st)
+{
+    cached_ = content;
+    mmFileStat_ = st;
 }
 
 /*
@@ -84,13 +105,21 @@ void HttpResponse::init(const std::string srcDir, const std::string &path, bool
  */
 void HttpResponse::makeResponse(Buffer &buff)
 {
+    /* 坏请求的路径不可信(可能越过资源目录)，不查看对应的文件，直接回复400页面 */
+    bool isBadRequest = code_ == 400;
+    /* 缓存中的文件都是可读的普通文件，命中时省去stat */
+    if (cached_ == nullptr && isBadRequest == false)
+    {
+        cached_ = FileCache::instance()->get(srcDir_ + path_, &mmFileStat_);
+    }
     /* 如果该文件获取不到文件信息或者是个文件夹，则返回404 找不到文件 */
-    if (stat(std::string(srcDir_ + path_).data(), &mmFileStat_) < 0 || S_ISDIR(mmFileStat_.st_mode))
+    if (isBadRequest == false && cached_ == nullptr &&
+        (stat(std::string(srcDir_ + path_).data(), &mmFileStat_) < 0 || S_ISDIR(mmFileStat_.st_mode)))
     {
         code_ = 404;
     }
     /* 无权限，返回403 */
-    else if (!(mmFileStat_.st_mode & S_IROTH))
+    else if (isBadRequest == false && cached_ == nullptr && !(mmFileStat_.st_mode & S_IROTH))
     {
         code_ = 403;
     }
@@ -111,6 +140,27 @@ void HttpResponse::makeResponse(Buffer &buff)
 }
 
  
+/*
+ * 不读取文件，直接生成错误页面，用于过载丢弃、请求头过大等场合，回复后关闭连接
+ */
+void HttpResponse::makeError(Buffer &buff, int code, const std::string &message)
+{
+    this->unmapFile();
+    code_ = code;
+    isKeepAlive_ = false;
+    path_ = "";
+    cookie_.clear();
+    mmFileStat_ = {0};
+    this->addStateLine(buff);
+    buff.append("Connection: close\r\n");
+    if (code_ == 503)
+    {
+        buff.append("Retry-After: " + std::to_string(RETRY_AFTER_S_) + "\r\n");
+    }
+    buff.append("Content-type: text/html\r\n");
+    this->errorContent(buff, message);
+}
+
 /*
  * 取消文件映射
  */
@@ -121,6 +171,15 @@ void HttpResponse::unmapFile()
         munmap(mmFile_, mmFileStat_.st_size);
         mmFile_ = nullptr;
     }
+    cached_.reset();
+}
+
+/*
+ * 放弃映射区所有权但不解除映射，由调用者负责munmap
+ */
+void HttpResponse::releaseFile()
+{
+    mmFile_ = nullptr;
 }
 
 /*
@@ -128,6 +187,10 @@ void HttpResponse::unmapFile()
  */
 char *HttpResponse::file()
 {
+    if (cached_)
+    {
+        return const_cast<char *>(cached_->data());
+    }
     return mmFile_;
 }
 
@@ -139,6 +202,14 @@ size_t HttpResponse::fileLen() const
     return mmFileStat_.st_size;
 }
 
+/*
+ * 载荷是否来自文件缓存
+ */
+bool HttpResponse::isCached() const
+{
+    return cached_ != nullptr;
+}
+
 /*
  * 生成错误页面
  */
@@ -201,13 +272,17 @@ void HttpResponse::addHeader(Buffer &buff)
     if (isKeepAlive_)
     {
         buff.append("keep-alive\r\n");
-        buff.append("keep-alive: max=6, timeout=120\r\n");
+        buff.append("keep-alive: max=" + std::to_string(KEEP_ALIVE_MAX_) + ", timeout=120\r\n");
     }
     else
     {
         buff.append("close\r\n");
     }
     buff.append("Content-type: " + this->getFileType() + "\r\n");
+    if (cookie_.empty() == false)
+    {
+        buff.append("Set-Cookie: " + cookie_ + "\r\n");
+    }
 }
 
 /*
@@ -216,6 +291,17 @@ void HttpResponse::addHeader(Buffer &buff)
  */
 void HttpResponse::addContent(Buffer &buff)
 {
+    /* 小文件读入缓存，之后的请求直接从内存发送 */
+    if (cached_ == nullptr)
+    {
+        cached_ = FileCache::instance()->load(srcDir_ + path_, mmFileStat_);
+    }
+    if (cached_)
+    {
+        buff.append("Content-length: " + std::to_string(cached_->size()) + "\r\n");
+        buff.append("\r\n");
+        return;
+    }
     /* 只读打开文件 */
     int srcfd = open(std::string(srcDir_ + path_).data(), O_RDONLY);
     if (srcfd < 0)
@@ -246,7 +332,11 @@ void HttpResponse::errorHtml()
     if (CODE_PATH_.count(code_) == 1)
     {
         path_ = CODE_PATH_.find(code_)->second;
-        stat(std::string(srcDir_ + path_).data(), &mmFileStat_);
+        cached_ = FileCache::instance()->get(srcDir_ + path_, &mmFileStat_);
+        if (cached_ == nullptr)
+        {
+            stat(std::string(srcDir_ + path_).data(), &mmFileStat_);
+        }
     }
 }
 
@@ -1,110 +1,435 @@
 #include <log.h>
 
+#include <new>
 #include <cstring>
 #include <cassert>
 #include <cstdarg>
+#include <climits>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#ifdef LOG_USE_ZLIB
+#include <zlib.h>
+#endif
+
+const int Log::FLUSH_INTERVAL_MS_;
+const size_t Log::ROTATE_BYTES_;
+const size_t Log::RECORD_MAX_LEN_;
+constexpr const char *Log::BINARY_SUFFIX_;
+
+/*
+ * 环形缓冲大小向上取2的幂，下标用掩码回绕
+ */
+Log::Ring::Ring(size_t size) : size_(1), head_(0), cachedTail_(0), tail_(0), retired_(false)
+{
+    while (size_ < size)
+    {
+        size_ <<= 1;
+    }
+    data_.reset(new char[size_]);
+}
+
+/*
+ * 生产者写入一条完整日志，剩余空间不够返回false，不会写入半条，used返回写入后的占用字节数
+ */
+bool Log::Ring::push(const char *data, size_t len, size_t &used)
+{
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (size_ - (head - cachedTail_) < len)
+    {
+        cachedTail_ = tail_.load(std::memory_order_acquire);
+        if (size_ - (head - cachedTail_) < len)
+        {
+            return false;
+        }
+    }
+    size_t pos = head & (size_ - 1);
+    size_t first = std::min(len, size_ - pos);
+    memcpy(data_.get() + pos, data, first);
+    memcpy(data_.get(), data + first, len - first);
+    head_.store(head + len, std::memory_order_release);
+    used = head + len - cachedTail_;
+    /* 估计值过半时再确认一次，后台线程可能已经取走 */
+    if (used > size_ / 2)
+    {
+        cachedTail_ = tail_.load(std::memory_order_acquire);
+        used = head + len - cachedTail_;
+    }
+    return true;
+}
+
+/*
+ * 已写入未取走的字节数
+ */
+size_t Log::Ring::used() const
+{
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+}
+
+/*
+ * 线程退出，交给后台线程在取空后释放
+ */
+Log::RingHolder::~RingHolder()
+{
+    if (ring != nullptr)
+    {
+        ring->retired_.store(true, std::memory_order_release);
+    }
+}
 
 /*
  * 私有化构造函数，单例模式
  */
-Log::Log() : lineCount_(0),
-             today_(0),
-             isOpen_(0),
+Log::Log() : isOpen_(false),
              level_(DEBUG),
              isAsync_(false),
-             fp_(nullptr),
-             queue_(nullptr),
-             thread_(nullptr)
+             fd_(-1),
+             fileBytes_(0),
+             period_(0),
+             part_(0),
+             fileTag_(0),
+             gmtOff_(0),
+             isRotating_(false),
+             rotateRetry_(0),
+             maxBytes_(ROTATE_BYTES_),
+             periodS_(ROTATE_PERIOD_S_),
+             mode_(MODE_TEXT),
+             isDeferred_(false),
+             ringSize_(0),
+             dropped_(0),
+             rateLimit_(0),
+             reportSec_(0),
+             isStop_(false),
+             isWake_(false),
+             thread_(nullptr),
+             maxFiles_(0),
+             maxDays_(0),
+             compress_(false),
+             isRotateRequested_(false),
+             isMaintainStop_(false),
+             maintainerPid_(0),
+             maintainer_(nullptr)
 {
 }
 
 /*
- * 析构时将队列中所有的日志取出写入日志文件
+ * 析构时停止后台线程，将所有环形缓冲中的日志写入日志文件
+ * 其他线程此时可能还没退出，环形缓冲不释放
  */
 Log::~Log()
 {
     /* 写线程不为空且写线程可回收 */
     if (thread_ != nullptr && thread_->joinable())
     {
-        /* 队列不为空则一直唤醒消费者取出日志 */
-        while (queue_->empty() != true)
         {
-            queue_->flush();
+            std::lock_guard<std::mutex> locker(mtx_);
+            isStop_ = true;
         }
-        /* 关闭阻塞队列和线程 */
-        queue_->close();
+        cond_.notify_one();
         thread_->join();
     }
-    if (fp_)
+    if (maintainer_ != nullptr)
     {
-        /* 刷新文件并且关闭文件 */
-        this->flush();
-        fclose(fp_);
+        if (maintainerPid_ == getpid())
+        {
+            {
+                std::lock_guard<std::mutex> locker(taskMtx_);
+                isMaintainStop_ = true;
+            }
+            taskCond_.notify_one();
+            maintainer_->join();
+        }
+        else
+        {
+            /* fork前创建的线程对象，子进程里没有对应的线程 */
+            maintainer_.release();
+            this->resetTaskSync();
+        }
+    }
+    if (fd_ >= 0)
+    {
+        close(fd_);
     }
 }
 
-/* 
- * 初始化Log配置
+/*
+ * 初始化Log配置，maxQueueSize按每条平均LINE_AVG_LEN_字节换算为每个线程环形缓冲的大小
  */
 void Log::init(LOG_LEVEL level,
                int maxQueueSize,
                const char *path,
                const char *suffix)
 {
-    isOpen_ = true;
-    level_ = level;
+    level_.store(level, std::memory_order_relaxed);
     /* 如果消息对列容量不为 0，则为异步日志 */
     if (maxQueueSize > 0)
     {
         isAsync_ = true;
-        if (queue_ == nullptr && thread_ == nullptr)
+        if (thread_ == nullptr)
         {
-            /* 初始化消息队列和线程智能指针 */
-            std::unique_ptr<BlockQueue<std::string>> que_ptr(new BlockQueue<std::string>(maxQueueSize));
-            queue_ = std::move(que_ptr);
+            /* 至少能放下两条最长的日志 */
+            ringSize_ = std::max(static_cast<size_t>(maxQueueSize) * LINE_AVG_LEN_, 2 * static_cast<size_t>(LINE_MAX_LEN_ + 64));
             /* 初始化同时设置线程回调函数为异步写日志 */
             std::unique_ptr<std::thread> thread_ptr(new std::thread([]()
                                                                     { Log::instance()->asyncWrite(); }));
             thread_ = std::move(thread_ptr);
         }
-        else
-        {
-            isAsync_ = false;
-        }
     }
-    lineCount_ = 0;
+    else
+    {
+        isAsync_ = false;
+    }
+    isDeferred_.store(isAsync_ && mode_ != MODE_TEXT, std::memory_order_relaxed);
+    clock_.sync(LogClock::now(), LogClock::realNs());
     /* 获取系统本地时间 */
     time_t timer = time(nullptr);
-    auto systime = localtime(&timer);
+    struct tm systime;
+    localtime_r(&timer, &systime);
+    gmtOff_ = systime.tm_gmtoff;
     path_ = path;
     suffix_ = suffix;
 
-    /* 填充文件名，eg：2022_09_17.log */
-    char fileName[LOG_NAME_LEN];
-    memset(fileName, 0, sizeof(fileName));
-    snprintf(fileName, LOG_NAME_LEN - 1, "%s/%04d_%02d_%02d%s",
-             path_, systime->tm_year + 1900, systime->tm_mon + 1, systime->tm_mday, suffix_);
-    /* 设置今天日期 */
-    today_ = systime->tm_mday;
-
     {
         std::lock_guard<std::mutex> locker(mtx_);
-        if (fp_)
-        {
-            this->flush();
-            fclose(fp_);
-            assert(fp_ == nullptr);
-        }
-        fp_ = fopen(fileName, "a");
-        if (fp_ == nullptr)
+        /* 填充文件名，eg：2022_09_17.log */
+        char fileName[LOG_NAME_LEN] = {0};
+        this->makeFileName(fileName, timer, 0);
+        period_ = this->period(timer);
+        part_ = 0;
+        this->openFile(fileName);
+    }
+    this->startMaintainer();
+    isOpen_.store(true, std::memory_order_release);
+}
+
+/*
+ * 设置切换策略，文件超过maxBytes字节或跨过periodS秒的周期(按本地时间对齐)时切换，0为不启用
+ */
+void Log::setRotate(size_t maxBytes, int periodS)
+{
+    std::lock_guard<std::mutex> locker(mtx_);
+    maxBytes_ = maxBytes;
+    periodS_ = periodS > 0 ? periodS : 0;
+    period_ = this->period(time(nullptr));
+}
+
+/*
+ * 设置保留策略：最多保留maxFiles个切换下来的文件、删除超过maxDays天的文件(0为不限)，
+ * compress为true时用gzip压缩切换下来的文件，编译时没有zlib则不压缩
+ * 多进程模式下各进程写自己的文件，maxFiles按进程计
+ */
+void Log::setRetention(int maxFiles, int maxDays, bool compress)
+{
+    std::lock_guard<std::mutex> locker(taskMtx_);
+    maxFiles_ = maxFiles > 0 ? maxFiles : 0;
+    maxDays_ = maxDays > 0 ? maxDays : 0;
+    compress_ = compress;
+}
+
+/*
+ * 设置格式化方式，二进制和文本之间切换时重新打开当天的日志文件
+ * 环形缓冲中的每条记录自带类型，切换前后写入的记录都能被正确处理
+ */
+void Log::setMode(LOG_MODE mode)
+{
+    std::lock_guard<std::mutex> locker(mtx_);
+    bool reopen = fd_ >= 0 && (mode == MODE_BINARY) != (mode_ == MODE_BINARY);
+    mode_ = mode;
+    isDeferred_.store(isAsync_ && mode_ != MODE_TEXT, std::memory_order_relaxed);
+    if (reopen)
+    {
+        time_t timer = time(nullptr);
+        char fileName[LOG_NAME_LEN] = {0};
+        this->makeFileName(fileName, timer, 0);
+        period_ = this->period(timer);
+        part_ = 0;
+        this->openFile(fileName);
+    }
+}
+
+/*
+ * 多进程模式下由worker调用：日志文件名带上本进程号并重新打开
+ * 文件大小和切换序号都是按进程记录的，各进程写自己的文件，
+ * 一个进程切换、压缩、删除文件时不会影响其它进程正在写的文件
+ */
+void Log::setPerProcess()
+{
+    std::lock_guard<std::mutex> locker(mtx_);
+    fileTag_ = getpid();
+    if (fd_ >= 0)
+    {
+        time_t timer = time(nullptr);
+        char fileName[LOG_NAME_LEN] = {0};
+        this->makeFileName(fileName, timer, 0);
+        period_ = this->period(timer);
+        part_ = 0;
+        this->openFile(fileName);
+    }
+}
+
+/*
+ * 是否延迟格式化，每条日志都会调用，不加锁
+ */
+bool Log::isDeferred()
+{
+    return isDeferred_.load(std::memory_order_relaxed);
+}
+
+/*
+ * 当前模式下日志文件的后缀，二进制日志固定为BINARY_SUFFIX_
+ */
+const char *Log::fileSuffix() const
+{
+    return (isAsync_ && mode_ == MODE_BINARY) ? BINARY_SUFFIX_ : suffix_;
+}
+
+/*
+ * 关闭原文件并打开新文件，只在初始化和切换模式时调用，调用者持有mtx_
+ */
+void Log::openFile(const char *fileName)
+{
+    if (fd_ >= 0)
+    {
+        close(fd_);
+    }
+    fd_ = this->openLogFile(fileName);
+    assert(fd_ >= 0);
+    fileName_ = fileName;
+    fileBytes_ = static_cast<size_t>(lseek(fd_, 0, SEEK_END));
+    formats_.clear();
+}
+
+/*
+ * 以追加方式打开日志文件，新建的二进制文件先写入文件头，失败返回-1
+ */
+int Log::openLogFile(const char *fileName) const
+{
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        /* 如果文件打开失败，可能是没有log目录。 */
+        mkdir(path_, 0777);
+        fd = open(fileName, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    }
+    if (fd >= 0 && isAsync_ && mode_ == MODE_BINARY && lseek(fd, 0, SEEK_END) == 0)
+    {
+        ssize_t n = ::write(fd, LogRecord::MAGIC_, sizeof(LogRecord::MAGIC_));
+        (void)n;
+    }
+    return fd;
+}
+
+/*
+ * 按sec所在周期生成日志文件名，周期短于一天时带上时分，part大于0时带上序号，多进程模式下带上进程号
+ * eg：2022_09_17.log、2022_09_17_1.log、2022_09_17_1300.log、2022_09_17.1234.log
+ */
+void Log::makeFileName(char *buff, time_t sec, int part) const
+{
+    /* 文件名取周期开始的时间 */
+    if (periodS_ > 0)
+    {
+        sec = static_cast<time_t>(this->period(sec) * periodS_ - gmtOff_);
+    }
+    struct tm systime;
+    localtime_r(&sec, &systime);
+    char stamp[64] = {0};
+    int n = snprintf(stamp, sizeof(stamp), "%04d_%02d_%02d",
+                     systime.tm_year + 1900, systime.tm_mon + 1, systime.tm_mday);
+    if (periodS_ > 0 && periodS_ < ROTATE_PERIOD_S_)
+    {
+        n += snprintf(stamp + n, sizeof(stamp) - n, "_%02d%02d", systime.tm_hour, systime.tm_min);
+    }
+    if (part > 0)
+    {
+        n += snprintf(stamp + n, sizeof(stamp) - n, "_%d", part);
+    }
+    if (fileTag_ > 0)
+    {
+        snprintf(stamp + n, sizeof(stamp) - n, ".%d", static_cast<int>(fileTag_));
+    }
+    snprintf(buff, LOG_NAME_LEN - 1, "%s/%s%s", path_, stamp, this->fileSuffix());
+}
+
+/*
+ * sec所在的切换周期，按本地时间对齐，不按时间切换时恒为0
+ */
+long Log::period(time_t sec) const
+{
+    return periodS_ > 0 ? (static_cast<long>(sec) + gmtOff_) / periodS_ : 0;
+}
+
+/*
+ * 设置每个调用点每秒最多输出的日志条数，0为不限
+ */
+void Log::setRateLimit(int perSecond)
+{
+    rateLimit_.store(perSecond < 0 ? 0 : perSecond, std::memory_order_relaxed);
+}
+
+int Log::rateLimit() const
+{
+    return rateLimit_.load(std::memory_order_relaxed);
+}
+
+/*
+ * 调用点第一次被抑制时登记，之后即使不再输出，被抑制的条数也会由reportSuppressed补写
+ */
+void Log::registerLimiter(LogLimiter *limiter, int level, const char *file, int line, const char *format)
+{
+    std::lock_guard<std::mutex> locker(limiterMtx_);
+    if (limiter->isRegistered_.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    limiter->level_ = level;
+    limiter->file_ = file;
+    limiter->line_ = line;
+    limiter->format_ = format;
+    limiters_.push_back(limiter);
+    limiter->isRegistered_.store(true, std::memory_order_release);
+}
+
+/*
+ * 补写一条汇总：某个调用点在过去seconds秒内被抑制了count条
+ */
+void Log::writeRepeated(int level, const char *file, int line, const char *format, uint32_t count, long seconds)
+{
+    const char *name = strrchr(file, '/');
+    this->write(static_cast<LOG_LEVEL>(level), "Message repeated %u times in %lds: \"%s\" (%s:%d)",
+                count, seconds, format, name == nullptr ? file : name + 1, line);
+}
+
+/*
+ * 每秒最多检查一次登记过的调用点，补写窗口已经结束的被抑制条数
+ */
+void Log::reportSuppressed(time_t sec)
+{
+    time_t last = reportSec_.load(std::memory_order_relaxed);
+    if (last == sec || reportSec_.compare_exchange_strong(last, sec, std::memory_order_relaxed) == false)
+    {
+        return;
+    }
+    std::vector<LogLimiter *> limiters;
+    {
+        std::lock_guard<std::mutex> locker(limiterMtx_);
+        if (limiters_.empty())
         {
-            /* 如果文件打开失败，可能是没有log目录。 */
-            mkdir(path, 0777);
-            fp_ = fopen(fileName, "a");
+            return;
         }
-        assert(fp_ != nullptr);
+        limiters = limiters_;
+    }
+    for (LogLimiter *limiter : limiters)
+    {
+        limiter->report(sec);
     }
 }
 
@@ -119,12 +444,11 @@ Log *Log::instance()
 }
 
 /*
- * 获取日志等级
+ * 获取日志等级，每条日志都会调用，不加锁
  */
 Log::LOG_LEVEL Log::getLevel()
 {
-    std::lock_guard<std::mutex> locker(mtx_);
-    return level_;
+    return static_cast<LOG_LEVEL>(level_.load(std::memory_order_relaxed));
 }
 
 /*
@@ -132,8 +456,7 @@ Log::LOG_LEVEL Log::getLevel()
  */
 void Log::setLevel(Log::LOG_LEVEL level)
 {
-    std::lock_guard<std::mutex> locker(mtx_);
-    level_ = level;
+    level_.store(level, std::memory_order_relaxed);
 }
 
 /*
@@ -141,128 +464,589 @@ void Log::setLevel(Log::LOG_LEVEL level)
  */
 bool Log::isOpen()
 {
-    std::lock_guard<std::mutex> locker(mtx_);
-    return isOpen_;
+    return isOpen_.load(std::memory_order_acquire);
+}
+
+/*
+ * 将异步写日志线程限定在cpus上运行
+ */
+bool Log::setAffinity(const std::vector<int> &cpus)
+{
+    if (thread_ == nullptr || cpus.empty())
+    {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+    {
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(thread_->native_handle(), sizeof(set), &set) == 0;
 }
 
 /*
- * 刷新文件流
+ * 唤醒后台线程立即写文件，同步模式下每条日志直接写入，无需刷新
  */
 void Log::flush()
 {
-    fflush(fp_);
+    if (isAsync_)
+    {
+        isWake_.store(true, std::memory_order_relaxed);
+        cond_.notify_one();
+    }
 }
 
 /*
- *
+ * 格式化一条日志，异步模式放入本线程的环形缓冲，同步模式直接写文件
+ * 时间前缀按秒缓存在线程局部变量中，同一秒内不再调用localtime
  */
 void Log::write(LOG_LEVEL level, const char *format, ...)
 {
+    static const char *titles[] = {"[DEBUG]: ", "[INFO]:  ", "[WARN]:  ", "[ERROR]: "};
+    static thread_local time_t lastSec = 0;
+    static thread_local char timeStr[80] = {0};
+    static thread_local char record[LogRecord::HEADER_LEN_ + LINE_MAX_LEN_ + 64];
+    char *line = record + LogRecord::HEADER_LEN_;
+
     /* 获取系统当前本地时间 */
     struct timeval now = {0};
     gettimeofday(&now, nullptr);
-    time_t tsec = now.tv_sec;
-    auto systime = localtime(&tsec);
+    if (now.tv_sec != lastSec)
+    {
+        struct tm systime;
+        time_t tsec = now.tv_sec;
+        localtime_r(&tsec, &systime);
+        snprintf(timeStr, sizeof(timeStr), "%d-%02d-%02d %02d:%02d:%02d",
+                 systime.tm_year + 1900, systime.tm_mon + 1, systime.tm_mday,
+                 systime.tm_hour, systime.tm_min, systime.tm_sec);
+        lastSec = now.tv_sec;
+    }
 
-    /* 如果时间不是今天或者日志行数超过5w行，就该换一个文件写了 */
-    if (today_ != systime->tm_mday || (lineCount_ && (lineCount_ % LOG_MAX_LEN == 0)))
+    int len = snprintf(line, LINE_MAX_LEN_, "%s.%06ld %s", timeStr, (long)now.tv_usec,
+                       titles[level >= DEBUG && level <= ERROR ? level : INFO]);
+    va_list vaList;
+    va_start(vaList, format);
+    int n = vsnprintf(line + len, LINE_MAX_LEN_, format, vaList);
+    va_end(vaList);
+    /* 超长的正文被截断 */
+    len += std::min(std::max(n, 0), LINE_MAX_LEN_ - 1);
+    line[len++] = '\n';
+
+    if (isAsync_ == false)
     {
-        std::lock_guard<std::mutex> locker(mtx_);
-        /* 生成新的文件名eg：2022_09_17_1.log */
-        char newFile[LOG_NAME_LEN] = {0};
-        /* 如果是日期变了 */
-        if (today_ != systime->tm_mday)
+        this->writeFile(line, len);
+        /* 同步模式没有后台线程，由写日志的线程顺带补写其他调用点被抑制的条数 */
+        this->reportSuppressed(now.tv_sec);
+        return;
+    }
+    LogRecord::putHeader(record, LogRecord::HEADER_LEN_ + len, LogRecord::TYPE_TEXT, level, 0);
+    this->pushRecord(level, record, LogRecord::HEADER_LEN_ + len);
+}
+
+/*
+ * 将一条记录放入本线程的环形缓冲，满了丢弃并计数
+ */
+void Log::pushRecord(LOG_LEVEL level, const char *record, size_t len)
+{
+    Ring *ring = this->localRing();
+    size_t used = 0;
+    if (ring->push(record, len, used) == false)
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        this->flush();
+        return;
+    }
+    /* 过半或出错时提前唤醒后台线程，否则等它定时来取 */
+    if (level == ERROR || used > ring->size_ / 2)
+    {
+        this->flush();
+    }
+}
+
+/*
+ * 获取本线程的环形缓冲，第一次写日志时创建并注册
+ * 指针单独放在无析构的线程局部变量中，快路径不经过线程局部对象的初始化检查
+ */
+Log::Ring *Log::localRing()
+{
+    static thread_local Ring *ring = nullptr;
+    if (ring == nullptr)
+    {
+        static thread_local RingHolder holder;
+        ring = new Ring(ringSize_);
+        holder.ring = ring;
+        MemoryGovernor::instance()->add(MemoryGovernor::LOG_QUEUE, ring->size_);
+        std::lock_guard<std::mutex> locker(ringMtx_);
+        rings_.push_back(ring);
+    }
+    return ring;
+}
+
+/*
+ * 写入当前日志文件，需要切换时通知维护线程，不在调用线程上打开或关闭文件
+ */
+void Log::writeFile(const char *data, size_t len)
+{
+    std::lock_guard<std::mutex> locker(mtx_);
+    fileBytes_ += len;
+    this->checkRotate(time(nullptr));
+    while (len > 0)
+    {
+        ssize_t n = ::write(fd_, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/*
+ * 跨过时间周期或超过大小上限时请求维护线程切换文件，调用者持有mtx_
+ * 新文件打开前日志继续写入原文件
+ */
+void Log::checkRotate(time_t sec)
+{
+    if (isRotating_ || sec < rotateRetry_ ||
+        ((maxBytes_ == 0 || fileBytes_ < maxBytes_) && this->period(sec) == period_))
+    {
+        return;
+    }
+    isRotating_ = true;
+    {
+        std::lock_guard<std::mutex> locker(taskMtx_);
+        isRotateRequested_ = true;
+    }
+    taskCond_.notify_one();
+}
+
+/*
+ * 启动维护线程，fork出的子进程中重新创建
+ */
+void Log::startMaintainer()
+{
+    if (maintainer_ != nullptr && maintainerPid_ == getpid())
+    {
+        return;
+    }
+    if (maintainer_ != nullptr)
+    {
+        maintainer_.release();
+        this->resetTaskSync();
+    }
+    maintainerPid_ = getpid();
+    maintainer_.reset(new std::thread([]()
+                                      { Log::instance()->maintain(); }));
+}
+
+/*
+ * fork出的子进程中重建维护线程使用的锁和条件变量
+ * 父进程的维护线程在fork时可能持有taskMtx_或正等在taskCond_上，子进程里没有这个线程，
+ * 沿用原来的对象会在加锁或析构(pthread_cond_destroy等待已不存在的等待者)时卡住
+ */
+void Log::resetTaskSync()
+{
+    new (&taskMtx_) std::mutex();
+    new (&taskCond_) std::condition_variable();
+}
+
+/*
+ * 维护线程，以最低优先级运行，处理切换请求和切换下来的文件
+ */
+void Log::maintain()
+{
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+    while (true)
+    {
+        bool rotate = false;
+        std::string fileName;
         {
-            snprintf(newFile, LOG_NAME_LEN - 1, "%s/%04d_%02d_%02d%s",
-                     path_, systime->tm_year, systime->tm_mon, systime->tm_mday, suffix_);
-            lineCount_ = 0;
-            today_ = systime->tm_mday;
+            std::unique_lock<std::mutex> locker(taskMtx_);
+            taskCond_.wait(locker, [this]()
+                           { return isMaintainStop_ || isRotateRequested_ || !rotated_.empty(); });
+            if (isMaintainStop_)
+            {
+                break;
+            }
+            rotate = isRotateRequested_;
+            isRotateRequested_ = false;
+            if (rotate == false)
+            {
+                fileName = rotated_.front();
+                rotated_.pop_front();
+            }
+        }
+        if (rotate)
+        {
+            this->rotateFile();
         }
-        /* 如果是行数超过5w行 */
         else
         {
-            snprintf(newFile, LOG_NAME_LEN - 1, "%s/%04d_%02d_%02d_%d%s",
-                     path_, systime->tm_year, systime->tm_mon, systime->tm_mday, lineCount_ / LOG_MAX_LEN, suffix_);
+            this->compressFile(fileName);
+            this->applyRetention();
         }
-
-        /* 刷新原文件并创建新文件 */
-        this->flush();
-        fclose(fp_);
-        fp_ = fopen(newFile, "a");
-        assert(fp_ != nullptr);
     }
+}
 
-    /* 正常向文件中写日志 */
+/*
+ * 打开新文件后在锁内替换fd，再在锁外关闭原文件，写日志的线程只在替换时短暂等待
+ */
+void Log::rotateFile()
+{
+    char fileName[LOG_NAME_LEN] = {0};
+    time_t sec = time(nullptr);
     {
         std::lock_guard<std::mutex> locker(mtx_);
-        lineCount_++;
-
-        char temp[1024] = {0};
+        /* 时区可能因夏令时变化 */
+        struct tm systime;
+        localtime_r(&sec, &systime);
+        gmtOff_ = systime.tm_gmtoff;
+        long period = this->period(sec);
+        this->makeFileName(fileName, sec, period == period_ ? part_ + 1 : 0);
+    }
+    int fd = this->openLogFile(fileName);
 
-        snprintf(temp, sizeof(temp), "%d-%02d-%02d %02d:%02d:%02d.%06ld ",
-                 systime->tm_year + 1900, systime->tm_mon + 1, systime->tm_mday,
-                 systime->tm_hour, systime->tm_min, systime->tm_sec, now.tv_usec);
-        buffer_.append(temp, strlen(temp));
-        memset(temp, 0, sizeof(temp));
+    int oldFd = -1;
+    std::string oldName;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        isRotating_ = false;
+        if (fd < 0)
+        {
+            /* 打开失败时继续写原文件，隔一段时间再试，不让每次写入都重新请求切换 */
+            rotateRetry_ = sec + ROTATE_RETRY_S_;
+            return;
+        }
+        rotateRetry_ = 0;
+        long period = this->period(sec);
+        part_ = period == period_ ? part_ + 1 : 0;
+        period_ = period;
+        oldFd = fd_;
+        oldName = fileName_;
+        fd_ = fd;
+        fileName_ = fileName;
+        fileBytes_ = static_cast<size_t>(lseek(fd, 0, SEEK_END));
+        formats_.clear();
+    }
+    close(oldFd);
 
-        /* 添加日志头 */
-        appendLogLevelTitle(level);
+    std::lock_guard<std::mutex> locker(taskMtx_);
+    rotated_.push_back(oldName);
+}
 
-        va_list vaList;
-        va_start(vaList, format);
-        vsnprintf(temp, sizeof(temp), format, vaList);
-        va_end(vaList);
+/*
+ * 用gzip压缩切换下来的文件，成功后删除原文件，目标已存在(其他进程已压缩)时跳过
+ */
+void Log::compressFile(const std::string &fileName)
+{
+#ifdef LOG_USE_ZLIB
+    {
+        std::lock_guard<std::mutex> locker(taskMtx_);
+        if (compress_ == false)
+        {
+            return;
+        }
+    }
+    int in = open(fileName.data(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        return;
+    }
+    std::string gzName = fileName + ".gz";
+    gzFile out = gzopen(gzName.data(), "wbx6");
+    if (out == nullptr)
+    {
+        close(in);
+        return;
+    }
+    char buff[65536];
+    ssize_t n = 0;
+    bool ok = true;
+    while ((n = read(in, buff, sizeof(buff))) > 0)
+    {
+        if (gzwrite(out, buff, static_cast<unsigned>(n)) != n)
+        {
+            ok = false;
+            break;
+        }
+    }
+    close(in);
+    if (gzclose(out) != Z_OK || n < 0 || ok == false)
+    {
+        unlink(gzName.data());
+        return;
+    }
+    unlink(fileName.data());
+#else
+    (void)fileName;
+#endif
+}
 
-        buffer_.append(temp, strlen(temp));
-        buffer_.append("\n\0", 2);
+/*
+ * 文件名中的进程号，不带进程号(单进程或master的文件)时返回0
+ */
+static pid_t fileOwner(const std::string &base, size_t suffixLen)
+{
+    std::string stem = base.substr(0, base.size() - suffixLen);
+    size_t dot = stem.rfind('.');
+    if (dot == std::string::npos || dot + 1 == stem.size() ||
+        stem.find_first_not_of("0123456789", dot + 1) != std::string::npos)
+    {
+        return 0;
+    }
+    return static_cast<pid_t>(atoi(stem.data() + dot + 1));
+}
 
-        /* 异步写，放入消息队列中 */
-        if (isAsync_ == true && queue_ != nullptr && queue_->full() != true)
+/*
+ * 按保留策略删除日志目录中切换下来的旧文件，只处理本模块生成的文件名
+ * 多进程模式下跳过其它仍在运行的进程的文件，它们可能正在写；
+ * worker不处理不带进程号的文件，那是master的
+ */
+void Log::applyRetention()
+{
+    int maxFiles = 0;
+    int maxDays = 0;
+    {
+        std::lock_guard<std::mutex> locker(taskMtx_);
+        maxFiles = maxFiles_;
+        maxDays = maxDays_;
+    }
+    if (maxFiles == 0 && maxDays == 0)
+    {
+        return;
+    }
+    std::string current;
+    pid_t tag = 0;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        current = fileName_;
+        tag = fileTag_;
+    }
+    DIR *dir = opendir(path_);
+    if (dir == nullptr)
+    {
+        return;
+    }
+    /* 修改时间和文件名，按时间从新到旧排序 */
+    std::vector<std::pair<time_t, std::string>> files;
+    struct dirent *entry = nullptr;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        std::string name = entry->d_name;
+        if (name.empty() || name[0] < '0' || name[0] > '9')
         {
-            queue_->push_back(buffer_.retrieveAlltoString());
+            continue;
         }
-        else
+        std::string base = name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0 ? name.substr(0, name.size() - 3) : name;
+        std::string suffix = suffix_;
+        std::string binary = BINARY_SUFFIX_;
+        bool isText = base.size() > suffix.size() && base.compare(base.size() - suffix.size(), suffix.size(), suffix) == 0;
+        bool isBinary = base.size() > binary.size() && base.compare(base.size() - binary.size(), binary.size(), binary) == 0;
+        std::string full = std::string(path_) + "/" + name;
+        struct stat st;
+        if ((isText == false && isBinary == false) || full == current || stat(full.data(), &st) < 0 || S_ISREG(st.st_mode) == 0)
+        {
+            continue;
+        }
+        pid_t owner = fileOwner(base, isText ? suffix.size() : binary.size());
+        if (owner == 0 ? tag > 0 : (owner != getpid() && (kill(owner, 0) == 0 || errno == EPERM)))
         {
-            fputs(buffer_.peek(), fp_);
+            continue;
+        }
+        files.push_back({st.st_mtime, full});
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end(), [](const std::pair<time_t, std::string> &a, const std::pair<time_t, std::string> &b)
+              { return a.first != b.first ? a.first > b.first : a.second > b.second; });
+    time_t expire = time(nullptr) - static_cast<time_t>(maxDays) * 86400;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if ((maxFiles > 0 && static_cast<int>(i) >= maxFiles) || (maxDays > 0 && files[i].first < expire))
+        {
+            unlink(files[i].second.data());
         }
-        buffer_.retrieveAll();
     }
 }
 
 /*
- * 添加日志头
+ * 后台线程，每FLUSH_INTERVAL_MS_或被唤醒时取空所有环形缓冲，退出前再取一次
  */
-void Log::appendLogLevelTitle(LOG_LEVEL level)
+void Log::asyncWrite()
 {
-    switch (level)
+    while (true)
     {
-    case Log::DEBUG:
-        buffer_.append("[DEBUG]: ", 9);
-        break;
-    case Log::INFO:
-        buffer_.append("[INFO]:  ", 9);
-        break;
-    case Log::WARN:
-        buffer_.append("[WARN]:  ", 9);
-        break;
-    case Log::ERROR:
-        buffer_.append("[ERROR]: ", 9);
-        break;
-    default:
-        buffer_.append("[INFO]:  ", 9);
-        break;
+        {
+            std::unique_lock<std::mutex> locker(mtx_);
+            if (isStop_)
+            {
+                break;
+            }
+            cond_.wait_for(locker, std::chrono::milliseconds(FLUSH_INTERVAL_MS_), [this]()
+                           { return isStop_ || isWake_.load(std::memory_order_relaxed); });
+            isWake_.store(false, std::memory_order_relaxed);
+        }
+        this->reportSuppressed(time(nullptr));
+        this->drain();
     }
+    this->drain();
 }
 
 /*
- * 异步写，从阻塞队列取出日志内容写入文件
+ * 取出所有环形缓冲中的记录，文本模式下格式化，二进制模式下补上格式串后原样输出，
+ * 合并为一次write写入文件，释放已退出线程的环形缓冲
  */
-void Log::asyncWrite()
+void Log::drain()
 {
-    std::string str = std::string("");
-    while (queue_->pop(str))
+    std::lock_guard<std::mutex> ringLocker(ringMtx_);
+    /* 先拷出所有记录并归还空间，格式化和写文件期间生产者可以继续写入 */
+    scratch_.clear();
+    for (Ring *ring : rings_)
+    {
+        size_t tail = ring->tail_.load(std::memory_order_relaxed);
+        size_t head = ring->head_.load(std::memory_order_acquire);
+        size_t len = head - tail;
+        if (len == 0)
+        {
+            continue;
+        }
+        size_t pos = tail & (ring->size_ - 1);
+        size_t first = std::min(len, ring->size_ - pos);
+        scratch_.append(ring->data_.get() + pos, first);
+        scratch_.append(ring->data_.get(), len - first);
+        ring->tail_.store(head, std::memory_order_release);
+    }
+
+    /* 环形缓冲满时丢弃的条数作为一条文本记录 */
+    uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+    {
+        char note[64] = {0};
+        int n = snprintf(note + LogRecord::HEADER_LEN_, sizeof(note) - LogRecord::HEADER_LEN_,
+                         "[WARN]:  %lu log lines dropped\n", (unsigned long)dropped);
+        LogRecord::putHeader(note, LogRecord::HEADER_LEN_ + n, LogRecord::TYPE_TEXT, WARN, 0);
+        scratch_.append(note, LogRecord::HEADER_LEN_ + n);
+    }
+
+    if (scratch_.empty() == false)
     {
         std::lock_guard<std::mutex> locker(mtx_);
-        fputs(str.data(), fp_);
+
+        out_.clear();
+        clock_.sync(LogClock::now(), LogClock::realNs());
+        if (mode_ == MODE_BINARY)
+        {
+            /* 每批记录前写一次时钟校准，解码时用它换算时间 */
+            char sync[LogRecord::HEADER_LEN_ + 24];
+            uint64_t tick = clock_.now();
+            int64_t ns = LogClock::realNs();
+            double rate = clock_.nsPerTick();
+            LogRecord::putHeader(sync, sizeof(sync), LogRecord::TYPE_SYNC, 0, 0);
+            memcpy(sync + LogRecord::HEADER_LEN_, &tick, 8);
+            memcpy(sync + LogRecord::HEADER_LEN_ + 8, &ns, 8);
+            memcpy(sync + LogRecord::HEADER_LEN_ + 16, &rate, 8);
+            out_.append(sync, sizeof(sync));
+        }
+        size_t p = 0;
+        while (p + LogRecord::HEADER_LEN_ <= scratch_.size())
+        {
+            LogRecord::Header header = LogRecord::getHeader(&scratch_[p]);
+            if (header.len < LogRecord::HEADER_LEN_ || p + header.len > scratch_.size())
+            {
+                break;
+            }
+            this->appendRecord(&scratch_[p], header);
+            p += header.len;
+        }
+
+        const char *data = out_.data();
+        size_t len = out_.size();
+        fileBytes_ += len;
+        this->checkRotate(time(nullptr));
+        while (len > 0)
+        {
+            ssize_t n = ::write(fd_, data, len);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            data += n;
+            len -= n;
+        }
     }
-}
\ No newline at end of file
+
+    /* 所属线程已退出且已取空的环形缓冲 */
+    for (auto it = rings_.begin(); it != rings_.end();)
+    {
+        Ring *ring = *it;
+        if (ring->retired_.load(std::memory_order_acquire) && ring->used() == 0)
+        {
+            MemoryGovernor::instance()->sub(MemoryGovernor::LOG_QUEUE, ring->size_);
+            delete ring;
+            it = rings_.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
+
+/*
+ * 将一条记录按当前模式追加到out_，调用者持有mtx_
+ */
+void Log::appendRecord(const char *record, const LogRecord::Header &header)
+{
+    bool binary = mode_ == MODE_BINARY;
+    if (header.type == LogRecord::TYPE_TEXT)
+    {
+        if (binary)
+        {
+            out_.append(record, header.len);
+        }
+        else
+        {
+            out_.append(record + LogRecord::HEADER_LEN_, header.len - LogRecord::HEADER_LEN_);
+        }
+        return;
+    }
+    if (header.type != LogRecord::TYPE_LOG || header.len < LogRecord::LOG_HEADER_LEN_)
+    {
+        return;
+    }
+    uint64_t tick = 0;
+    uint64_t fmt = 0;
+    memcpy(&tick, record + LogRecord::HEADER_LEN_, 8);
+    memcpy(&fmt, record + LogRecord::HEADER_LEN_ + 8, 8);
+    const char *format = reinterpret_cast<const char *>(static_cast<uintptr_t>(fmt));
+    if (binary)
+    {
+        /* 格式串在本文件中第一次出现，先写出它的内容 */
+        if (formats_.insert(fmt).second)
+        {
+            size_t len = strlen(format);
+            char head[LogRecord::HEADER_LEN_ + 8];
+            LogRecord::putHeader(head, sizeof(head) + len, LogRecord::TYPE_FORMAT, 0, 0);
+            memcpy(head + LogRecord::HEADER_LEN_, &fmt, 8);
+            out_.append(head, sizeof(head));
+            out_.append(format, len);
+        }
+        out_.append(record, header.len);
+        return;
+    }
+    char prefix[64];
+    size_t n = LogRecord::formatTime(clock_.toNs(tick), prefix, sizeof(prefix));
+    out_.append(prefix, n);
+    out_.append(LogRecord::levelTitle(header.level));
+    out_ += LogRecord::format(format, record + LogRecord::LOG_HEADER_LEN_, record + header.len, header.argc);
+    out_.push_back('\n');
+}
@@ -0,0 +1,286 @@
+#include <logrecord.h>
+
+#include <ctime>
+#include <algorithm>
+#include <cstdio>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+const size_t LogRecord::HEADER_LEN_;
+const size_t LogRecord::LOG_HEADER_LEN_;
+const size_t LogRecord::STR_MAX_LEN_;
+const char LogRecord::MAGIC_[8] = {'W', 'S', 'B', 'L', 'O', 'G', '1', '\n'};
+
+/*
+ * 写入记录头
+ */
+void LogRecord::putHeader(char *p, size_t len, TYPE type, int level, int argc)
+{
+    Header header;
+    header.len = static_cast<uint32_t>(len);
+    header.type = static_cast<uint8_t>(type);
+    header.level = static_cast<uint8_t>(level);
+    header.argc = static_cast<uint16_t>(argc);
+    memcpy(p, &header, sizeof(header));
+}
+
+/*
+ * 读出记录头，p不要求对齐
+ */
+LogRecord::Header LogRecord::getHeader(const char *p)
+{
+    Header header;
+    memcpy(&header, p, sizeof(header));
+    return header;
+}
+
+/*
+ * 按格式串和编码后的参数生成日志正文
+ * 长度修饰符以记录中的参数类型为准，参数类型和转换符不一致时尽量按参数类型输出
+ */
+std::string LogRecord::format(const char *fmt, const char *args, const char *end, int argc)
+{
+    std::string out;
+    char buff[512];
+    int used = 0;
+    while (*fmt != '\0')
+    {
+        if (*fmt != '%')
+        {
+            const char *next = strchr(fmt, '%');
+            size_t len = next == nullptr ? strlen(fmt) : static_cast<size_t>(next - fmt);
+            out.append(fmt, len);
+            fmt += len;
+            continue;
+        }
+        if (fmt[1] == '%')
+        {
+            out.push_back('%');
+            fmt += 2;
+            continue;
+        }
+
+        /* 取出一个参数，tag为0表示参数不够 */
+        auto next = [&](char &tag, int64_t &i, double &f, std::string &s)
+        {
+            tag = 0;
+            if (used >= argc || args >= end)
+            {
+                return;
+            }
+            used++;
+            tag = *args++;
+            if (tag == 's')
+            {
+                uint16_t len = 0;
+                memcpy(&len, args, 2);
+                s.assign(args + 2, len);
+                args += 2 + len;
+                return;
+            }
+            memcpy(tag == 'f' ? static_cast<void *>(&f) : static_cast<void *>(&i), args, 8);
+            args += 8;
+        };
+
+        /* 标志、宽度、精度原样保留，'*'替换为参数值，长度修饰符丢弃 */
+        std::string spec = "%";
+        fmt++;
+        while (*fmt != '\0' && strchr("-+ #0", *fmt) != nullptr)
+        {
+            spec.push_back(*fmt++);
+        }
+        for (int part = 0; part < 2; part++)
+        {
+            if (part == 1)
+            {
+                if (*fmt != '.')
+                {
+                    break;
+                }
+                spec.push_back(*fmt++);
+            }
+            if (*fmt == '*')
+            {
+                char tag;
+                int64_t i = 0;
+                double f = 0;
+                std::string s;
+                next(tag, i, f, s);
+                spec += std::to_string(i);
+                fmt++;
+            }
+            while (*fmt >= '0' && *fmt <= '9')
+            {
+                spec.push_back(*fmt++);
+            }
+        }
+        while (*fmt != '\0' && strchr("hlLqjzt", *fmt) != nullptr)
+        {
+            fmt++;
+        }
+        char conv = *fmt;
+        if (conv == '\0')
+        {
+            break;
+        }
+        fmt++;
+        if (conv == 'n')
+        {
+            continue;
+        }
+
+        char tag;
+        int64_t i = 0;
+        double f = 0;
+        std::string s;
+        next(tag, i, f, s);
+        if (tag == 0)
+        {
+            out += "(missing)";
+            continue;
+        }
+        if (tag == 'f')
+        {
+            i = static_cast<int64_t>(f);
+        }
+        else
+        {
+            f = tag == 'i' ? static_cast<double>(i) : static_cast<double>(static_cast<uint64_t>(i));
+        }
+
+        int n = 0;
+        if (conv == 's' || tag == 's')
+        {
+            if (tag != 's')
+            {
+                s = tag == 'f' ? std::to_string(f) : (tag == 'i' ? std::to_string(i) : std::to_string(static_cast<uint64_t>(i)));
+            }
+            n = snprintf(buff, sizeof(buff), (spec + "s").data(), s.data());
+        }
+        else if (strchr("eEfFgGaA", conv) != nullptr)
+        {
+            n = snprintf(buff, sizeof(buff), (spec + conv).data(), f);
+        }
+        else if (conv == 'p')
+        {
+            n = snprintf(buff, sizeof(buff), (spec + conv).data(), reinterpret_cast<void *>(static_cast<uintptr_t>(i)));
+        }
+        else if (conv == 'c')
+        {
+            n = snprintf(buff, sizeof(buff), (spec + conv).data(), static_cast<int>(i));
+        }
+        else if (conv == 'd' || conv == 'i')
+        {
+            n = snprintf(buff, sizeof(buff), (spec + "ll" + conv).data(), static_cast<long long>(i));
+        }
+        else
+        {
+            n = snprintf(buff, sizeof(buff), (spec + "ll" + conv).data(), static_cast<unsigned long long>(i));
+        }
+        if (n > 0)
+        {
+            out.append(buff, std::min(static_cast<size_t>(n), sizeof(buff) - 1));
+        }
+    }
+    return out;
+}
+
+/*
+ * 将纳秒时间格式化为日志时间前缀，eg：2022-09-17 10:00:00.000001 ，返回长度
+ */
+size_t LogRecord::formatTime(int64_t ns, char *buff, size_t size)
+{
+    time_t sec = static_cast<time_t>(ns / 1000000000);
+    long usec = static_cast<long>(ns % 1000000000 / 1000);
+    struct tm systime;
+    localtime_r(&sec, &systime);
+    int n = snprintf(buff, size, "%d-%02d-%02d %02d:%02d:%02d.%06ld ",
+                     systime.tm_year + 1900, systime.tm_mon + 1, systime.tm_mday,
+                     systime.tm_hour, systime.tm_min, systime.tm_sec, usec);
+    return n < 0 ? 0 : std::min(static_cast<size_t>(n), size - 1);
+}
+
+/*
+ * 日志等级对应的标题
+ */
+const char *LogRecord::levelTitle(int level)
+{
+    static const char *titles[] = {"[DEBUG]: ", "[INFO]:  ", "[WARN]:  ", "[ERROR]: "};
+    return titles[level >= 0 && level <= 3 ? level : 1];
+}
+
+LogClock::LogClock() : hasBase_(false), baseTick_(0), baseNs_(0), lastTick_(0), lastNs_(0), nsPerTick_(1.0)
+{
+}
+
+/*
+ * 读取时钟计数，x86上为TSC，其他平台为单调时钟的纳秒数
+ */
+uint64_t LogClock::now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * 当前实际时间(纳秒)
+ */
+int64_t LogClock::realNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * 用同一时刻的计数和实际时间校准，频率取第一次校准到本次的平均值
+ */
+void LogClock::sync(uint64_t tick, int64_t ns)
+{
+    if (hasBase_ == false)
+    {
+        hasBase_ = true;
+        baseTick_ = tick;
+        baseNs_ = ns;
+    }
+    else if (tick > baseTick_ && ns > baseNs_)
+    {
+        nsPerTick_ = static_cast<double>(ns - baseNs_) / static_cast<double>(tick - baseTick_);
+    }
+    lastTick_ = tick;
+    lastNs_ = ns;
+}
+
+/*
+ * 直接设置锚点和频率，解码时按文件中的SYNC记录设置
+ */
+void LogClock::set(uint64_t tick, int64_t ns, double nsPerTick)
+{
+    hasBase_ = true;
+    lastTick_ = tick;
+    lastNs_ = ns;
+    nsPerTick_ = nsPerTick;
+}
+
+/*
+ * 计数换算为实际时间
+ */
+int64_t LogClock::toNs(uint64_t tick) const
+{
+    double delta = static_cast<double>(static_cast<int64_t>(tick - lastTick_));
+    return lastNs_ + static_cast<int64_t>(delta * nsPerTick_);
+}
+
+/*
+ * 当前估计的每个计数的纳秒数
+ */
+double LogClock::nsPerTick() const
+{
+    return nsPerTick_;
+}
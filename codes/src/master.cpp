@@ -0,0 +1,352 @@
+#include <master.h>
+
+#include <new>
+#include <cerrno>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/*
+ * 构造函数，分配共享内存统计区
+ */
+Master::Master(int port, int workerNum, const WorkerFunc &worker, bool bindCpu)
+    : port_(port), bindCpu_(bindCpu), isStop_(false), worker_(worker), stat_(nullptr), statNum_(workerNum * 2),
+      workers_(workerNum)
+{
+    assert(workerNum > 0);
+    void *mem = mmap(nullptr, sizeof(ServerStat) * statNum_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(mem != MAP_FAILED);
+    stat_ = static_cast<ServerStat *>(mem);
+    for (size_t i = 0; i < statNum_; i++)
+    {
+        new (&stat_[i]) ServerStat();
+        stat_[i].slot = static_cast<int>(i);
+    }
+    for (int i = 0; i < workerNum; i++)
+    {
+        workers_[i] = {-1, 0, 0, static_cast<size_t>(i), -1};
+    }
+    if (bindCpu_)
+    {
+        long cpuNum = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int i = 0; i < workerNum; i++)
+        {
+            workers_[i].cpu = static_cast<int>(i % (cpuNum > 0 ? cpuNum : 1));
+        }
+    }
+}
+
+/*
+ * 析构函数，释放共享内存和监听socket
+ */
+Master::~Master()
+{
+    for (int fd : listenFds_)
+    {
+        close(fd);
+    }
+    munmap(stat_, sizeof(ServerStat) * statNum_);
+}
+
+/*
+ * master主循环：同步等待信号，处理worker退出、重载和停止
+ */
+int Master::run()
+{
+    /* master只写同步日志，worker初始化时会重新打开自己的日志 */
+    Log::instance()->init(Log::INFO, 0);
+    /* 监听socket始终由master持有，worker重启或重载时排队中的连接不会丢失 */
+    size_t listenNum = bindCpu_ ? workers_.size() : 1;
+    for (size_t i = 0; i < listenNum; i++)
+    {
+        int fd = Webserver::listenSocket(port_, workers_[i].cpu);
+        if (fd < 0)
+        {
+            LOG_ERROR("master listen failed");
+            return 1;
+        }
+        listenFds_.push_back(fd);
+    }
+
+    /* 阻塞关心的信号，改为sigtimedwait同步处理，fork出的worker会恢复原来的信号掩码 */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &oldMask_);
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        this->spawn(i);
+    }
+    LOG_INFO("master %d start, workers: %zu", getpid(), workers_.size());
+
+    time_t nextReport = time(nullptr) + REPORT_INTERVAL_S_;
+    while (true)
+    {
+        /* 超时取下一次汇总和延迟拉起中较早的一个，等待期间照常响应信号 */
+        struct timespec timeout = {this->nextTimeout(nextReport), 0};
+        int sig = sigtimedwait(&mask, nullptr, &timeout);
+        if (sig == SIGCHLD)
+        {
+            this->reap();
+        }
+        else if (sig == SIGHUP)
+        {
+            this->reload();
+        }
+        else if (sig == SIGINT || sig == SIGTERM)
+        {
+            this->stopAll();
+        }
+        this->respawn();
+        if (time(nullptr) >= nextReport)
+        {
+            this->report();
+            nextReport = time(nullptr) + REPORT_INTERVAL_S_;
+        }
+        /* 停止后等所有worker(包括正在排空的旧worker)退出 */
+        if (isStop_)
+        {
+            bool alive = !retired_.empty();
+            for (auto &w : workers_)
+            {
+                alive = alive || w.pid > 0;
+            }
+            if (alive == false)
+            {
+                break;
+            }
+        }
+    }
+    this->report();
+    LOG_INFO("master %d exit", getpid());
+    sigprocmask(SIG_SETMASK, &oldMask_, nullptr);
+    return 0;
+}
+
+/*
+ * 在指定槽位fork一个worker，子进程运行worker回调后退出
+ */
+void Master::spawn(size_t slot)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        LOG_ERROR("fork worker failed");
+        return;
+    }
+    ServerStat *stat = &stat_[workers_[slot].statSlot];
+    if (pid == 0)
+    {
+        sigprocmask(SIG_SETMASK, &oldMask_, nullptr);
+        stat->connections = 0;
+        worker_(listenFds_[bindCpu_ ? slot : 0], stat, workers_[slot].cpu);
+        exit(0);
+    }
+    workers_[slot].pid = pid;
+    workers_[slot].startTime = time(nullptr);
+    workers_[slot].respawnTime = 0;
+    LOG_INFO("spawn worker[%zu] pid %d, stat slot %zu", slot, pid, workers_[slot].statSlot);
+}
+
+/*
+ * 回收退出的worker，非停止状态下重新拉起
+ */
+void Master::reap()
+{
+    int status = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        auto old = std::find_if(retired_.begin(), retired_.end(), [pid](const Worker &w)
+                                { return w.pid == pid; });
+        if (old != retired_.end())
+        {
+            /* 累计计数保留在槽位里继续参与汇总，当前连接数清零后槽位可以给下一次重载使用 */
+            stat_[old->statSlot].connections = 0;
+            retired_.erase(old);
+            LOG_INFO("retired worker pid %d exit", pid);
+            continue;
+        }
+        for (size_t i = 0; i < workers_.size(); i++)
+        {
+            if (workers_[i].pid != pid)
+            {
+                continue;
+            }
+            workers_[i].pid = -1;
+            stat_[workers_[i].statSlot].connections = 0;
+            if (WIFSIGNALED(status))
+            {
+                LOG_ERROR("worker[%zu] pid %d killed by signal %d", i, pid, WTERMSIG(status));
+            }
+            else if (WEXITSTATUS(status) != 0 || isStop_ == false)
+            {
+                LOG_WARN("worker[%zu] pid %d exit status %d", i, pid, WEXITSTATUS(status));
+            }
+            else
+            {
+                LOG_INFO("worker[%zu] pid %d exit", i, pid);
+            }
+            if (isStop_ == false)
+            {
+                /* 刚启动就退出说明启动即崩溃，由主循环稍后拉起，master不能在这里睡眠 */
+                time_t now = time(nullptr);
+                if (now - workers_[i].startTime < RESPAWN_DELAY_S_)
+                {
+                    workers_[i].respawnTime = now + RESPAWN_DELAY_S_;
+                    LOG_WARN("worker[%zu] respawn in %d s", i, RESPAWN_DELAY_S_);
+                }
+                else
+                {
+                    this->spawn(i);
+                }
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * 拉起已到延迟时间的worker
+ */
+void Master::respawn()
+{
+    time_t now = time(nullptr);
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        if (workers_[i].respawnTime == 0 || workers_[i].pid > 0 || now < workers_[i].respawnTime)
+        {
+            continue;
+        }
+        workers_[i].respawnTime = 0;
+        if (isStop_ == false)
+        {
+            this->spawn(i);
+        }
+    }
+}
+
+/*
+ * sigtimedwait的超时秒数：到下一次汇总或最早一个延迟拉起的时间
+ */
+int Master::nextTimeout(time_t nextReport) const
+{
+    time_t wakeup = nextReport;
+    for (auto &w : workers_)
+    {
+        if (w.respawnTime > 0)
+        {
+            wakeup = std::min(wakeup, w.respawnTime);
+        }
+    }
+    return static_cast<int>(std::max(wakeup - time(nullptr), static_cast<time_t>(0)));
+}
+
+/*
+ * 找一个当前worker和排空中的旧worker都没有使用的统计槽位
+ */
+bool Master::findFreeStat(size_t &statSlot) const
+{
+    for (size_t s = 0; s < statNum_; s++)
+    {
+        bool isUsed = false;
+        for (auto &w : workers_)
+        {
+            isUsed = isUsed || w.statSlot == s;
+        }
+        for (auto &w : retired_)
+        {
+            isUsed = isUsed || w.statSlot == s;
+        }
+        if (isUsed == false)
+        {
+            statSlot = s;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * 平滑重载：先拉起一组新worker，再通知旧worker停止accept并排空
+ * 监听socket一直由master持有，切换期间不会拒绝连接
+ * 旧worker排空期间仍在写自己的统计槽位，新worker换用空闲槽位；
+ * 上一次重载的旧worker还没退完、没有空闲槽位时，该worker本次不替换
+ */
+void Master::reload()
+{
+    if (isStop_)
+    {
+        return;
+    }
+    LOG_INFO("master reload");
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        Worker old = workers_[i];
+        if (old.pid > 0)
+        {
+            size_t statSlot = 0;
+            if (this->findFreeStat(statSlot) == false)
+            {
+                LOG_WARN("worker[%zu] not reloaded, previous workers still draining", i);
+                continue;
+            }
+            workers_[i].statSlot = statSlot;
+        }
+        this->spawn(i);
+        if (old.pid > 0)
+        {
+            retired_.push_back(old);
+            kill(old.pid, SIGTERM);
+        }
+    }
+}
+
+/*
+ * 停止：通知所有worker排空后退出，不再拉起
+ */
+void Master::stopAll()
+{
+    if (isStop_)
+    {
+        return;
+    }
+    isStop_ = true;
+    LOG_INFO("master stop");
+    for (auto &w : workers_)
+    {
+        if (w.pid > 0)
+        {
+            kill(w.pid, SIGTERM);
+        }
+    }
+    for (auto &w : retired_)
+    {
+        kill(w.pid, SIGTERM);
+    }
+}
+
+/*
+ * 汇总共享内存中的worker统计并输出
+ */
+void Master::report()
+{
+    int connections = 0;
+    uint64_t accepted = 0;
+    uint64_t requests = 0;
+    uint64_t shed = 0;
+    for (size_t i = 0; i < statNum_; i++)
+    {
+        connections += stat_[i].connections;
+        accepted += stat_[i].accepted;
+        requests += stat_[i].requests;
+        shed += stat_[i].shed;
+    }
+    LOG_INFO("workers: %zu, connections: %d, accepted: %lu, requests: %lu, shed: %lu",
+             workers_.size(), connections, accepted, requests, shed);
+}
@@ -0,0 +1,142 @@
+#include <memgovernor.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * 私有化构造函数，单例模式，默认不限制
+ */
+MemoryGovernor::MemoryGovernor() : usage_{}, softLimit_(0), hardLimit_(0)
+{
+}
+
+/*
+ * 单例模式，获取内存记账实例
+ */
+MemoryGovernor *MemoryGovernor::instance()
+{
+    static MemoryGovernor governor;
+    return &governor;
+}
+
+/*
+ * 设置软上限和硬上限(字节)，0为不限
+ */
+void MemoryGovernor::init(size_t softLimit, size_t hardLimit)
+{
+    softLimit_ = softLimit;
+    hardLimit_ = hardLimit;
+}
+
+/*
+ * 子系统新占用bytes字节
+ */
+void MemoryGovernor::add(SUBSYSTEM sub, size_t bytes)
+{
+    usage_[sub].fetch_add(bytes, std::memory_order_relaxed);
+}
+
+/*
+ * 子系统释放bytes字节
+ */
+void MemoryGovernor::sub(SUBSYSTEM sub, size_t bytes)
+{
+    usage_[sub].fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+/*
+ * 子系统当前占用的字节数
+ */
+size_t MemoryGovernor::usage(SUBSYSTEM sub) const
+{
+    return usage_[sub].load(std::memory_order_relaxed);
+}
+
+/*
+ * 所有子系统合计占用的字节数
+ */
+size_t MemoryGovernor::total() const
+{
+    size_t sum = 0;
+    for (int i = 0; i < SUBSYSTEM_NUM; i++)
+    {
+        sum += usage_[i].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+/*
+ * 返回软上限
+ */
+size_t MemoryGovernor::softLimit() const
+{
+    return softLimit_;
+}
+
+/*
+ * 返回硬上限
+ */
+size_t MemoryGovernor::hardLimit() const
+{
+    return hardLimit_;
+}
+
+/*
+ * 当前内存压力等级
+ */
+MemoryGovernor::PRESSURE MemoryGovernor::pressure() const
+{
+    size_t sum = this->total();
+    if (hardLimit_ > 0 && sum >= hardLimit_)
+    {
+        return PRESSURE_HARD;
+    }
+    if (softLimit_ > 0 && sum >= softLimit_)
+    {
+        return PRESSURE_SOFT;
+    }
+    return PRESSURE_NONE;
+}
+
+/*
+ * 各子系统占用情况，用于输出日志
+ */
+std::string MemoryGovernor::report() const
+{
+    char buff[256] = {0};
+    snprintf(buff, sizeof(buff), "total: %zu (conn buffer: %zu, file cache: %zu, log queue: %zu), soft: %zu, hard: %zu",
+             this->total(), this->usage(CONN_BUFFER), this->usage(FILE_CACHE), this->usage(LOG_QUEUE),
+             this->softLimit(), this->hardLimit());
+    return buff;
+}
+
+/*
+ * 读取所在cgroup的内存上限，先找cgroup v2再找v1，没有限制返回0
+ */
+size_t MemoryGovernor::cgroupLimit()
+{
+    const char *paths[] = {
+        "/sys/fs/cgroup/memory.max",
+        "/sys/fs/cgroup/memory/memory.limit_in_bytes",
+    };
+    for (const char *path : paths)
+    {
+        FILE *fp = fopen(path, "r");
+        if (fp == nullptr)
+        {
+            continue;
+        }
+        char line[64] = {0};
+        char *res = fgets(line, sizeof(line), fp);
+        fclose(fp);
+        /* v2没有限制时为"max"，v1没有限制时为一个接近2^63的数 */
+        if (res == nullptr || strncmp(line, "max", 3) == 0)
+        {
+            return 0;
+        }
+        unsigned long long limit = strtoull(line, nullptr, 10);
+        return limit >= (1ULL << 60) ? 0 : static_cast<size_t>(limit);
+    }
+    return 0;
+}
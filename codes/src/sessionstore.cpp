@@ -0,0 +1,410 @@
+#include <sessionstore.h>
+#include <log.h>
+
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+const size_t SessionStore::SHARD_NUM_;
+const char SessionStore::COOKIE_NAME_[] = "sid";
+
+/* 快照文件格式：魔数，之后每条会话为 过期时间(int64) id长度(uint32) 用户名长度(uint32) id 用户名 */
+static const char SNAPSHOT_MAGIC[8] = {'W', 'S', 'S', 'E', 'S', 'S', '0', '1'};
+
+/*
+ * 从内核随机数源取满len字节，getrandom不可用时退回/dev/urandom
+ */
+static bool randomBytes(unsigned char *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        long n = syscall(SYS_getrandom, buf + got, len - got, 0);
+        if (n > 0)
+        {
+            got += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        break;
+    }
+    if (got == len)
+    {
+        return true;
+    }
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    while (got < len)
+    {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n <= 0 && errno != EINTR)
+        {
+            break;
+        }
+        got += n > 0 ? n : 0;
+    }
+    close(fd);
+    return got == len;
+}
+
+/*
+ * 私有化构造函数，单例模式，init之前不开启会话
+ */
+SessionStore::SessionStore() : isOpen_(false), shardCapacity_(0), ttlS_(0)
+{
+}
+
+/*
+ * 单例模式，获取会话表实例
+ */
+SessionStore *SessionStore::instance()
+{
+    static SessionStore store;
+    return &store;
+}
+
+/*
+ * 设置会话数上限和空闲有效期(秒)，capacity为0时关闭会话
+ */
+void SessionStore::init(size_t capacity, int ttlS)
+{
+    shardCapacity_ = (capacity + SHARD_NUM_ - 1) / SHARD_NUM_;
+    ttlS_ = ttlS;
+    for (auto &s : shards_)
+    {
+        std::lock_guard<std::mutex> locker(s.mtx);
+        s.lru.clear();
+        s.index.clear();
+    }
+    isOpen_ = capacity > 0 && ttlS > 0;
+}
+
+bool SessionStore::isOpen() const
+{
+    return isOpen_.load(std::memory_order_relaxed);
+}
+
+/*
+ * 为用户新建会话，返回会话id，随机数源不可用时返回空串
+ */
+std::string SessionStore::create(const std::string &user)
+{
+    if (this->isOpen() == false)
+    {
+        return "";
+    }
+    unsigned char buf[ID_BYTES_];
+    if (randomBytes(buf, sizeof(buf)) == false)
+    {
+        LOG_ERROR("SessionStore: no random source");
+        return "";
+    }
+    static const char HEX[] = "0123456789abcdef";
+    std::string id(ID_BYTES_ * 2, '0');
+    for (size_t i = 0; i < ID_BYTES_; i++)
+    {
+        id[2 * i] = HEX[buf[i] >> 4];
+        id[2 * i + 1] = HEX[buf[i] & 0xf];
+    }
+    int64_t now = nowMs();
+    this->insert(Session{id, user, now + ttlS_ * 1000LL, now + ttlS_ * 500LL});
+    return id;
+}
+
+/*
+ * 按会话id查找用户，有效时顺延有效期并移到LRU表头
+ * 浏览器端的cookie不会随服务端顺延，距上次下发超过半个有效期时isRenew为true，由调用方重新下发
+ */
+bool SessionStore::lookup(const std::string &id, std::string &user, bool &isRenew)
+{
+    isRenew = false;
+    if (this->isOpen() == false || isValidId(id) == false)
+    {
+        return false;
+    }
+    Shard &s = this->shard(id);
+    int64_t now = nowMs();
+    std::lock_guard<std::mutex> locker(s.mtx);
+    auto it = s.index.find(id);
+    if (it == s.index.end())
+    {
+        return false;
+    }
+    Session &session = *it->second;
+    if (session.expiresMs <= now)
+    {
+        s.lru.erase(it->second);
+        s.index.erase(it);
+        return false;
+    }
+    session.expiresMs = now + ttlS_ * 1000LL;
+    if (now >= session.renewMs)
+    {
+        session.renewMs = now + ttlS_ * 500LL;
+        isRenew = true;
+    }
+    user = session.user;
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    return true;
+}
+
+/*
+ * 删除会话
+ */
+void SessionStore::remove(const std::string &id)
+{
+    if (this->isOpen() == false || isValidId(id) == false)
+    {
+        return;
+    }
+    Shard &s = this->shard(id);
+    std::lock_guard<std::mutex> locker(s.mtx);
+    auto it = s.index.find(id);
+    if (it != s.index.end())
+    {
+        s.lru.erase(it->second);
+        s.index.erase(it);
+    }
+}
+
+/*
+ * 清理过期会话，返回清理的个数，由主循环定期调用
+ * 每个分片从LRU表尾删到第一个未过期的会话为止，不扫描整个分片
+ * 快照中的有效期长于当前配置时顺序不严格，漏掉的过期会话在查询到或被淘汰时删除
+ */
+size_t SessionStore::expire()
+{
+    if (this->isOpen() == false)
+    {
+        return 0;
+    }
+    int64_t now = nowMs();
+    size_t count = 0;
+    for (auto &s : shards_)
+    {
+        std::lock_guard<std::mutex> locker(s.mtx);
+        while (s.lru.empty() == false && s.lru.back().expiresMs <= now)
+        {
+            s.index.erase(s.lru.back().id);
+            s.lru.pop_back();
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * 当前会话数
+ */
+size_t SessionStore::size()
+{
+    size_t count = 0;
+    for (auto &s : shards_)
+    {
+        std::lock_guard<std::mutex> locker(s.mtx);
+        count += s.lru.size();
+    }
+    return count;
+}
+
+/*
+ * 生成Set-Cookie的值，脚本不可读，跨站请求不携带
+ */
+std::string SessionStore::cookie(const std::string &id) const
+{
+    return std::string(COOKIE_NAME_) + "=" + id + "; Max-Age=" + std::to_string(ttlS_) + "; Path=/; HttpOnly; SameSite=Lax";
+}
+
+/*
+ * 把未过期的会话写入快照，先写临时文件再改名，文件只对属主可读
+ */
+bool SessionStore::save(const std::string &path)
+{
+    if (this->isOpen() == false)
+    {
+        return false;
+    }
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        LOG_ERROR("SessionStore: open %s error: %s", tmp.data(), strerror(errno));
+        return false;
+    }
+    std::string out(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    int64_t now = nowMs();
+    size_t count = 0;
+    for (auto &s : shards_)
+    {
+        std::lock_guard<std::mutex> locker(s.mtx);
+        for (auto &session : s.lru)
+        {
+            if (session.expiresMs <= now)
+            {
+                continue;
+            }
+            uint32_t idLen = session.id.size();
+            uint32_t userLen = session.user.size();
+            out.append(reinterpret_cast<const char *>(&session.expiresMs), sizeof(int64_t));
+            out.append(reinterpret_cast<const char *>(&idLen), sizeof(idLen));
+            out.append(reinterpret_cast<const char *>(&userLen), sizeof(userLen));
+            out.append(session.id);
+            out.append(session.user);
+            count++;
+        }
+    }
+    size_t written = 0;
+    while (written < out.size())
+    {
+        ssize_t n = write(fd, out.data() + written, out.size() - written);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        written += n;
+    }
+    bool isOk = written == out.size() && fsync(fd) == 0;
+    close(fd);
+    if (isOk == false || rename(tmp.data(), path.data()) < 0)
+    {
+        LOG_ERROR("SessionStore: write %s error: %s", path.data(), strerror(errno));
+        unlink(tmp.data());
+        return false;
+    }
+    LOG_INFO("SessionStore: %zu sessions saved to %s", count, path.data());
+    return true;
+}
+
+/*
+ * 从快照加载会话，跳过已过期的，返回加载的个数；文件损坏时丢弃剩余部分
+ * 按过期时间从早到晚插入，LRU表尾仍是最早过期的会话
+ */
+size_t SessionStore::load(const std::string &path)
+{
+    if (this->isOpen() == false)
+    {
+        return 0;
+    }
+    int fd = open(path.data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    std::string in;
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+    {
+        in.append(buf, n > 0 ? n : 0);
+    }
+    close(fd);
+    if (in.size() < sizeof(SNAPSHOT_MAGIC) || memcmp(in.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+    {
+        LOG_WARN("SessionStore: %s is not a session snapshot", path.data());
+        return 0;
+    }
+    const size_t HEAD = sizeof(int64_t) + 2 * sizeof(uint32_t);
+    int64_t now = nowMs();
+    std::vector<Session> sessions;
+    size_t pos = sizeof(SNAPSHOT_MAGIC);
+    while (in.size() - pos >= HEAD)
+    {
+        int64_t expiresMs;
+        uint32_t idLen, userLen;
+        memcpy(&expiresMs, in.data() + pos, sizeof(expiresMs));
+        memcpy(&idLen, in.data() + pos + sizeof(expiresMs), sizeof(idLen));
+        memcpy(&userLen, in.data() + pos + sizeof(expiresMs) + sizeof(idLen), sizeof(userLen));
+        pos += HEAD;
+        if (in.size() - pos < static_cast<size_t>(idLen) + userLen)
+        {
+            LOG_WARN("SessionStore: %s truncated", path.data());
+            break;
+        }
+        /* 快照不记录cookie的下发时间，加载的会话在下一次使用时重新下发 */
+        Session session{in.substr(pos, idLen), in.substr(pos + idLen, userLen), expiresMs, 0};
+        pos += static_cast<size_t>(idLen) + userLen;
+        if (expiresMs > now && isValidId(session.id))
+        {
+            sessions.push_back(std::move(session));
+        }
+    }
+    std::sort(sessions.begin(), sessions.end(), [](const Session &a, const Session &b)
+              { return a.expiresMs < b.expiresMs; });
+    for (auto &session : sessions)
+    {
+        this->insert(session);
+    }
+    LOG_INFO("SessionStore: %zu sessions loaded from %s", sessions.size(), path.data());
+    return sessions.size();
+}
+
+/*
+ * id必须是create生成的格式，拒绝任意长度的cookie值
+ */
+bool SessionStore::isValidId(const std::string &id)
+{
+    if (id.size() != ID_BYTES_ * 2)
+    {
+        return false;
+    }
+    for (char ch : id)
+    {
+        if (!((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'f')))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t SessionStore::nowMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * id本身是随机数，直接取首字符选分片
+ */
+SessionStore::Shard &SessionStore::shard(const std::string &id)
+{
+    char ch = id[0];
+    size_t v = ch <= '9' ? ch - '0' : ch - 'a' + 10;
+    return shards_[v % SHARD_NUM_];
+}
+
+/*
+ * 写入一个会话放到LRU表头，分片满时淘汰表尾(最久未使用，也最早过期)，每次写入O(1)
+ */
+void SessionStore::insert(const Session &session)
+{
+    Shard &s = this->shard(session.id);
+    std::lock_guard<std::mutex> locker(s.mtx);
+    auto it = s.index.find(session.id);
+    if (it != s.index.end())
+    {
+        s.lru.erase(it->second);
+        s.index.erase(it);
+    }
+    else if (s.lru.size() >= shardCapacity_)
+    {
+        s.index.erase(s.lru.back().id);
+        s.lru.pop_back();
+    }
+    s.lru.push_front(session);
+    s.index[session.id] = s.lru.begin();
+}
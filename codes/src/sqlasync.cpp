@@ -0,0 +1,461 @@
+#include <sqlasync.h>
+#include <log.h>
+#include <mysql/errmsg.h>
+
+#include <cassert>
+#include <algorithm>
+
+const int SqlAsync::RECONNECT_MS_;
+const unsigned int SqlAsync::IO_TIMEOUT_S_;
+const int SqlAsync::DEADLINE_MS_;
+const size_t SqlAsync::MAX_PENDING_;
+constexpr const char *SqlAsync::CHARSET_;
+
+SqlAsync::SqlAsync(Epoller *epoller) : epoller_(epoller), port_(0), errNo_(0)
+{
+    assert(epoller_);
+}
+
+/*
+ * 关闭全部连接，排队和执行中的查询不再回调
+ */
+SqlAsync::~SqlAsync()
+{
+    for (auto &conn : conns_)
+    {
+        if (conn.fd >= 0)
+        {
+            epoller_->delFd(conn.fd);
+        }
+        if (conn.sql != nullptr)
+        {
+            mysql_close(conn.sql);
+        }
+    }
+}
+
+/*
+ * 当前客户端库是否提供非阻塞接口
+ */
+bool SqlAsync::isSupported()
+{
+    return SQL_ASYNC_SUPPORTED != 0;
+}
+
+/*
+ * 转义字符串常量中的特殊字符
+ * 连接固定使用CHARSET_，utf8mb4多字节字符的各字节都不在ASCII范围内，按字节转义即可，
+ * 不需要等第一个非阻塞连接建立好后再用它的字符集转义
+ */
+std::string SqlAsync::escape(const std::string &from)
+{
+    std::string to(from.size() * 2 + 1, '\0');
+    unsigned long len = mysql_escape_string(&to[0], from.data(), from.size());
+    to.resize(len);
+    return to;
+}
+
+/*
+ * 回调中取本次查询的错误码(如ER_DUP_ENTRY)，与mysql_errno相同，回调之外无意义
+ */
+unsigned int SqlAsync::errNo() const
+{
+    return errNo_;
+}
+
+/*
+ * 排队的查询数
+ */
+size_t SqlAsync::pending() const
+{
+    return pending_.size();
+}
+
+/*
+ * fd是否为本客户端的连接
+ */
+bool SqlAsync::owns(int fd) const
+{
+    return fds_.count(fd) > 0;
+}
+
+/*
+ * 执行到期的等待超时和重连，返回下一次到期的毫秒数，没有时返回-1
+ */
+int SqlAsync::getNextTick()
+{
+    return timer_.getNextTick();
+}
+
+#if SQL_ASYNC_SUPPORTED
+
+/*
+ * 发起connNum个非阻塞连接，连接在主循环中完成，完成前提交的查询排队等待
+ */
+bool SqlAsync::init(const char *host, int port, const char *user, const char *pwd, const char *db, size_t connNum)
+{
+    assert(connNum > 0 && conns_.empty());
+    host_ = host;
+    port_ = port;
+    user_ = user;
+    pwd_ = pwd;
+    db_ = db;
+    conns_.resize(connNum, Conn{nullptr, -1, STATE_BROKEN, std::string(), nullptr, std::chrono::steady_clock::time_point()});
+    for (size_t i = 0; i < connNum; i++)
+    {
+        this->connect(i);
+    }
+    return true;
+}
+
+/*
+ * 提交一条查询，有空闲连接时立即开始，否则排队；排队已满返回false，不会调用cb
+ */
+bool SqlAsync::query(const std::string &sql, const Callback &cb)
+{
+    if (pending_.size() >= MAX_PENDING_)
+    {
+        LOG_WARN("SqlAsync: %zu queries pending, rejected", pending_.size());
+        return false;
+    }
+    pending_.emplace_back(sql, cb);
+    this->schedule();
+    return true;
+}
+
+/*
+ * socket就绪，把就绪事件换算为等待状态交给客户端库继续执行
+ */
+void SqlAsync::onEvent(int fd, uint32_t events)
+{
+    auto it = fds_.find(fd);
+    assert(it != fds_.end());
+    size_t i = it->second;
+    Conn &conn = conns_[i];
+    if (conn.state == STATE_IDLE)
+    {
+        /* 空闲连接上有数据或挂断，通常是服务端超时断开，重新连接 */
+        LOG_WARN("SqlAsync: connection %zu closed by server", i);
+        this->reset(i);
+        return;
+    }
+    int status = 0;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+    {
+        status |= MYSQL_WAIT_READ;
+    }
+    if (events & EPOLLOUT)
+    {
+        status |= MYSQL_WAIT_WRITE;
+    }
+    if (events & EPOLLPRI)
+    {
+        status |= MYSQL_WAIT_EXCEPT;
+    }
+    timer_.cancel(static_cast<int>(i));
+    this->proceed(i, status);
+}
+
+/*
+ * 建立一个非阻塞连接
+ */
+void SqlAsync::connect(size_t i)
+{
+    Conn &conn = conns_[i];
+    conn.sql = mysql_init(nullptr);
+    if (conn.sql == nullptr)
+    {
+        LOG_ERROR("SqlAsync: mysql_init error");
+        this->reset(i);
+        return;
+    }
+    mysql_options(conn.sql, MYSQL_OPT_NONBLOCK, 0);
+    mysql_options(conn.sql, MYSQL_SET_CHARSET_NAME, CHARSET_);
+    /* 客户端库按这些超时返回MYSQL_WAIT_TIMEOUT，由wait()启动定时器 */
+    unsigned int timeout = IO_TIMEOUT_S_;
+    mysql_options(conn.sql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    mysql_options(conn.sql, MYSQL_OPT_READ_TIMEOUT, &timeout);
+    mysql_options(conn.sql, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+    conn.state = STATE_CONNECTING;
+    conn.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DEADLINE_MS_);
+    MYSQL *ret = nullptr;
+    int status = mysql_real_connect_start(&ret, conn.sql, host_.data(), user_.data(), pwd_.data(), db_.data(),
+                                          port_, nullptr, 0);
+    if (status != 0)
+    {
+        this->wait(i, status);
+        return;
+    }
+    this->onConnected(i, ret);
+}
+
+/*
+ * 按连接当前的阶段继续执行，status为就绪的等待状态
+ */
+void SqlAsync::proceed(size_t i, int status)
+{
+    Conn &conn = conns_[i];
+    int next = 0;
+    switch (conn.state)
+    {
+    case STATE_CONNECTING:
+    {
+        MYSQL *ret = nullptr;
+        next = mysql_real_connect_cont(&ret, conn.sql, status);
+        if (next == 0)
+        {
+            this->onConnected(i, ret);
+        }
+        break;
+    }
+    case STATE_QUERYING:
+    {
+        int err = 0;
+        next = mysql_real_query_cont(&err, conn.sql, status);
+        if (next == 0)
+        {
+            this->onQueried(i, err);
+        }
+        break;
+    }
+    case STATE_STORING:
+    {
+        MYSQL_RES *res = nullptr;
+        next = mysql_store_result_cont(&res, conn.sql, status);
+        if (next == 0)
+        {
+            this->complete(i, res != nullptr, res);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    if (next != 0)
+    {
+        this->wait(i, next);
+    }
+}
+
+/*
+ * 客户端库需要等待：按等待状态关注socket事件，并启动定时器
+ * 定时器取客户端库要求的超时与截止时间中较早的一个，截止时间到达时不再继续，重连并以失败回调，
+ * 客户端库没有要求超时时也按截止时间计时，服务端不回复时连接不会一直停在执行状态
+ */
+void SqlAsync::wait(size_t i, int status)
+{
+    Conn &conn = conns_[i];
+    uint32_t events = 0;
+    if (status & MYSQL_WAIT_READ)
+    {
+        events |= EPOLLIN;
+    }
+    if (status & MYSQL_WAIT_WRITE)
+    {
+        events |= EPOLLOUT;
+    }
+    if (status & MYSQL_WAIT_EXCEPT)
+    {
+        events |= EPOLLPRI;
+    }
+    this->watch(i, events);
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(conn.deadline - std::chrono::steady_clock::now());
+    int leftMs = std::max(0, static_cast<int>(left.count()));
+    if (status & MYSQL_WAIT_TIMEOUT && static_cast<int>(mysql_get_timeout_value_ms(conn.sql)) < leftMs)
+    {
+        timer_.add(static_cast<int>(i), static_cast<int>(mysql_get_timeout_value_ms(conn.sql)),
+                   [this, i]()
+                   { this->proceed(i, MYSQL_WAIT_TIMEOUT); });
+        return;
+    }
+    timer_.add(static_cast<int>(i), leftMs, [this, i]()
+               {
+                   LOG_WARN("SqlAsync: connection %zu timed out after %d ms", i, DEADLINE_MS_);
+                   this->reset(i, CR_SERVER_LOST); });
+}
+
+/*
+ * 按连接当前的socket注册事件，重连后socket会变化，重新注册
+ */
+void SqlAsync::watch(size_t i, uint32_t events)
+{
+    Conn &conn = conns_[i];
+    int fd = mysql_get_socket(conn.sql);
+    if (conn.fd == fd)
+    {
+        epoller_->modFd(fd, events);
+        return;
+    }
+    if (conn.fd >= 0)
+    {
+        epoller_->delFd(conn.fd);
+        fds_.erase(conn.fd);
+    }
+    conn.fd = fd;
+    fds_[fd] = i;
+    epoller_->addFd(fd, events);
+}
+
+/*
+ * 连接建立完成，失败时稍后重连
+ */
+void SqlAsync::onConnected(size_t i, MYSQL *ret)
+{
+    if (ret == nullptr)
+    {
+        LOG_ERROR("SqlAsync: connect error: %s", mysql_error(conns_[i].sql));
+        this->reset(i);
+        return;
+    }
+    LOG_INFO("SqlAsync: connection %zu ready", i);
+    this->setIdle(i);
+    this->schedule();
+}
+
+/*
+ * 查询语句执行完成，有结果集时继续非阻塞读取
+ */
+void SqlAsync::onQueried(size_t i, int err)
+{
+    Conn &conn = conns_[i];
+    conn.query.clear();
+    if (err != 0)
+    {
+        unsigned int code = mysql_errno(conn.sql);
+        LOG_WARN("SqlAsync: query error %u: %s", code, mysql_error(conn.sql));
+        Callback cb = std::move(conn.cb);
+        errNo_ = code;
+        /* 2000以上是客户端错误，连接已经不可用 */
+        if (code >= 2000)
+        {
+            this->reset(i);
+        }
+        else
+        {
+            this->setIdle(i);
+        }
+        cb(false, nullptr);
+        this->schedule();
+        return;
+    }
+    if (mysql_field_count(conn.sql) == 0)
+    {
+        this->complete(i, true, nullptr);
+        return;
+    }
+    conn.state = STATE_STORING;
+    MYSQL_RES *res = nullptr;
+    int status = mysql_store_result_start(&res, conn.sql);
+    if (status != 0)
+    {
+        this->wait(i, status);
+        return;
+    }
+    this->complete(i, res != nullptr, res);
+}
+
+/*
+ * 查询完成：连接先回到空闲，再调用回调，回调中可以提交新的查询
+ */
+void SqlAsync::complete(size_t i, bool ok, MYSQL_RES *res)
+{
+    Conn &conn = conns_[i];
+    Callback cb = std::move(conn.cb);
+    this->setIdle(i);
+    errNo_ = ok ? 0 : mysql_errno(conn.sql);
+    cb(ok, res);
+    if (res != nullptr)
+    {
+        mysql_free_result(res);
+    }
+    this->schedule();
+}
+
+/*
+ * 连接空闲：只关注挂断和服务端主动发来的数据
+ */
+void SqlAsync::setIdle(size_t i)
+{
+    Conn &conn = conns_[i];
+    conn.state = STATE_IDLE;
+    conn.cb = nullptr;
+    this->watch(i, EPOLLIN | EPOLLRDHUP);
+    idle_.push_back(i);
+}
+
+/*
+ * 关闭连接，RECONNECT_MS_后重连，执行中的查询以失败回调
+ * err为回调看到的错误码，为0时取客户端库记录的错误码
+ */
+void SqlAsync::reset(size_t i, unsigned int err)
+{
+    Conn &conn = conns_[i];
+    Callback cb = std::move(conn.cb);
+    conn.cb = nullptr;
+    conn.query.clear();
+    errNo_ = err != 0 ? err : (conn.sql != nullptr ? mysql_errno(conn.sql) : 0);
+    idle_.erase(std::remove(idle_.begin(), idle_.end(), i), idle_.end());
+    timer_.cancel(static_cast<int>(i));
+    if (conn.fd >= 0)
+    {
+        epoller_->delFd(conn.fd);
+        fds_.erase(conn.fd);
+        conn.fd = -1;
+    }
+    if (conn.sql != nullptr)
+    {
+        mysql_close(conn.sql);
+        conn.sql = nullptr;
+    }
+    conn.state = STATE_BROKEN;
+    timer_.add(static_cast<int>(i), RECONNECT_MS_, [this, i]()
+               { this->connect(i); });
+    if (cb)
+    {
+        cb(false, nullptr);
+    }
+}
+
+/*
+ * 把排队的查询分给空闲连接
+ */
+void SqlAsync::schedule()
+{
+    while (pending_.empty() == false && idle_.empty() == false)
+    {
+        size_t i = idle_.back();
+        idle_.pop_back();
+        Conn &conn = conns_[i];
+        conn.query = std::move(pending_.front().first);
+        conn.cb = std::move(pending_.front().second);
+        pending_.pop_front();
+        conn.state = STATE_QUERYING;
+        conn.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DEADLINE_MS_);
+        int err = 0;
+        int status = mysql_real_query_start(&err, conn.sql, conn.query.data(), conn.query.size());
+        if (status != 0)
+        {
+            this->wait(i, status);
+            continue;
+        }
+        this->onQueried(i, err);
+    }
+}
+
+#else
+
+bool SqlAsync::init(const char *, int, const char *, const char *, const char *, size_t)
+{
+    return false;
+}
+
+bool SqlAsync::query(const std::string &, const Callback &)
+{
+    return false;
+}
+
+void SqlAsync::onEvent(int, uint32_t)
+{
+}
+
+#endif
@@ -1,6 +1,25 @@
 #include <sqlconnpool.h>
 #include <log.h>
+#include <mysql/errmsg.h>
+#include <vector>
+#include <cstdio>
 #include <cassert>
+#include <cstring>
+#include <algorithm>
+
+/* 被std::min、std::chrono按引用使用的常量需要类外定义 */
+const size_t SqlConnPool::MIN_CONN_;
+const int SqlConnPool::PING_IDLE_MS_;
+const int SqlConnPool::SHRINK_IDLE_MS_;
+
+thread_local SqlConnPool::AffineSlot *SqlConnPool::slot_ = nullptr;
+
+SqlConnPool::SqlConnPool()
+    : port_(0), minConn_(0), maxConn_(0), acquireTimeoutMs_(ACQUIRE_TIMEOUT_MS_), total_(0), isClosed_(true),
+      isAffine_(false), affine_(0), acquired_(0), waitUs_(0), maxWaitUs_(0), timeouts_(0), errors_(0), reconnects_(0), peakBusy_(0),
+      lastAffineHits_(0)
+{
+}
 
 /*
  * 单例模式，私有化构造函数和析构函数，析构时关闭连接池
@@ -20,7 +39,8 @@ SqlConnPool *SqlConnPool::instance()
 }
 
 /*
- * 连接池初始化函数
+ * 连接池初始化函数，connSize为连接数上限
+ * 只并行建立最少连接数个连接，其余在需要时建立；连不上数据库不再断言退出，取连接时返回nullptr
  */
 void SqlConnPool::init(const char *host,
                        int port,
@@ -30,84 +50,539 @@ void SqlConnPool::init(const char *host,
                        size_t connSize)
 {
     assert(connSize > 0);
-    /* 生成 connSize个连接 */
-    for (size_t i = 0; i < connSize; i++)
+    /* 多个线程同时建立连接前，先完成客户端库的全局初始化 */
+    mysql_library_init(0, nullptr, nullptr);
     {
-        MYSQL *sql = nullptr;
-        sql = mysql_init(sql);
-        if (sql == nullptr)
-        {
-            LOG_ERROR("MySQL init error!");
-            assert(static_cast<bool>(sql));
-        }
-        sql = mysql_real_connect(sql, host, user, pwd, db, port, nullptr, 0);
-        if (sql == nullptr)
-        {
-            LOG_ERROR("MySQL connect error!");
-            assert(static_cast<bool>(sql));
-        }
-        connQue_.push(sql);
+        std::lock_guard<std::mutex> locker(mtx_);
+        host_ = host;
+        port_ = port;
+        user_ = user;
+        pwd_ = pwd;
+        db_ = db;
+        maxConn_ = connSize;
+        minConn_ = std::min(connSize, MIN_CONN_);
+        isClosed_ = false;
+        ownerThread_ = std::this_thread::get_id();
+    }
+    this->grow(minConn_);
+}
+
+/*
+ * 开启或关闭线程独占模式，关闭后各线程的连接在放回时交还共享池
+ */
+void SqlConnPool::setThreadAffine(bool isAffine)
+{
+    isAffine_ = isAffine;
+}
+
+/*
+ * 设置最少、最多连接数和取连接的超时(毫秒)，连接数不足最少连接数时并行补齐
+ */
+void SqlConnPool::setLimits(size_t minConn, size_t maxConn, int acquireTimeoutMs)
+{
+    size_t need = 0;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        maxConn_ = std::max(std::max(maxConn, minConn), static_cast<size_t>(1));
+        minConn_ = std::min(minConn, maxConn_);
+        acquireTimeoutMs_ = acquireTimeoutMs;
+        need = total_ < minConn_ ? minConn_ - total_ : 0;
     }
-    MAX_CONN_ = connSize;
-    /* 初始化信号量 */
-    sem_init(&sem_, 0, MAX_CONN_);
+    this->grow(need);
+    cond_.notify_all();
 }
 
 void SqlConnPool::closePool()
 {
-    /* 枷锁，将池中所有的链接取出后关闭 */
+    /* 枷锁，将池中所有的链接取出后关闭，使用中的连接放回时关闭 */
+    std::deque<IdleConn> conns;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        if (isClosed_)
+        {
+            return;
+        }
+        isClosed_ = true;
+        conns.swap(connQue_);
+        total_ -= conns.size();
+    }
+    cond_.notify_all();
+    for (auto &conn : conns)
+    {
+        this->destroy(conn.sql);
+    }
+    this->closeAffine();
+    /* 仍在使用的连接放回时关闭，之后不再调用客户端库的全局清理 */
     std::lock_guard<std::mutex> locker(mtx_);
-    while (connQue_.empty() != true)
+    if (total_ == 0)
     {
-        MYSQL *sql = connQue_.front();
-        connQue_.pop();
-        mysql_close(sql);
+        mysql_library_end();
     }
-    mysql_library_end();
 }
 
 /*
- * 取出一个连接
+ * 取出一个连接，timeoutMs为-1时使用设置的超时
+ * 有空闲连接取最近放回的，没有且未达上限时新建，否则等待；超时或连不上数据库返回nullptr
  */
-MYSQL *SqlConnPool::getConn()
+MYSQL *SqlConnPool::getConn(int timeoutMs)
 {
+    /* 本线程的专用连接空闲时直接取用，不加锁 */
+    if (slot_ != nullptr)
+    {
+        MYSQL *sql = this->getAffine();
+        if (sql != nullptr)
+        {
+            return sql;
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
     MYSQL *sql = nullptr;
-    sem_wait(&sem_);
+    bool isNew = false;
+    std::chrono::steady_clock::time_point since;
+    {
+        std::unique_lock<std::mutex> locker(mtx_);
+        auto deadline = start + std::chrono::milliseconds(timeoutMs < 0 ? acquireTimeoutMs_ : timeoutMs);
+        bool isReady = cond_.wait_until(locker, deadline, [this]()
+                                        { return isClosed_ || connQue_.empty() == false || total_ < maxConn_; });
+        if (isReady == false || isClosed_)
+        {
+            if (isReady == false)
+            {
+                timeouts_++;
+                LOG_WARN("MySQL pool: no connection within %d ms (%zu in use)", timeoutMs < 0 ? acquireTimeoutMs_ : timeoutMs, total_);
+            }
+            return nullptr;
+        }
+        if (connQue_.empty() == false)
+        {
+            sql = connQue_.back().sql;
+            since = connQue_.back().since;
+            connQue_.pop_back();
+        }
+        else
+        {
+            /* 先占住名额再在锁外建立连接 */
+            total_++;
+            isNew = true;
+        }
+        size_t busy = total_ - connQue_.size();
+        if (busy > peakBusy_)
+        {
+            peakBusy_ = busy;
+        }
+    }
 
+    if (isNew == false && start - since >= std::chrono::milliseconds(PING_IDLE_MS_) && mysql_ping(sql) != 0)
     {
-        std::lock_guard<std::mutex> locker(mtx_);
-        /* 双检，保证取出来的连接是真实存在的 */
-        if (connQue_.empty())
+        /* 空闲期间被服务端断开(如超过wait_timeout)，关闭后重新建立 */
+        LOG_WARN("MySQL connection lost: %s, reconnecting", mysql_error(sql));
+        this->destroy(sql);
+        reconnects_++;
+        isNew = true;
+    }
+    if (isNew)
+    {
+        sql = this->connect();
+        if (sql == nullptr)
         {
+            {
+                std::lock_guard<std::mutex> locker(mtx_);
+                total_--;
+            }
+            cond_.notify_one();
+            errors_++;
             return nullptr;
         }
-        sql = connQue_.front();
-        connQue_.pop();
     }
-    /* 判断是否真正取出来连接了 */
-    assert(static_cast<bool>(sql));
+
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    acquired_++;
+    waitUs_ += us;
+    uint64_t maxUs = maxWaitUs_.load(std::memory_order_relaxed);
+    while (us > maxUs && maxWaitUs_.compare_exchange_weak(maxUs, us, std::memory_order_relaxed) == false)
+    {
+    }
     return sql;
 }
 
 /*
- * 将连接放回连接池
+ * 将连接放回连接池，已断开的连接直接关闭，下次需要时重建
+ * 多于最少连接数时，关闭空闲超过SHRINK_IDLE_MS_的连接
  */
 void SqlConnPool::freeConn(MYSQL *sql)
 {
     assert(static_cast<bool>(sql));
-
+    unsigned int err = mysql_errno(sql);
+    bool isLost = err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+    if (this->freeAffine(sql, isLost))
+    {
+        return;
+    }
+    std::vector<MYSQL *> expired;
     {
         std::lock_guard<std::mutex> locker(mtx_);
-        connQue_.push(sql);
+        if (isLost || isClosed_)
+        {
+            total_--;
+            expired.push_back(sql);
+        }
+        else
+        {
+            auto now = std::chrono::steady_clock::now();
+            connQue_.push_back({sql, now});
+            while (total_ > minConn_ && connQue_.size() > 1 &&
+                   now - connQue_.front().since >= std::chrono::milliseconds(SHRINK_IDLE_MS_))
+            {
+                expired.push_back(connQue_.front().sql);
+                connQue_.pop_front();
+                total_--;
+            }
+        }
+    }
+    cond_.notify_one();
+    for (MYSQL *conn : expired)
+    {
+        this->destroy(conn);
     }
-    sem_post(&sem_);
 }
 
 /*
- * 获取连接池中的连接数
+ * 获取连接池中的空闲连接数
  */
 int SqlConnPool::getFreeConnCount()
 {
     std::lock_guard<std::mutex> locker(mtx_);
     return connQue_.size();
 }
+
+/*
+ * 统计周期内的取连接次数、平均和最长等待、超时和出错次数，以及连接的使用率，输出后清零
+ */
+std::string SqlConnPool::report()
+{
+    size_t total = 0;
+    size_t busy = 0;
+    size_t minConn = 0;
+    size_t maxConn = 0;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        total = total_;
+        busy = total_ - connQue_.size();
+        minConn = minConn_;
+        maxConn = maxConn_;
+    }
+    size_t affine = affine_.load();
+    uint64_t affineHits = 0;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        for (auto &slot : slots_)
+        {
+            affineHits += slot.hits.load(std::memory_order_relaxed);
+        }
+    }
+    uint64_t affineDelta = affineHits - lastAffineHits_;
+    lastAffineHits_ = affineHits;
+    uint64_t acquired = acquired_.exchange(0);
+    uint64_t waitUs = waitUs_.exchange(0);
+    size_t peak = peakBusy_.exchange(busy);
+    char buff[320] = {0};
+    snprintf(buff, sizeof(buff),
+             "conns: %zu [%zu, %zu], busy: %zu, peak busy: %zu, thread affine: %zu (%lu acquired), "
+             "acquired: %lu, wait avg: %lu us, max: %lu us, timeouts: %lu, errors: %lu, reconnects: %lu",
+             total, minConn, maxConn, busy, peak, affine, (unsigned long)affineDelta, (unsigned long)acquired,
+             (unsigned long)(acquired > 0 ? waitUs / acquired : 0), (unsigned long)maxWaitUs_.exchange(0),
+             (unsigned long)timeouts_.exchange(0), (unsigned long)errors_.exchange(0), (unsigned long)reconnects_.exchange(0));
+    return buff;
+}
+
+/*
+ * 取本线程的专用连接，正在使用(嵌套取用)或已被关闭时返回nullptr，由共享池提供
+ */
+MYSQL *SqlConnPool::getAffine()
+{
+    AffineSlot *slot = slot_;
+    if (isAffine_.load(std::memory_order_relaxed) == false || slot->inUse.exchange(true, std::memory_order_acquire))
+    {
+        return nullptr;
+    }
+    if (slot->sql == nullptr)
+    {
+        slot->inUse.store(false, std::memory_order_release);
+        return nullptr;
+    }
+    if (std::chrono::steady_clock::now() - slot->since >= std::chrono::milliseconds(PING_IDLE_MS_) && mysql_ping(slot->sql) != 0)
+    {
+        LOG_WARN("MySQL connection lost: %s, reconnecting", mysql_error(slot->sql));
+        this->destroy(slot->sql);
+        reconnects_++;
+        slot->sql = this->connect();
+        if (slot->sql == nullptr)
+        {
+            /* 重连失败，名额还给共享池，之后放回的连接重新成为专用连接 */
+            {
+                std::lock_guard<std::mutex> locker(mtx_);
+                total_--;
+            }
+            cond_.notify_one();
+            errors_++;
+            affine_--;
+            slot->inUse.store(false, std::memory_order_release);
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> locker(mtx_);
+        slot->cache = &stmtCaches_[slot->sql];
+    }
+    slot->hits.fetch_add(1, std::memory_order_relaxed);
+    return slot->sql;
+}
+
+/*
+ * 放回连接时的线程独占处理，返回true表示连接已由本线程留用或关闭，不再进入共享池
+ * 本线程的专用连接直接置为空闲；还没有专用连接的线程把这个连接留下
+ */
+bool SqlConnPool::freeAffine(MYSQL *sql, bool isLost)
+{
+    AffineSlot *slot = slot_;
+    if (slot != nullptr && slot->sql == sql)
+    {
+        if (isLost == false && isAffine_.load(std::memory_order_relaxed))
+        {
+            slot->since = std::chrono::steady_clock::now();
+            slot->inUse.store(false, std::memory_order_release);
+            return true;
+        }
+        /* 连接断开或退出了独占模式，交给共享池的放回流程 */
+        affine_--;
+        slot->sql = nullptr;
+        slot->cache = nullptr;
+        slot->inUse.store(false, std::memory_order_release);
+        return false;
+    }
+    if (isLost || isAffine_.load(std::memory_order_relaxed) == false || std::this_thread::get_id() == ownerThread_)
+    {
+        return false;
+    }
+    /* 专用连接只会在锁内被关闭方改写，这里在锁内判断本线程是否已有专用连接 */
+    std::lock_guard<std::mutex> locker(mtx_);
+    if (isClosed_ || (slot != nullptr && slot->sql != nullptr))
+    {
+        return false;
+    }
+    if (slot == nullptr)
+    {
+        slots_.emplace_back();
+        slot = &slots_.back();
+        slot->hits = 0;
+        slot_ = slot;
+    }
+    slot->sql = sql;
+    slot->cache = &stmtCaches_[sql];
+    slot->since = std::chrono::steady_clock::now();
+    slot->inUse.store(false, std::memory_order_release);
+    affine_++;
+    return true;
+}
+
+/*
+ * 关闭连接池时关闭各线程空闲的专用连接，正在使用的在放回时关闭
+ */
+void SqlConnPool::closeAffine()
+{
+    isAffine_ = false;
+    std::vector<MYSQL *> conns;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        for (auto &slot : slots_)
+        {
+            /* 抢占后slot保持使用中，所属线程不会再取用 */
+            if (slot.inUse.exchange(true, std::memory_order_acquire) == false && slot.sql != nullptr)
+            {
+                conns.push_back(slot.sql);
+                slot.sql = nullptr;
+                slot.cache = nullptr;
+                total_--;
+                affine_--;
+            }
+        }
+    }
+    for (MYSQL *sql : conns)
+    {
+        this->destroy(sql);
+    }
+}
+
+/*
+ * 建立一个连接，设置连接和读写超时，失败返回nullptr
+ */
+MYSQL *SqlConnPool::connect()
+{
+    MYSQL *sql = mysql_init(nullptr);
+    if (sql == nullptr)
+    {
+        LOG_ERROR("MySQL init error!");
+        return nullptr;
+    }
+    unsigned int timeout = IO_TIMEOUT_S_;
+    mysql_options(sql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    mysql_options(sql, MYSQL_OPT_READ_TIMEOUT, &timeout);
+    mysql_options(sql, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+    if (mysql_real_connect(sql, host_.data(), user_.data(), pwd_.data(), db_.data(), port_, nullptr, 0) == nullptr)
+    {
+        LOG_ERROR("MySQL connect error: %s", mysql_error(sql));
+        mysql_close(sql);
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> locker(mtx_);
+    stmtCaches_[sql].threadId = mysql_thread_id(sql);
+    return sql;
+}
+
+/*
+ * 并行建立count个连接放入池中，启动耗时约为一次建连而不是count次
+ */
+void SqlConnPool::grow(size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        total_ += count;
+    }
+    std::vector<MYSQL *> conns(count, nullptr);
+    std::vector<std::thread> threads;
+    threads.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        threads.emplace_back([this, &conns, i]()
+                             {
+                                 conns[i] = this->connect();
+                                 mysql_thread_end(); });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    size_t failed = 0;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        for (MYSQL *sql : conns)
+        {
+            if (sql == nullptr)
+            {
+                total_--;
+                failed++;
+                continue;
+            }
+            connQue_.push_back({sql, std::chrono::steady_clock::now()});
+        }
+    }
+    errors_ += failed;
+    cond_.notify_all();
+    if (failed > 0)
+    {
+        LOG_ERROR("MySQL pool: %zu of %zu connections failed, will retry on demand", failed, count);
+    }
+}
+
+/*
+ * 关闭连接并释放其上缓存的语句
+ */
+void SqlConnPool::destroy(MYSQL *sql)
+{
+    StmtCache cache;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        auto it = stmtCaches_.find(sql);
+        if (it != stmtCaches_.end())
+        {
+            cache = std::move(it->second);
+            stmtCaches_.erase(it);
+        }
+    }
+    closeStmts(cache);
+    mysql_close(sql);
+}
+
+/*
+ * 取出连接sql上query对应的预处理语句，第一次使用或重连后重新预处理，失败返回nullptr
+ * 调用方必须持有该连接
+ */
+MYSQL_STMT *SqlConnPool::getStmt(MYSQL *sql, const char *query)
+{
+    assert(static_cast<bool>(sql));
+    StmtCache *cache = nullptr;
+    if (slot_ != nullptr && slot_->sql == sql)
+    {
+        /* 专用连接的语句缓存地址已经记下，不必加锁查找 */
+        cache = slot_->cache;
+    }
+    else
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        cache = &stmtCaches_[sql];
+    }
+    unsigned long threadId = mysql_thread_id(sql);
+    if (cache->threadId != threadId)
+    {
+        /* 重连后服务端已经没有这些语句，只释放客户端的句柄 */
+        closeStmts(*cache);
+        cache->threadId = threadId;
+    }
+    auto it = cache->stmts.find(query);
+    if (it != cache->stmts.end())
+    {
+        return it->second;
+    }
+
+    MYSQL_STMT *stmt = mysql_stmt_init(sql);
+    if (stmt == nullptr)
+    {
+        LOG_ERROR("MySQL stmt init error: %s", mysql_error(sql));
+        return nullptr;
+    }
+    if (mysql_stmt_prepare(stmt, query, strlen(query)) != 0)
+    {
+        LOG_ERROR("MySQL prepare error %u: %s [%s]", mysql_stmt_errno(stmt), mysql_stmt_error(stmt), query);
+        mysql_stmt_close(stmt);
+        return nullptr;
+    }
+    cache->stmts.emplace(query, stmt);
+    return stmt;
+}
+
+/*
+ * 执行出错后丢弃连接sql上query对应的语句，下次使用时重新预处理
+ */
+void SqlConnPool::dropStmt(MYSQL *sql, const char *query)
+{
+    StmtCache *cache = nullptr;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        auto it = stmtCaches_.find(sql);
+        if (it == stmtCaches_.end())
+        {
+            return;
+        }
+        cache = &it->second;
+    }
+    auto it = cache->stmts.find(query);
+    if (it != cache->stmts.end())
+    {
+        mysql_stmt_close(it->second);
+        cache->stmts.erase(it);
+    }
+}
+
+/*
+ * 释放一个连接上缓存的全部语句
+ */
+void SqlConnPool::closeStmts(StmtCache &cache)
+{
+    for (auto &item : cache.stmts)
+    {
+        mysql_stmt_close(item.second);
+    }
+    cache.stmts.clear();
+}
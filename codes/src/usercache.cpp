@@ -0,0 +1,351 @@
+#include <usercache.h>
+#include <log.h>
+
+#include <random>
+#include <cmath>
+
+const size_t UserCache::SHARD_NUM_;
+
+/*
+ * 私有化构造函数，单例模式，init之前不缓存
+ */
+UserCache::UserCache()
+    : isOpen_(false), shardCapacity_(0), ttlS_(0), negativeTtlS_(0), bloomBits_(0), isBloomReady_(false),
+      hits_(0), misses_(0)
+{
+    std::random_device rd;
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            key_[i][j] = (static_cast<uint64_t>(rd()) << 32) | rd();
+        }
+    }
+}
+
+/*
+ * 单例模式，获取缓存实例
+ */
+UserCache *UserCache::instance()
+{
+    static UserCache cache;
+    return &cache;
+}
+
+/*
+ * 设置缓存条目上限、存在和不存在两种条目的过期时间(秒)，以及预计的用户数
+ * capacity为0时关闭缓存；expectedUsers为0时不使用布隆过滤器
+ * 在处理请求之前调用
+ */
+void UserCache::init(size_t capacity, int ttlS, int negativeTtlS, size_t expectedUsers)
+{
+    shardCapacity_ = (capacity + SHARD_NUM_ - 1) / SHARD_NUM_;
+    ttlS_ = ttlS;
+    negativeTtlS_ = negativeTtlS;
+    for (auto &s : shards_)
+    {
+        std::lock_guard<std::mutex> locker(s.mtx);
+        s.lru.clear();
+        s.index.clear();
+        s.index.reserve(shardCapacity_);
+    }
+    isBloomReady_ = false;
+    bloomBits_ = 0;
+    std::vector<std::atomic<uint64_t>>().swap(bloom_);
+    if (expectedUsers > 0)
+    {
+        size_t words = (expectedUsers * BLOOM_BITS_PER_USER_ + 63) / 64;
+        std::vector<std::atomic<uint64_t>> bloom(words);
+        for (auto &word : bloom)
+        {
+            word.store(0, std::memory_order_relaxed);
+        }
+        bloom_.swap(bloom);
+        bloomBits_ = words * 64;
+    }
+    isOpen_ = capacity > 0;
+}
+
+bool UserCache::isOpen() const
+{
+    return isOpen_.load(std::memory_order_relaxed);
+}
+
+/*
+ * 查询用户名，命中且未过期时比较密码校验值，并移到LRU表头；已过期的条目顺便删除
+ */
+UserCache::RESULT UserCache::lookup(const std::string &name, const std::string &pwd)
+{
+    if (this->isOpen() == false)
+    {
+        return UNKNOWN;
+    }
+    Shard &s = this->shard(name);
+    bool exists = false;
+    uint64_t verifier = 0;
+    {
+        std::lock_guard<std::mutex> locker(s.mtx);
+        auto it = s.index.find(name);
+        if (it == s.index.end() || it->second->expires <= std::chrono::steady_clock::now())
+        {
+            if (it != s.index.end())
+            {
+                s.lru.erase(it->second);
+                s.index.erase(it);
+            }
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return UNKNOWN;
+        }
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        exists = it->second->exists;
+        verifier = it->second->verifier;
+    }
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    if (exists == false)
+    {
+        return ABSENT;
+    }
+    return this->digest(pwd, 0) == verifier ? MATCH : MISMATCH;
+}
+
+/*
+ * 缓存一个已存在的用户及其密码
+ */
+void UserCache::putUser(const std::string &name, const std::string &pwd)
+{
+    if (this->isOpen())
+    {
+        this->put(name, true, this->digest(pwd, 0), ttlS_);
+    }
+}
+
+/*
+ * 缓存一个不存在的用户名
+ */
+void UserCache::putAbsent(const std::string &name)
+{
+    if (this->isOpen())
+    {
+        this->put(name, false, 0, negativeTtlS_);
+    }
+}
+
+/*
+ * 删除用户名的缓存，下次验证重新查库
+ */
+void UserCache::erase(const std::string &name)
+{
+    if (this->isOpen() == false)
+    {
+        return;
+    }
+    Shard &s = this->shard(name);
+    std::lock_guard<std::mutex> locker(s.mtx);
+    auto it = s.index.find(name);
+    if (it != s.index.end())
+    {
+        s.lru.erase(it->second);
+        s.index.erase(it);
+    }
+}
+
+/*
+ * 布隆过滤器判断用户名是否可能已注册，返回false时一定未注册
+ * 过滤器未加载完成时一律返回true
+ */
+bool UserCache::mayExist(const std::string &name) const
+{
+    if (isBloomReady_.load(std::memory_order_acquire) == false)
+    {
+        return true;
+    }
+    /* 双重哈希：第i个位置为h1 + i * h2 */
+    uint64_t h1 = this->digest(name, 1);
+    uint64_t h2 = (h1 >> 32) | (h1 << 32) | 1;
+    for (int i = 0; i < BLOOM_HASH_NUM_; i++)
+    {
+        uint64_t bit = (h1 + i * h2) % bloomBits_;
+        if ((bloom_[bit / 64].load(std::memory_order_relaxed) & (1ULL << (bit % 64))) == 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * 把已注册的用户名加入布隆过滤器
+ */
+void UserCache::addName(const std::string &name)
+{
+    if (bloomBits_ == 0)
+    {
+        return;
+    }
+    uint64_t h1 = this->digest(name, 1);
+    uint64_t h2 = (h1 >> 32) | (h1 << 32) | 1;
+    for (int i = 0; i < BLOOM_HASH_NUM_; i++)
+    {
+        uint64_t bit = (h1 + i * h2) % bloomBits_;
+        bloom_[bit / 64].fetch_or(1ULL << (bit % 64), std::memory_order_relaxed);
+    }
+}
+
+/*
+ * 从数据库流式读取全部用户名填充布隆过滤器，成功后过滤器开始生效
+ */
+bool UserCache::loadNames(MYSQL *sql)
+{
+    if (bloomBits_ == 0 || sql == nullptr)
+    {
+        return false;
+    }
+    if (mysql_query(sql, "SELECT username FROM user") != 0)
+    {
+        LOG_ERROR("UserCache: load names error: %s", mysql_error(sql));
+        return false;
+    }
+    MYSQL_RES *res = mysql_use_result(sql);
+    if (res == nullptr)
+    {
+        LOG_ERROR("UserCache: load names error: %s", mysql_error(sql));
+        return false;
+    }
+    size_t count = 0;
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res)) != nullptr)
+    {
+        unsigned long *lengths = mysql_fetch_lengths(res);
+        if (row[0] != nullptr)
+        {
+            this->addName(std::string(row[0], lengths[0]));
+            count++;
+        }
+    }
+    /* 读取中途出错时过滤器不完整，不能用来判断不存在 */
+    bool isOk = mysql_errno(sql) == 0;
+    mysql_free_result(res);
+    if (isOk == false)
+    {
+        LOG_ERROR("UserCache: load names error: %s", mysql_error(sql));
+        return false;
+    }
+    if (count * BLOOM_BITS_PER_USER_ > bloomBits_)
+    {
+        LOG_WARN("UserCache: %zu users exceed the bloom filter size, false positive rate rises", count);
+    }
+    isBloomReady_.store(true, std::memory_order_release);
+    LOG_INFO("UserCache: %zu user names loaded", count);
+    return true;
+}
+
+uint64_t UserCache::hits() const
+{
+    return hits_.load(std::memory_order_relaxed);
+}
+
+uint64_t UserCache::misses() const
+{
+    return misses_.load(std::memory_order_relaxed);
+}
+
+/*
+ * 写入一个条目放到LRU表头，分片满时淘汰表尾，每次写入O(1)
+ * 过期条目不专门清理：查到时删除，或者随着不再被使用移到表尾后淘汰
+ */
+void UserCache::put(const std::string &name, bool exists, uint64_t verifier, int ttlS)
+{
+    Shard &s = this->shard(name);
+    auto expires = std::chrono::steady_clock::now() + std::chrono::seconds(ttlS);
+    std::lock_guard<std::mutex> locker(s.mtx);
+    auto it = s.index.find(name);
+    if (it != s.index.end())
+    {
+        it->second->exists = exists;
+        it->second->verifier = verifier;
+        it->second->expires = expires;
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        return;
+    }
+    if (s.lru.size() >= shardCapacity_)
+    {
+        s.index.erase(s.lru.back().name);
+        s.lru.pop_back();
+    }
+    s.lru.push_front(Entry{name, exists, verifier, expires});
+    s.index[name] = s.lru.begin();
+}
+
+/*
+ * 用户名所在的分片
+ */
+UserCache::Shard &UserCache::shard(const std::string &name)
+{
+    /* 布隆过滤器用同一个哈希的低位，分片取高位 */
+    return shards_[(this->digest(name, 1) >> 32) % SHARD_NUM_];
+}
+
+/*
+ * SipHash-2-4，keyIdx选择密钥
+ */
+uint64_t UserCache::digest(const std::string &data, int keyIdx) const
+{
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                 \
+    do                           \
+    {                            \
+        v0 += v1;                \
+        v1 = ROTL(v1, 13);       \
+        v1 ^= v0;                \
+        v0 = ROTL(v0, 32);       \
+        v2 += v3;                \
+        v3 = ROTL(v3, 16);       \
+        v3 ^= v2;                \
+        v0 += v3;                \
+        v3 = ROTL(v3, 21);       \
+        v3 ^= v0;                \
+        v2 += v1;                \
+        v1 = ROTL(v1, 17);       \
+        v1 ^= v2;                \
+        v2 = ROTL(v2, 32);       \
+    } while (0)
+
+    uint64_t k0 = key_[keyIdx][0];
+    uint64_t k1 = key_[keyIdx][1];
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data.data());
+    size_t len = data.size();
+    size_t end = len - len % 8;
+    for (size_t i = 0; i < end; i += 8)
+    {
+        uint64_t m = 0;
+        for (int j = 0; j < 8; j++)
+        {
+            m |= static_cast<uint64_t>(p[i + j]) << (8 * j);
+        }
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    uint64_t b = static_cast<uint64_t>(len) << 56;
+    for (size_t j = 0; j < len % 8; j++)
+    {
+        b |= static_cast<uint64_t>(p[end + j]) << (8 * j);
+    }
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+#undef SIPROUND
+#undef ROTL
+}
@@ -1,13 +1,24 @@
 #include <webserver.h>
 
+/* 被std::min、std::chrono按引用使用的常量需要类外定义 */
+const int Webserver::FD_RESERVED_;
+const int Webserver::DRAIN_TIMEOUT_MS_;
+const int Webserver::REPORT_INTERVAL_S_;
+const int Webserver::READ_RETRY_MS_;
+const int Webserver::RECLAIM_INTERVAL_MS_;
+const int Webserver::SESSION_SWEEP_S_;
+
 /*
  * 构造函数，初始化服务器各种配置
  */
 Webserver::Webserver(int port, int timeoutMs,
                      int sqlPort, const char *sqlUser, const char *sqlPwd, const char *dbName,
-                     int connPoolNum, int threadNum, bool openLog, Log::LOG_LEVEL logLevel, int logQueSize)
-    : port_(port), timeoutMs_(timeoutMs), isClose_(false),
-      timer_(new HeapTimer()), threadPool_(new ThreadPool(threadNum)), epoller_(new Epoller)
+                     int connPoolNum, int threadNum, bool openLog, Log::LOG_LEVEL logLevel, int logQueSize,
+                     int listenFd)
+    : port_(port), timeoutMs_(timeoutMs), listenFd_(-1), reserveFd_(-1), upgradeFd_(-1), stopFd_(-1), completeFd_(-1),
+      isClose_(false), isDraining_(false), stat_(nullptr), busyPollUs_(0), latency_{},
+      timer_(new HeapTimer()), throttle_(new HeapTimer()), threadPool_(new ThreadPool(threadNum)), epoller_(new Epoller),
+      completions_(MAX_FD_CNT_), isCompleteNotified_(false), batchTasks_(0), batches_(0)
 {
     /* 获取程序根目录 */
     srcDir_ = getcwd(nullptr, 256);
@@ -19,12 +30,48 @@ Webserver::Webserver(int port, int timeoutMs,
     HttpConn::srcDir_ = srcDir_;
     /*初始化数据库连接池*/
     SqlConnPool::instance()->init("localhost", sqlPort, sqlUser, sqlPwd, dbName, connPoolNum);
+    /* 保存数据库配置，开启异步数据库客户端时使用 */
+    sqlPort_ = sqlPort;
+    sqlUser_ = sqlUser;
+    sqlPwd_ = sqlPwd;
+    dbName_ = dbName;
 
     /* 初始化事件模式 ET */
     this->initEventMode();
 
-    /* 初始化listenfd */
-    if (this->initSocket() == false)
+    /* 连接上限取MAX_FD_CNT_与进程fd上限中较小者，超过水位后淘汰空闲长连接 */
+    struct rlimit rlim;
+    maxConn_ = static_cast<int>(MAX_FD_CNT_);
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY &&
+        rlim.rlim_cur < MAX_FD_CNT_ + FD_RESERVED_)
+    {
+        int limit = static_cast<int>(rlim.rlim_cur);
+        maxConn_ = std::max(limit - std::min(FD_RESERVED_, limit / 4), 1);
+    }
+    idleWatermark_ = maxConn_ * IDLE_WATERMARK_ / 100;
+
+    /* 预留一个文件描述符，fd耗尽(EMFILE)时释放它来接受连接并回复503 */
+    reserveFd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    /* 信号处理函数只能做异步信号安全的事，用eventfd唤醒主循环 */
+    stopFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stopFd_ < 0 || epoller_->addFd(stopFd_, EPOLLIN) == false)
+    {
+        isClose_ = true;
+    }
+    completeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (completeFd_ < 0 || epoller_->addFd(completeFd_, EPOLLIN) == false)
+    {
+        isClose_ = true;
+    }
+
+    /* 初始化listenfd，有旧进程在运行时直接接管它的监听socket */
+    if (this->initSocket(listenFd) == false)
+    {
+        isClose_ = true;
+    }
+    /* 监听热升级socket，等待下一个版本的进程来接管；多进程模式下监听socket归master所有 */
+    else if (listenFd < 0 && this->initUpgradeSocket() == false)
     {
         isClose_ = true;
     }
@@ -46,6 +93,7 @@ Webserver::Webserver(int port, int timeoutMs,
             LOG_INFO("Log level: %d", logLevel);
             LOG_INFO("srcDir: %s", srcDir_);
             LOG_INFO("SqlConnPool num: %d, ThreadPool num: %d", connPoolNum, threadNum);
+            LOG_INFO("Max conn: %d, idle evict watermark: %d", maxConn_, idleWatermark_);
         }
     }
 }
@@ -55,8 +103,26 @@ Webserver::Webserver(int port, int timeoutMs,
  */
 Webserver::~Webserver()
 {
-    close(listenFd_);
+    this->stopListen();
+    if (reserveFd_ >= 0)
+    {
+        close(reserveFd_);
+    }
+    if (stopFd_ >= 0)
+    {
+        close(stopFd_);
+    }
+    if (completeFd_ >= 0)
+    {
+        close(completeFd_);
+    }
     isClose_ = true;
+    if (sessionSnapshot_.empty() == false)
+    {
+        SessionStore::instance()->save(sessionSnapshot_);
+    }
+    sqlAsync_.reset();
+    HttpRequest::asyncVerify_ = false;
     free(srcDir_);
     SqlConnPool::instance()->closePool();
 }
@@ -71,16 +137,58 @@ void Webserver::start()
     {
         LOG_INFO("=================Server start!===================");
     }
+    getrusage(RUSAGE_SELF, &lastUsage_);
+    nextReport_ = std::chrono::steady_clock::now() + std::chrono::seconds(REPORT_INTERVAL_S_);
 
     /* 循环等待epoll时间 */
     while (isClose_ == false)
     {
         /* 从定时器取出最进要过期的文件描述符时间 */
+        timeMs = -1;
         if (timeoutMs_ > 0)
         {
             /* 获取最近超时时间，同时删除已经超时的连接 */
             timeMs = timer_->getNextTick();
         }
+        /* 限速到期的连接重新注册EPOLLOUT */
+        int throttleMs = throttle_->getNextTick();
+        if (throttleMs >= 0 && (timeMs < 0 || throttleMs < timeMs))
+        {
+            timeMs = throttleMs;
+        }
+        /* 异步数据库客户端的等待超时和重连 */
+        if (sqlAsync_)
+        {
+            int sqlMs = sqlAsync_->getNextTick();
+            if (sqlMs >= 0 && (timeMs < 0 || sqlMs < timeMs))
+            {
+                timeMs = sqlMs;
+            }
+        }
+        /* 排空阶段：连接全部结束或到达截止时间即退出，期间定期醒来检查 */
+        if (isDraining_)
+        {
+            if (HttpConn::userCount_ <= 0 || std::chrono::steady_clock::now() >= drainDeadline_)
+            {
+                LOG_INFO("drain finished, remaining clients: %d", (int)HttpConn::userCount_);
+                break;
+            }
+            timeMs = (timeMs < 0 || timeMs > 100) ? 100 : timeMs;
+        }
+        /* 内存超过软上限时收缩缓存和空闲缓冲区，超过硬上限时淘汰空闲连接 */
+        this->checkMemory();
+        /* 定期输出时延分位数和CPU消耗 */
+        if (std::chrono::steady_clock::now() >= nextReport_)
+        {
+            this->reportStats();
+        }
+        /* 定期清理过期会话，查询时过期的会话已经按无效处理，这里只回收内存 */
+        if (SessionStore::instance()->isOpen() && std::chrono::steady_clock::now() >= nextSweep_)
+        {
+            size_t expired = SessionStore::instance()->expire();
+            LOG_DEBUG("%zu sessions expired", expired);
+            nextSweep_ = std::chrono::steady_clock::now() + std::chrono::seconds(SESSION_SWEEP_S_);
+        }
         /* 等待产生事件返回 */
         int count = epoller_->wait(timeMs);
         for (int i = 0; i < count; i++)
@@ -94,11 +202,48 @@ void Webserver::start()
                 /* 如果是监听描述符，处理新连接 */
                 this->dealListen();
             }
+            else if (fd == upgradeFd_)
+            {
+                /* 新版本进程请求接管监听socket */
+                this->dealUpgrade();
+            }
+            else if (fd == completeFd_)
+            {
+                /* 工作线程处理完的连接 */
+                this->dealComplete();
+            }
+            else if (fd == stopFd_)
+            {
+                /* 收到退出信号，停止accept并排空存量连接 */
+                uint64_t val = 0;
+                ssize_t n = read(stopFd_, &val, sizeof(val));
+                (void)n;
+                LOG_INFO("stop signal received");
+                this->stopListen();
+                this->startDrain();
+            }
+            else if (sqlAsync_ && sqlAsync_->owns(fd))
+            {
+                /* 异步数据库连接可读写，继续执行其上的查询 */
+                sqlAsync_->onEvent(fd, events);
+            }
+            else if (users_.count(fd) == 0 || users_[fd].isClosed() || epoller_->getEventTag(i) != users_[fd].generation())
+            {
+                /* 本批中前面的事件(accept前淘汰空闲连接、开始排空)已经关闭了该连接，
+                 * 它排在后面的事件作废，不能再去调整已摘除的定时器或读写已关闭的fd；
+                 * 关闭后fd又被本批中的accept复用时，代数不一致，旧事件也不会落到新连接上 */
+                LOG_DEBUG("drop event for closed client[%d]", fd);
+            }
+            else if ((events & EPOLLERR) && !(events & (EPOLLHUP | EPOLLRDHUP)) && users_[fd].hasZeroCopyPending())
+            {
+                /* 零拷贝完成通知会触发EPOLLERR，交给写回调回收映射区并继续发送 */
+                LOG_DEBUG("EPOLLERR zerocopy completion %d", fd);
+                this->dealWrite(&users_[fd]);
+            }
             else if (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
             {
                 /* 如果是EPOLLHUP | EPOLLRDHUP | EPOLLERR其中之一，直接关闭连接 */
                 LOG_DEBUG("EPOLLHUP | EPOLLRDHUP | EPOLLERR %d", fd);
-                assert(users_.count(fd) > 0);
                 this->closeConn(&users_[fd]);
             }
             else if (events & EPOLLIN)
@@ -119,271 +264,1379 @@ void Webserver::start()
                 LOG_ERROR("Unexpect epoll events");
             }
         }
+        /* 本轮需要工作线程处理的连接一次性分批提交 */
+        this->flushPending();
     }
 }
 
 /*
- * 设置文件描述符非阻塞，成功返回旧的fcntl属性
+ * 设置运行统计输出位置，多进程模式下指向master分配的共享内存
+ * 多进程模式下日志改写本进程自己的文件，切换和清理不会动其它worker正在写的文件
  */
-int Webserver::setFdNonBlock(int fd)
+void Webserver::setStat(ServerStat *stat)
 {
-    assert(fd >= 0);
-    int oldFl = fcntl(fd, F_GETFL);
-    int newFl = oldFl | O_NONBLOCK;
-    fcntl(fd, F_SETFL, newFl);
-    LOG_DEBUG("fd : %d  setFdNonBlock", fd);
-    return oldFl;
+    stat_ = stat;
+    if (stat_ != nullptr)
+    {
+        stat_->pid = getpid();
+        Log::instance()->setPerProcess();
+    }
 }
 
 /*
- * 初始化套接字，成功返回true
+ * 设置零拷贝发送阈值，响应载荷不小于threshold字节时使用MSG_ZEROCOPY，0为关闭
  */
-bool Webserver::initSocket()
+void Webserver::setZeroCopy(size_t threshold)
 {
-    int ret = 0;
-    struct sockaddr_in addr;
+    HttpConn::zeroCopyThreshold_ = threshold;
+    LOG_INFO("ZeroCopy threshold: %zu", threshold);
+}
 
-    if (port_ > 65535 || port_ < 1024)
+/*
+ * 绑核：调用线程(事件循环)绑定到cpu，线程池工作线程轮流绑定到同一NUMA节点的各个核，
+ * 日志线程限定在该节点内。事件循环线程显式使用本地内存策略，工作线程绑核后
+ * 按默认策略首次访问即从本地节点分配，连接缓冲区不会再在节点之间迁移
+ */
+bool Webserver::setAffinity(int cpu)
+{
+    if (cpu < 0)
     {
-        LOG_ERROR("port %d is not access!!", port_);
-        return false;
+        return true;
     }
-    /* 绑定IP和Port */
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port_);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    std::vector<int> cpus = this->nodeCpus(cpu);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    bool res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    /* glibc没有封装set_mempolicy，直接系统调用 */
+    bool isLocalMem = syscall(SYS_set_mempolicy, MPOL_LOCAL_, nullptr, 0) == 0;
+    int memErrno = isLocalMem ? 0 : errno;
+    res = threadPool_->setAffinity(cpus) && isLocalMem && res;
+    Log::instance()->setAffinity(cpus);
+    LOG_INFO("bind cpu %d, node cpus: %zu, local mempolicy: %s, %s", cpu, cpus.size(),
+             isLocalMem ? "ok" : strerror(memErrno), res ? "success" : "failed");
+    return res;
+}
 
-    struct linger optLinger = {0};
-    optLinger.l_linger = 1;
-    optLinger.l_onoff = 1;
-    /* 创建流式套接字 */
-    listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenFd_ < 0)
-    {
-        LOG_ERROR("listenfd socket init failed !!");
-        return false;
-    }
-    /* 直到所有数据发送完成或超时再关闭 */
-    ret = setsockopt(listenFd_, SOL_SOCKET, SO_LINGER, &optLinger, sizeof(optLinger));
-    if (ret < 0)
-    {
-        close(listenFd_);
-        LOG_ERROR("setsockopt SO_LINGER failed");
-        return false;
-    }
-    /* 设置端口复用，无需等待2MSL，但是只有最后一个绑定该端口的才可以接收数据 */
-    int optVal = 1;
-    ret = setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, (void *)&optVal, sizeof(optVal));
-    if (ret < 0)
-    {
-        close(listenFd_);
-        LOG_ERROR("setsockopt SO_REUSEADDR failed");
-        return false;
-    }
-    /* 绑定IP和端口 */
-    ret = bind(listenFd_, (sockaddr *)&addr, sizeof(addr));
-    if (ret < 0)
+/*
+ * 读取sysfs，返回与cpu同一NUMA节点的所有核，读取失败时只返回cpu本身
+ * 节点编号可能不连续(如只有node0和node2)，逐个遍历目录中的nodeN
+ */
+std::vector<int> Webserver::nodeCpus(int cpu)
+{
+    std::vector<int> cpus;
+    char path[128] = {0};
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *entry = nullptr;
+    while (dir != nullptr && cpus.empty() && (entry = readdir(dir)) != nullptr)
     {
-        close(listenFd_);
-        LOG_ERROR("bind failed");
-        return false;
+        int node = 0;
+        char tail = 0;
+        if (sscanf(entry->d_name, "node%d%c", &node, &tail) != 1)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *fp = fopen(path, "r");
+        if (fp == nullptr)
+        {
+            continue;
+        }
+        /* cpulist格式：0-7,16-23 */
+        std::vector<int> list;
+        int lo = 0;
+        int hi = 0;
+        char sep = 0;
+        while (fscanf(fp, "%d", &lo) == 1)
+        {
+            hi = lo;
+            sep = static_cast<char>(fgetc(fp));
+            if (sep == '-' && fscanf(fp, "%d", &hi) == 1)
+            {
+                sep = static_cast<char>(fgetc(fp));
+            }
+            for (int i = lo; i <= hi; i++)
+            {
+                list.push_back(i);
+            }
+            if (sep != ',')
+            {
+                break;
+            }
+        }
+        fclose(fp);
+        if (std::find(list.begin(), list.end(), cpu) != list.end())
+        {
+            cpus = list;
+        }
     }
-    /* 监听 */
-    ret = listen(listenFd_, 6);
-    if (ret < 0)
+    if (dir != nullptr)
     {
-        close(listenFd_);
-        LOG_ERROR("listen failed");
-        return false;
+        closedir(dir);
     }
-    /* 将监听描述符加入epoll等待事件 */
-    bool res = epoller_->addFd(listenFd_, listenEvent_ | EPOLLIN);
-    if (res == false)
+    if (cpus.empty())
     {
-        close(listenFd_);
-        LOG_ERROR("add epoll fd failed");
-        return false;
+        cpus.push_back(cpu);
     }
-    /* 设置文件描述符非阻塞 */
-    this->setFdNonBlock(listenFd_);
-    LOG_INFO("lisnten fd init success !! port : %d", port_);
-    return true;
+    return cpus;
 }
 
 /*
- * 设置epoll ET边沿触发模式
+ * 设置小文件缓存容量(字节)，缓存命中的GET请求在主线程直接处理，0为关闭
  */
-void Webserver::initEventMode()
+void Webserver::setFileCache(size_t capacity)
 {
-    listenEvent_ = EPOLLHUP;
-    /*EPOLLONESHOT，为了保证当前连接在同一时刻只被一个线程处理*/
-    connEvent_ = EPOLLONESHOT | EPOLLRDHUP;
+    FileCache::instance()->init(capacity);
+    LOG_INFO("FileCache capacity: %zu", capacity);
+}
 
-    connEvent_ |= EPOLLET;
-    listenEvent_ |= EPOLLET;
+/*
+ * 设置每个连接每轮最多发送的字节数，超过后让出工作线程重新排队，0为不限
+ */
+void Webserver::setWriteQuantum(size_t bytes)
+{
+    HttpConn::writeQuantum_ = bytes;
+    LOG_INFO("Write quantum: %zu", bytes);
 }
 
 /*
- * 向std::unordered_map<int, HttpConn> users_添加一个新连接成员
+ * 设置单个连接读缓冲上限(同时是请求报文的最大长度)和所有连接读缓冲合计的上限
  */
-void Webserver::addClient(int fd, sockaddr_in addr)
+void Webserver::setReadLimit(size_t highWater, size_t budget)
 {
-    assert(fd > 0);
-    users_[fd].init(fd, addr);
-    if (timeoutMs_ > 0)
+    HttpConn::readHighWater_ = highWater;
+    HttpConn::readBudget_ = budget;
+    LOG_INFO("Read high water: %zu, budget: %zu", highWater, budget);
+}
+
+/*
+ * 设置内存软上限和硬上限(字节)，都为0时按所在cgroup的内存上限取比例，没有cgroup限制则不限
+ */
+void Webserver::setMemoryLimit(size_t softLimit, size_t hardLimit)
+{
+    if (softLimit == 0 && hardLimit == 0)
     {
-        timer_->add(fd, timeoutMs_, std::bind(&Webserver::closeConn, this, &users_[fd]));
+        size_t limit = MemoryGovernor::cgroupLimit();
+        softLimit = limit / 100 * MEM_SOFT_PERCENT_;
+        hardLimit = limit / 100 * MEM_HARD_PERCENT_;
     }
-    /* 将新文件描述符添加到epoll树上 */
-    epoller_->addFd(fd, EPOLLIN | connEvent_);
-    this->setFdNonBlock(fd);
-
-    LOG_DEBUG("add client fd : %d, ip : %s, port : %d", users_[fd].getFd(), users_[fd].getIP(), users_[fd].getPort());
+    MemoryGovernor::instance()->init(softLimit, hardLimit);
+    LOG_INFO("Memory soft limit: %zu, hard limit: %zu", softLimit, hardLimit);
 }
 
 /*
- * 处理新连接，加入std::unordered_map<int, HttpConn> users_;
+ * 设置日志格式化方式，延迟格式化和二进制模式需要异步日志(日志队列容量大于0)
  */
-void Webserver::dealListen()
+void Webserver::setLogMode(Log::LOG_MODE mode)
 {
-    struct sockaddr_in addr;
-    socklen_t sockLen = sizeof(addr);
-    do
-    {
-        int fd = accept(listenFd_, (sockaddr *)&addr, &sockLen);
-        if (fd < 0)
-        {
-            break;
-        }
-        else if (HttpConn::userCount_ >= static_cast<int>(MAX_FD_CNT_))
-        {
-            this->sendError(fd, "Server busy");
-            LOG_WARN("Clients is full!");
-            return;
-        }
-        this->addClient(fd, addr);
-    } while (listenEvent_ & EPOLLET);
+    Log::instance()->setMode(mode);
+    LOG_INFO("Log mode: %d, deferred: %d", (int)mode, (int)Log::instance()->isDeferred());
 }
 
 /*
- * 处理写事件
+ * 设置日志切换和保留策略，切换、压缩和清理都在日志的维护线程中进行
  */
-void Webserver::dealWrite(HttpConn *client)
+void Webserver::setLogRotate(size_t maxBytes, int periodS, int maxFiles, int maxDays, bool compress)
 {
-    assert(client);
-    this->extentTime(client);
-    threadPool_->addTask(std::bind(&Webserver::onWrite, this, client));
+    Log::instance()->setRotate(maxBytes, periodS);
+    Log::instance()->setRetention(maxFiles, maxDays, compress);
+    LOG_INFO("Log rotate: %zu bytes, %d s, keep %d files, %d days, compress: %d", maxBytes, periodS, maxFiles, maxDays, (int)compress);
 }
 
 /*
- * 处理读事件
+ * 设置每个日志调用点每秒最多输出的条数，超出的合并为一条汇总，0为不限
  */
-void Webserver::dealRead(HttpConn *client)
+void Webserver::setLogRateLimit(int perSecond)
 {
-    assert(client);
-    this->extentTime(client);
-    threadPool_->addTask(std::bind(&Webserver::onRead, this, client));
+    Log::instance()->setRateLimit(perSecond);
+    LOG_INFO("Log rate limit: %d per call site per second", perSecond);
 }
 
 /*
- * 发送错误信息
+ * 开启用户验证缓存，capacity为0时关闭
+ * expectedUsers不为0时从数据库加载全部用户名建立布隆过滤器，注册时跳过对新用户名的查询
  */
-void Webserver::sendError(int fd, const char *info)
+void Webserver::setUserCache(size_t capacity, int ttlS, int negativeTtlS, size_t expectedUsers)
 {
-    assert(fd > 0);
-    int ret = send(fd, info, strlen(info), 0);
-    if (ret < 0)
+    UserCache *cache = UserCache::instance();
+    cache->init(capacity, ttlS, negativeTtlS, expectedUsers);
+    if (capacity > 0 && expectedUsers > 0)
     {
-        LOG_WARN("send error to client[%d]", fd);
+        MYSQL *sql = nullptr;
+        SqlConnRAII sqlConn(&sql, SqlConnPool::instance());
+        cache->loadNames(sql);
     }
-    close(fd);
+    LOG_INFO("UserCache capacity: %zu, ttl: %d s, negative ttl: %d s", capacity, ttlS, negativeTtlS);
 }
 
 /*
- * 对应连接有新动作，更新连接超时时间
+ * 开启会话，capacity为0时关闭；snapshotPath非空时启动时加载快照、退出时写入
+ * 会话表在进程内，多进程模式下一个worker建立的会话在其它worker上无效，不开启会话
+ * 需要在setStat之后调用
  */
-void Webserver::extentTime(HttpConn *client)
+void Webserver::setSessions(size_t capacity, int ttlS, const char *snapshotPath)
 {
-    assert(client);
-    if (timeoutMs_ > 0)
+    if (stat_ != nullptr && capacity > 0)
     {
-        timer_->adjust(client->getFd(), timeoutMs_);
+        LOG_WARN("Sessions are disabled in multi-process mode");
+        return;
+    }
+    SessionStore *store = SessionStore::instance();
+    store->init(capacity, ttlS);
+    nextSweep_ = std::chrono::steady_clock::now() + std::chrono::seconds(SESSION_SWEEP_S_);
+    if (store->isOpen() && snapshotPath != nullptr && *snapshotPath != '\0')
+    {
+        sessionSnapshot_ = snapshotPath;
+        store->load(sessionSnapshot_);
     }
+    LOG_INFO("Sessions capacity: %zu, ttl: %d s", capacity, ttlS);
 }
 
 /*
- * 关闭一个http连接
+ * 设置数据库连接池的最少、最多连接数和取连接的超时(毫秒)
+ * isThreadAffine为true时每个工作线程独占一个连接，共享池只应付嵌套取用和超出的部分，
+ * 最多连接数应不少于工作线程数
  */
-void Webserver::closeConn(HttpConn *client)
+void Webserver::setSqlPool(size_t minConn, size_t maxConn, int acquireTimeoutMs, bool isThreadAffine)
 {
-    assert(client);
-    LOG_INFO("client[%d] quit", client->getFd());
-    /* 关闭前先从epoll树上将文件描述符摘掉 */
-    epoller_->delFd(client->getFd());
-    client->close();
+    SqlConnPool::instance()->setLimits(minConn, maxConn, acquireTimeoutMs);
+    SqlConnPool::instance()->setThreadAffine(isThreadAffine);
+    if (isThreadAffine && maxConn < threadPool_->size())
+    {
+        LOG_WARN("SqlConnPool max %zu < %zu workers, some workers share the pool", maxConn, threadPool_->size());
+    }
+    LOG_INFO("SqlConnPool min: %zu, max: %zu, acquire timeout: %d ms, thread affine: %d",
+             minConn, maxConn, acquireTimeoutMs, isThreadAffine);
 }
 
 /*
- * 读事件线程池回调，从http连接中取出数据
+ * 开启异步数据库客户端，登录注册在主线程中用connNum个非阻塞连接完成，工作线程不再阻塞等待数据库
+ * 客户端库不支持非阻塞接口时保持阻塞连接池
  */
-void Webserver::onRead(HttpConn *client)
+void Webserver::setAsyncSql(int connNum)
 {
-    assert(client);
-    int readErrno = 0;
-
-    ssize_t ret = client->read(&readErrno);
-    /* 非阻塞模式下会返回EAGAIN，如果不是EAGAIN说明有问题 */
-    if (ret <= 0 && readErrno != EAGAIN)
+    if (connNum <= 0)
     {
-        this->closeConn(client);
         return;
     }
-    this->onProcess(client);
+    if (SqlAsync::isSupported() == false)
+    {
+        LOG_WARN("Async sql is not supported by the client library, using blocking pool");
+        return;
+    }
+    sqlAsync_.reset(new SqlAsync(epoller_.get()));
+    if (sqlAsync_->init("localhost", sqlPort_, sqlUser_.data(), sqlPwd_.data(), dbName_.data(), connNum) == false)
+    {
+        LOG_ERROR("Async sql init error, using blocking pool");
+        sqlAsync_.reset();
+        return;
+    }
+    HttpRequest::asyncVerify_ = true;
+    LOG_INFO("Async sql connections: %d", connNum);
 }
 
 /*
- * 写事件线程池回调函数，向http发送数据
+ * 开启访问日志，ringPath和textPath都为空时不开启
+ * 多进程模式下每个worker一个环形缓冲，文件名后加上统计槽位序号，
+ * 重启和重载拉起的worker复用槽位的文件，正常退出时删除
  */
-void Webserver::onWrite(HttpConn *client)
+void Webserver::setAccessLog(const char *ringPath, const char *textPath, size_t capacity, double sampleRate, double errorSampleRate)
 {
-    assert(client);
-    int writeErrno = 0;
-
-    ssize_t ret = client->write(&writeErrno);
-    /* 如果数据已经写完了，但链接是长连接，则重新调用onProcess，会把文件描述符重新设置为EPOLLIN */
-    if (client->toWriteBytes() == 0)
+    bool hasRing = ringPath != nullptr && *ringPath != '\0';
+    bool hasText = textPath != nullptr && *textPath != '\0';
+    if (hasRing == false && hasText == false)
     {
-        if (client->isKeepAlive())
-        {
-            this->onProcess(client);
-            return;
-        }
+        return;
+    }
+    std::string ring = hasRing ? ringPath : "";
+    if (hasRing && stat_ != nullptr)
+    {
+        ring += "." + std::to_string(stat_->slot);
     }
-    else if (ret < 0)
+    if (AccessLog::instance()->init(ring.data(), textPath, capacity, sampleRate, errorSampleRate))
     {
-        if (writeErrno == EAGAIN)
+        if (hasRing && stat_ != nullptr)
         {
-            /* 说明写缓冲区满了，需要重新设置读事件，放回epoll树 */
-            epoller_->modFd(client->getFd(), connEvent_ | EPOLLOUT);
-            return;
+            AccessLog::instance()->unlinkOnExit();
         }
+        LOG_INFO("Access log: ring %s, text %s, capacity %zu, sample %.3f, error sample %.3f",
+                 hasRing ? ring.data() : "(anonymous)", hasText ? textPath : "(none)", capacity, sampleRate, errorSampleRate);
+    }
+    else
+    {
+        LOG_ERROR("Access log init failed: ring %s, text %s, errno %d", ring.data(), hasText ? textPath : "", errno);
     }
-    LOG_DEBUG("ret == %d, error == %d", ret, writeErrno);
-    /* 其他意外情况，关闭连接 */
-    this->closeConn(client);
 }
 
-/* 解析http报文 */
-void Webserver::onProcess(HttpConn *client)
+/*
+ * 检查内存压力并回收，每隔RECLAIM_INTERVAL_MS_最多执行一次
+ * 软上限：先淘汰文件缓存，再释放空闲连接缓冲区多余的空间，读取由HttpConn::read暂停
+ * 硬上限：再按LRU淘汰空闲长连接，新连接在dealListen中回复503
+ */
+void Webserver::checkMemory()
 {
-    if (client->process())
+    MemoryGovernor *governor = MemoryGovernor::instance();
+    MemoryGovernor::PRESSURE pressure = governor->pressure();
+    if (pressure == MemoryGovernor::PRESSURE_NONE)
     {
-        /* 成功处理http请求，则设置文件描述符写事件，准备写响应 */
-        epoller_->modFd(client->getFd(), connEvent_ | EPOLLOUT);
+        return;
     }
-    else
+    auto now = std::chrono::steady_clock::now();
+    if (now < nextReclaim_)
     {
-        /* 解析http请求失败，重新注册文件描述符为读，继续读取socket */
-        epoller_->modFd(client->getFd(), connEvent_ | EPOLLIN);
+        return;
+    }
+    nextReclaim_ = now + std::chrono::milliseconds(RECLAIM_INTERVAL_MS_);
+
+    size_t before = governor->total();
+    size_t target = governor->softLimit() > 0 ? governor->softLimit() : governor->hardLimit();
+    if (before > target)
+    {
+        FileCache::instance()->shrink(before - target);
+    }
+    for (int fd : idleList_)
+    {
+        users_[fd].shrinkBuffers();
+    }
+    if (pressure == MemoryGovernor::PRESSURE_HARD)
+    {
+        while (governor->pressure() == MemoryGovernor::PRESSURE_HARD && this->evictIdle())
+        {
+        }
+    }
+    size_t after = governor->total();
+    if (after < before)
+    {
+        LOG_WARN("memory pressure %d, reclaimed %zu bytes, %s", (int)pressure, before - after, governor->report().data());
     }
 }
+
+/*
+ * 按路径前缀设置发送权重(每轮配额的倍数)和限速(字节/秒，0为不限)
+ */
+void Webserver::addWritePolicy(const std::string &prefix, int weight, size_t rate)
+{
+    HttpConn::addWritePolicy(prefix, weight, rate);
+    LOG_INFO("Write policy: %s, weight: %d, rate: %zu", prefix.data(), weight, rate);
+}
+
+/*
+ * 低时延模式：事件循环阻塞前最多忙等spinUs微秒，窗口随事件到达间隔自适应，
+ * 同时为连接socket设置SO_BUSY_POLL/SO_PREFER_BUSY_POLL，0为关闭
+ */
+void Webserver::setBusyPoll(int spinUs)
+{
+    busyPollUs_ = spinUs > 0 ? spinUs : 0;
+    epoller_->setBusyPoll(busyPollUs_);
+    LOG_INFO("Busy poll: %d us", busyPollUs_);
+}
+
+/*
+ * 记录一次请求的处理时延
+ */
+void Webserver::recordLatency(int64_t us)
+{
+    if (us < 0)
+    {
+        return;
+    }
+    int i = 0;
+    while (i < 31 && (us >> (i + 1)) > 0)
+    {
+        i++;
+    }
+    latency_[i].fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * 输出上一个统计周期内的请求时延p50/p99、CPU消耗和忙等统计，输出后清零直方图
+ */
+void Webserver::reportStats()
+{
+    nextReport_ = std::chrono::steady_clock::now() + std::chrono::seconds(REPORT_INTERVAL_S_);
+    uint64_t hist[32];
+    uint64_t total = 0;
+    for (int i = 0; i < 32; i++)
+    {
+        hist[i] = latency_[i].exchange(0, std::memory_order_relaxed);
+        total += hist[i];
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long cpuMs = (usage.ru_utime.tv_sec - lastUsage_.ru_utime.tv_sec) * 1000 +
+                 (usage.ru_utime.tv_usec - lastUsage_.ru_utime.tv_usec) / 1000 +
+                 (usage.ru_stime.tv_sec - lastUsage_.ru_stime.tv_sec) * 1000 +
+                 (usage.ru_stime.tv_usec - lastUsage_.ru_stime.tv_usec) / 1000;
+    lastUsage_ = usage;
+    LOG_INFO("memory: %s", MemoryGovernor::instance()->report().data());
+    if (AccessLog::instance()->lost() > 0)
+    {
+        LOG_WARN("access log: %lu records overwritten before written to file", (unsigned long)AccessLog::instance()->lost());
+    }
+    if (total == 0)
+    {
+        return;
+    }
+
+    /* 分位数取所在桶的上界 */
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    uint64_t count = 0;
+    for (int i = 0; i < 32; i++)
+    {
+        count += hist[i];
+        if (p50 == 0 && count * 100 >= total * 50)
+        {
+            p50 = 2ULL << i;
+        }
+        if (p99 == 0 && count * 100 >= total * 99)
+        {
+            p99 = 2ULL << i;
+        }
+    }
+    uint64_t spinUs = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    epoller_->getSpinStat(spinUs, hits, misses);
+    LOG_INFO("requests: %lu, latency p50 <= %lu us, p99 <= %lu us, cpu: %ld ms / %d s, spin: %lu ms, hit: %lu, miss: %lu",
+             total, p50, p99, cpuMs, REPORT_INTERVAL_S_, spinUs / 1000, hits, misses);
+    LOG_INFO("dispatch: %lu conns in %lu batches, read buffered: %zu bytes, shed batches: %lu",
+             batchTasks_, batches_, HttpConn::readUsage_.load(), threadPool_->shedCount());
+    LOG_INFO("sql pool: %s", SqlConnPool::instance()->report().data());
+    if (SessionStore::instance()->isOpen())
+    {
+        LOG_INFO("sessions: %zu", SessionStore::instance()->size());
+    }
+    if (UserCache::instance()->isOpen())
+    {
+        LOG_INFO("user cache: hit %lu, miss %lu", UserCache::instance()->hits(), UserCache::instance()->misses());
+    }
+    batchTasks_ = 0;
+    batches_ = 0;
+}
+
+/*
+ * 设置文件描述符非阻塞，成功返回旧的fcntl属性
+ */
+int Webserver::setFdNonBlock(int fd)
+{
+    assert(fd >= 0);
+    int oldFl = fcntl(fd, F_GETFL);
+    int newFl = oldFl | O_NONBLOCK;
+    fcntl(fd, F_SETFL, newFl);
+    LOG_DEBUG("fd : %d  setFdNonBlock", fd);
+    return oldFl;
+}
+
+/*
+ * 创建、绑定并监听TCP套接字，成功返回fd，失败返回-1
+ * 多进程模式下由master调用，worker继承同一个监听socket
+ * incomingCpu不为-1时开启SO_REUSEPORT并设置SO_INCOMING_CPU，
+ * 内核优先把在该核上收包的连接分给这个监听socket
+ */
+int Webserver::listenSocket(int port, int incomingCpu)
+{
+    int ret = 0;
+    int fd = -1;
+    struct sockaddr_in addr;
+
+    if (port > 65535 || port < 1024)
+    {
+        LOG_ERROR("port %d is not access!!", port);
+        return -1;
+    }
+    /* 绑定IP和Port */
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    struct linger optLinger = {0};
+    optLinger.l_linger = 1;
+    optLinger.l_onoff = 1;
+    /* 创建流式套接字 */
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        LOG_ERROR("listenfd socket init failed !!");
+        return -1;
+    }
+    /* 直到所有数据发送完成或超时再关闭 */
+    ret = setsockopt(fd, SOL_SOCKET, SO_LINGER, &optLinger, sizeof(optLinger));
+    if (ret < 0)
+    {
+        close(fd);
+        LOG_ERROR("setsockopt SO_LINGER failed");
+        return -1;
+    }
+    /* 设置端口复用，无需等待2MSL，但是只有最后一个绑定该端口的才可以接收数据 */
+    int optVal = 1;
+    ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&optVal, sizeof(optVal));
+    if (ret < 0)
+    {
+        close(fd);
+        LOG_ERROR("setsockopt SO_REUSEADDR failed");
+        return -1;
+    }
+    if (incomingCpu >= 0)
+    {
+        ret = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&optVal, sizeof(optVal));
+        if (ret == 0)
+        {
+            ret = setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, (void *)&incomingCpu, sizeof(incomingCpu));
+        }
+        if (ret < 0)
+        {
+            close(fd);
+            LOG_ERROR("setsockopt SO_REUSEPORT/SO_INCOMING_CPU failed");
+            return -1;
+        }
+    }
+    /* 绑定IP和端口 */
+    ret = bind(fd, (sockaddr *)&addr, sizeof(addr));
+    if (ret < 0)
+    {
+        close(fd);
+        LOG_ERROR("bind failed");
+        return -1;
+    }
+    /* 监听 */
+    ret = listen(fd, 6);
+    if (ret < 0)
+    {
+        close(fd);
+        LOG_ERROR("listen failed");
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * 初始化套接字，成功返回true
+ * 监听socket来源依次为：master传入、热升级时旧进程交接、自己bind
+ */
+bool Webserver::initSocket(int listenFd)
+{
+    uint32_t events = listenEvent_ | EPOLLIN;
+    if (listenFd >= 0)
+    {
+        /* 多个worker共享同一个监听socket，EPOLLEXCLUSIVE避免惊群 */
+        listenFd_ = listenFd;
+        events |= EPOLLEXCLUSIVE;
+    }
+    else
+    {
+        /* 热升级：旧进程交过来的监听socket已经bind/listen，直接注册到epoll */
+        listenFd_ = this->inheritListenFd();
+        if (listenFd_ >= 0)
+        {
+            LOG_INFO("inherit listen fd %d from old process", listenFd_);
+        }
+        else
+        {
+            listenFd_ = this->listenSocket(port_);
+        }
+    }
+    if (listenFd_ < 0)
+    {
+        return false;
+    }
+    /* 将监听描述符加入epoll等待事件 */
+    bool res = epoller_->addFd(listenFd_, events);
+    if (res == false)
+    {
+        this->stopListen();
+        LOG_ERROR("add epoll fd failed");
+        return false;
+    }
+    /* 设置文件描述符非阻塞 */
+    this->setFdNonBlock(listenFd_);
+    LOG_INFO("lisnten fd init success !! port : %d", port_);
+    return true;
+}
+
+/*
+ * 热升级socket地址，使用抽象命名空间，进程退出后自动释放，不会残留文件
+ */
+static socklen_t upgradeAddr(int port, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "WebServer.upgrade.%d", port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/*
+ * 连接旧进程的热升级socket，通过SCM_RIGHTS取得监听fd
+ * 没有旧进程返回-1，按正常流程bind
+ */
+int Webserver::inheritListenFd()
+{
+    struct sockaddr_un addr;
+    socklen_t addrLen = upgradeAddr(port_, &addr);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    if (connect(sock, (sockaddr *)&addr, addrLen) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    /* 旧进程卡住时不要一直等 */
+    struct timeval tv = {5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char tag = 0;
+    struct iovec iov = {&tag, 1};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int fd = -1;
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) > 0)
+    {
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (cm != nullptr && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+        }
+    }
+    /* 旧进程先关闭自己的热升级socket再断开连接，读到EOF后才能bind同一个地址 */
+    while (fd >= 0 && read(sock, &tag, 1) > 0)
+    {
+    }
+    close(sock);
+    return fd;
+}
+
+/*
+ * 监听热升级socket
+ */
+bool Webserver::initUpgradeSocket()
+{
+    struct sockaddr_un addr;
+    socklen_t addrLen = upgradeAddr(port_, &addr);
+    upgradeFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (upgradeFd_ < 0)
+    {
+        LOG_ERROR("upgrade socket init failed !!");
+        return false;
+    }
+    if (bind(upgradeFd_, (sockaddr *)&addr, addrLen) < 0 || listen(upgradeFd_, 1) < 0 ||
+        epoller_->addFd(upgradeFd_, EPOLLIN) == false)
+    {
+        close(upgradeFd_);
+        upgradeFd_ = -1;
+        LOG_ERROR("upgrade socket bind failed");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 新进程连上热升级socket，把监听fd交给它，随后停止accept并排空存量连接
+ */
+void Webserver::dealUpgrade()
+{
+    int conn = accept4(upgradeFd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0)
+    {
+        return;
+    }
+    char tag = 'L';
+    struct iovec iov = {&tag, 1};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &listenFd_, sizeof(int));
+
+    if (listenFd_ < 0 || sendmsg(conn, &msg, MSG_NOSIGNAL) < 0)
+    {
+        LOG_ERROR("hand over listen fd failed");
+        close(conn);
+        return;
+    }
+    LOG_INFO("listen fd handed over to new process");
+    /* 先释放热升级地址再断开，新进程读到EOF后绑定同一地址 */
+    epoller_->delFd(upgradeFd_);
+    close(upgradeFd_);
+    upgradeFd_ = -1;
+    close(conn);
+
+    this->stopListen();
+    this->startDrain();
+}
+
+/*
+ * 停止accept：从epoll摘下并关闭本进程持有的监听socket和热升级socket
+ * 监听socket已交给新进程时，内核中的socket和其中排队的连接由新进程继续处理
+ */
+void Webserver::stopListen()
+{
+    if (listenFd_ >= 0)
+    {
+        epoller_->delFd(listenFd_);
+        close(listenFd_);
+        listenFd_ = -1;
+    }
+    if (upgradeFd_ >= 0)
+    {
+        epoller_->delFd(upgradeFd_);
+        close(upgradeFd_);
+        upgradeFd_ = -1;
+    }
+}
+
+/*
+ * 进入排空阶段：关闭空闲长连接，正在处理的请求完成后不再保持连接
+ */
+void Webserver::startDrain()
+{
+    if (isDraining_)
+    {
+        return;
+    }
+    isDraining_ = true;
+    drainDeadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(DRAIN_TIMEOUT_MS_);
+    while (this->evictIdle())
+    {
+    }
+    LOG_INFO("start draining, clients: %d", (int)HttpConn::userCount_);
+}
+
+/*
+ * 请求优雅退出，异步信号安全，可以在信号处理函数中调用
+ */
+void Webserver::stop()
+{
+    uint64_t val = 1;
+    if (stopFd_ < 0 || write(stopFd_, &val, sizeof(val)) < 0)
+    {
+        isClose_ = true;
+    }
+}
+
+/*
+ * 设置epoll ET边沿触发模式
+ */
+void Webserver::initEventMode()
+{
+    listenEvent_ = EPOLLHUP;
+    /*EPOLLONESHOT，为了保证当前连接在同一时刻只被一个线程处理*/
+    connEvent_ = EPOLLONESHOT | EPOLLRDHUP;
+
+    connEvent_ |= EPOLLET;
+    listenEvent_ |= EPOLLET;
+}
+
+/*
+ * 向std::unordered_map<int, HttpConn> users_添加一个新连接成员
+ */
+void Webserver::addClient(int fd, sockaddr_in addr)
+{
+    assert(fd > 0);
+    users_[fd].init(fd, addr);
+    if (timeoutMs_ > 0)
+    {
+        timer_->add(fd, timeoutMs_, std::bind(&Webserver::onTimeout, this, &users_[fd], users_[fd].generation()));
+    }
+    /* 低时延模式：读socket时在驱动队列上忙等，失败(缺少CAP_NET_ADMIN等)不影响正常服务 */
+    if (busyPollUs_ > 0)
+    {
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busyPollUs_, sizeof(busyPollUs_)) < 0)
+        {
+            LOG_DEBUG("setsockopt SO_BUSY_POLL failed, errno %d", errno);
+        }
+#ifdef SO_PREFER_BUSY_POLL
+        int prefer = 1;
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+    }
+    /* 将新文件描述符添加到epoll树上 */
+    epoller_->addFd(fd, EPOLLIN | connEvent_, users_[fd].generation());
+    this->setFdNonBlock(fd);
+    if (stat_ != nullptr)
+    {
+        stat_->accepted++;
+        stat_->connections = HttpConn::userCount_.load();
+    }
+
+    LOG_DEBUG("add client fd : %d, ip : %s, port : %d", users_[fd].getFd(), users_[fd].getIP(), users_[fd].getPort());
+}
+
+/*
+ * 处理新连接，加入std::unordered_map<int, HttpConn> users_;
+ */
+void Webserver::dealListen()
+{
+    struct sockaddr_in addr;
+    socklen_t sockLen = sizeof(addr);
+    do
+    {
+        /* fd压力超过水位，先淘汰最久未活动的空闲长连接，给活跃客户端腾位置 */
+        while (HttpConn::userCount_ >= idleWatermark_ && this->evictIdle())
+        {
+        }
+        int fd = accept(listenFd_, (sockaddr *)&addr, &sockLen);
+        if (fd < 0)
+        {
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                /* 能淘汰空闲连接就继续accept，否则只能回复503 */
+                if (this->evictIdle())
+                {
+                    continue;
+                }
+                this->dealFdExhausted();
+            }
+            break;
+        }
+        else if (HttpConn::userCount_ >= maxConn_)
+        {
+            this->sendError(fd, "Server busy");
+            LOG_WARN("Clients is full!");
+            continue;
+        }
+        else if (threadPool_->isOverload())
+        {
+            /* 线程池排队时间持续超标，尽早拒绝新连接，保住已有请求的时延 */
+            this->sendError(fd, "Server overloaded");
+            LOG_WARN("ThreadPool overload, shed client");
+            continue;
+        }
+        else if (MemoryGovernor::instance()->pressure() == MemoryGovernor::PRESSURE_HARD)
+        {
+            /* 超过内存硬上限，新连接的缓冲区也分配不起 */
+            this->sendError(fd, "Server memory pressure");
+            LOG_WARN("Memory over hard limit, shed client");
+            continue;
+        }
+        this->addClient(fd, addr);
+    } while (listenEvent_ & EPOLLET);
+}
+
+/*
+ * 进程fd耗尽时释放预留fd，接受等待中的连接回复503后关闭，再重新占住预留fd
+ * 否则ET模式下监听socket上的连接永远取不走
+ */
+void Webserver::dealFdExhausted()
+{
+    LOG_WARN("accept: fd exhausted");
+    if (reserveFd_ < 0)
+    {
+        return;
+    }
+    close(reserveFd_);
+    /* ET模式需要把监听队列取空，每次关闭后腾出的fd刚好给下一次accept用 */
+    int fd = -1;
+    while ((fd = accept(listenFd_, nullptr, nullptr)) >= 0)
+    {
+        this->sendError(fd, "Server busy");
+    }
+    reserveFd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * 处理写事件
+ */
+void Webserver::dealWrite(HttpConn *client)
+{
+    assert(client);
+    this->extentTime(client);
+    /* 载荷在内存中的响应直接续写，mmap的文件可能触发缺页读盘，交给工作线程 */
+    if (client->isCachedResponse())
+    {
+        CONN_ACTION action = this->doWrite(client);
+        if (action == ACTION_PROCESS)
+        {
+            this->dispatch(client);
+            return;
+        }
+        this->applyAction(client, action);
+        return;
+    }
+    this->submit(client, ACTION_WRITE);
+}
+
+/*
+ * 处理读事件
+ */
+void Webserver::dealRead(HttpConn *client)
+{
+    assert(client);
+    this->unmarkIdle(client->getFd());
+    this->extentTime(client);
+    client->startTiming();
+    /* 非阻塞读只是内存拷贝，在主线程完成，读到的请求再决定由谁处理 */
+    int readErrno = 0;
+    ssize_t ret = client->read(&readErrno);
+    /* 非阻塞模式下会返回EAGAIN，如果不是EAGAIN说明有问题 */
+    if (ret <= 0 && readErrno != EAGAIN)
+    {
+        this->closeConn(client);
+        return;
+    }
+    this->dispatch(client);
+}
+
+/*
+ * 向无法接纳的连接回复 503 Service Unavailable 并关闭
+ */
+void Webserver::sendError(int fd, const char *info)
+{
+    assert(fd > 0);
+    char resp[256] = {0};
+    int len = snprintf(resp, sizeof(resp),
+                       "HTTP/1.1 503 Service Unavailable\r\n"
+                       "Retry-After: %d\r\n"
+                       "Connection: close\r\n"
+                       "Content-type: text/plain\r\n"
+                       "Content-length: %zu\r\n\r\n%s",
+                       RETRY_AFTER_S_, strlen(info), info);
+    int ret = send(fd, resp, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0)
+    {
+        LOG_WARN("send error to client[%d]", fd);
+    }
+    if (stat_ != nullptr)
+    {
+        stat_->shed++;
+    }
+    /* 连接继承了监听socket的SO_LINGER，关闭掉避免close阻塞主线程 */
+    struct linger optLinger = {0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &optLinger, sizeof(optLinger));
+    close(fd);
+}
+
+/*
+ * 对应连接有新动作，更新连接超时时间
+ */
+void Webserver::extentTime(HttpConn *client)
+{
+    assert(client);
+    if (timeoutMs_ > 0)
+    {
+        timer_->adjust(client->getFd(), timeoutMs_);
+    }
+}
+
+/*
+ * 关闭一个http连接
+ */
+void Webserver::closeConn(HttpConn *client)
+{
+    assert(client);
+    /* 工作线程还在使用连接，等完成队列交回后再关闭，避免工作线程读写被复用的fd */
+    if (client->isBusy())
+    {
+        client->setClosing();
+        return;
+    }
+    LOG_INFO("client[%d] quit", client->getFd());
+    /* 每条关闭路径都在这里摘除定时器，超时触发时节点已经出堆，cancel不做任何事 */
+    timer_->cancel(client->getFd());
+    throttle_->cancel(client->getFd());
+    this->unmarkIdle(client->getFd());
+    /* 关闭前先从epoll树上将文件描述符摘掉 */
+    epoller_->delFd(client->getFd());
+    client->close();
+    if (stat_ != nullptr)
+    {
+        stat_->connections = HttpConn::userCount_.load();
+    }
+}
+
+/*
+ * 定时器回调，句柄代数不一致说明连接已经关闭并被新连接复用，忽略
+ */
+void Webserver::onTimeout(HttpConn *client, uint32_t gen)
+{
+    assert(client);
+    if (client->generation() != gen)
+    {
+        LOG_DEBUG("stale timer for client[%d]", client->getFd());
+        return;
+    }
+    this->closeConn(client);
+}
+
+/*
+ * 限速或暂停读等待结束，重新注册EPOLLOUT继续发送或EPOLLIN继续读取
+ */
+void Webserver::onThrottle(HttpConn *client, uint32_t gen)
+{
+    assert(client);
+    if (client->generation() != gen || client->isBusy())
+    {
+        return;
+    }
+    epoller_->modFd(client->getFd(), connEvent_ | (client->toWriteBytes() > 0 ? EPOLLOUT : EPOLLIN), client->generation());
+}
+
+/*
+ * 主线程：连接交给工作线程处理，置busy后在本轮事件处理完时分批提交
+ */
+void Webserver::submit(HttpConn *client, CONN_ACTION action)
+{
+    client->setBusy(true);
+    pending_.push_back({client, client->generation(), action});
+}
+
+/*
+ * 线程池回调，依次处理一批连接，结果一次性交回主线程
+ */
+void Webserver::onBatch(std::vector<ConnAction> &batch)
+{
+    for (auto &item : batch)
+    {
+        assert(item.client);
+        CONN_ACTION action = item.action == ACTION_WRITE ? this->doWrite(item.client) : ACTION_PROCESS;
+        /* 长连接中剩余的请求在工作线程里接着处理 */
+        while (action == ACTION_PROCESS)
+        {
+            action = this->doProcess(item.client);
+        }
+        item.action = action;
+    }
+    this->postActions(batch);
+}
+
+/*
+ * 工作线程：线程池过载且这批连接排队过久，新请求直接回复503，续写照常进行
+ */
+void Webserver::onShed(std::vector<ConnAction> &batch)
+{
+    for (auto &item : batch)
+    {
+        assert(item.client);
+        if (item.action != ACTION_WRITE)
+        {
+            item.client->reject(503, "Server overloaded");
+        }
+        item.action = this->doWrite(item.client);
+    }
+    this->postActions(batch);
+}
+
+/*
+ * 向http连接发送数据，返回连接的下一步动作
+ */
+Webserver::CONN_ACTION Webserver::doWrite(HttpConn *client)
+{
+    assert(client);
+    int writeErrno = 0;
+
+    ssize_t ret = client->write(&writeErrno);
+    /* 如果数据已经写完了，但链接是长连接，则继续处理读缓冲中的请求，最终重新注册EPOLLIN */
+    if (client->toWriteBytes() == 0)
+    {
+        int64_t latencyUs = client->stopTiming();
+        this->recordLatency(latencyUs);
+        if (latencyUs >= 0)
+        {
+            client->logAccess(latencyUs);
+        }
+        /* 排空阶段不再保持连接 */
+        if (client->isKeepAlive() && !isDraining_)
+        {
+            return ACTION_PROCESS;
+        }
+    }
+    else if (client->throttleMs() > 0)
+    {
+        /* 令牌不足，等待一段时间后再发 */
+        return ACTION_THROTTLE;
+    }
+    else if (ret > 0 || writeErrno == EAGAIN)
+    {
+        /* 本轮配额用完或者写缓冲区满了，重新注册EPOLLOUT，排到其他就绪连接之后 */
+        return ACTION_WRITE;
+    }
+    LOG_DEBUG("ret == %d, error == %d", ret, writeErrno);
+    /* 其他意外情况，关闭连接 */
+    return ACTION_CLOSE;
+}
+
+/*
+ * 解析http报文，解析成功立即尝试发送响应，返回连接的下一步动作
+ */
+Webserver::CONN_ACTION Webserver::doProcess(HttpConn *client)
+{
+    if (client->process() == false)
+    {
+        /* 请求需要验证用户，交回主线程发起异步查询 */
+        if (client->isQueryPending())
+        {
+            return ACTION_QUERY;
+        }
+        /* 请求不完整或已处理完，重新注册文件描述符为读，继续读取socket */
+        return ACTION_READ;
+    }
+    if (stat_ != nullptr)
+    {
+        stat_->requests++;
+    }
+    /* socket通常可写，直接发送，省去一次EPOLLOUT往返 */
+    return this->doWrite(client);
+}
+
+/*
+ * 主线程：缓存命中的GET请求直接处理，其余交给线程池，读缓冲为空时直接重新注册读
+ */
+void Webserver::dispatch(HttpConn *client)
+{
+    CONN_ACTION action = ACTION_PROCESS;
+    while (action == ACTION_PROCESS)
+    {
+        if (client->toReadBytes() > 0 && client->isCacheHit() == false)
+        {
+            this->submit(client, ACTION_PROCESS);
+            return;
+        }
+        action = this->doProcess(client);
+    }
+    this->applyAction(client, action);
+}
+
+/*
+ * 主线程：执行连接的下一步动作
+ */
+void Webserver::applyAction(HttpConn *client, CONN_ACTION action)
+{
+    switch (action)
+    {
+    case ACTION_READ:
+        /* 长连接上一个请求已经处理完，进入空闲LRU */
+        if (client->isIdle())
+        {
+            if (isDraining_)
+            {
+                this->closeConn(client);
+                return;
+            }
+            this->markIdle(client->getFd());
+        }
+        /* 接收预算用完时不立即注册EPOLLIN，否则socket里剩余的数据会让它马上再次触发 */
+        if (client->isReadPaused())
+        {
+            throttle_->add(client->getFd(), READ_RETRY_MS_,
+                           std::bind(&Webserver::onThrottle, this, client, client->generation()));
+            break;
+        }
+        epoller_->modFd(client->getFd(), connEvent_ | EPOLLIN, client->generation());
+        break;
+    case ACTION_WRITE:
+        epoller_->modFd(client->getFd(), connEvent_ | EPOLLOUT, client->generation());
+        break;
+    case ACTION_PROCESS:
+        this->dispatch(client);
+        break;
+    case ACTION_THROTTLE:
+        throttle_->add(client->getFd(), client->throttleMs(),
+                       std::bind(&Webserver::onThrottle, this, client, client->generation()));
+        break;
+    case ACTION_QUERY:
+        this->startQuery(client);
+        break;
+    default:
+        this->closeConn(client);
+        break;
+    }
+}
+
+/*
+ * 主线程：向异步数据库客户端提交用户验证，等待期间连接不注册任何事件，只受超时定时器约束
+ */
+void Webserver::startQuery(HttpConn *client)
+{
+    assert(sqlAsync_);
+    std::string name, pwd;
+    bool isLogin = false;
+    client->getQuery(name, pwd, isLogin);
+    uint32_t gen = client->generation();
+    auto start = std::chrono::steady_clock::now();
+    HttpRequest::userVerifyAsync(sqlAsync_.get(), name, pwd, isLogin,
+                                 [this, client, gen, start](bool isVerified)
+                                 {
+                                     int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                                      std::chrono::steady_clock::now() - start)
+                                                      .count();
+                                     this->onQueryDone(client, gen, isVerified, us);
+                                 });
+}
+
+/*
+ * 主线程：验证结果到达，生成响应并直接发送，连接期间已关闭时丢弃
+ */
+void Webserver::onQueryDone(HttpConn *client, uint32_t gen, bool isVerified, int64_t upstreamUs)
+{
+    if (client->generation() != gen)
+    {
+        LOG_DEBUG("stale query result for client[%d]", client->getFd());
+        return;
+    }
+    client->resumeQuery(isVerified, upstreamUs);
+    if (stat_ != nullptr)
+    {
+        stat_->requests++;
+    }
+    CONN_ACTION action = this->doWrite(client);
+    if (action == ACTION_PROCESS)
+    {
+        this->dispatch(client);
+        return;
+    }
+    this->applyAction(client, action);
+}
+
+/*
+ * 工作线程：把一批处理结果放入完成队列，队列由空变非空时唤醒主循环
+ */
+void Webserver::postActions(std::vector<ConnAction> &done)
+{
+    /* 每个连接同时最多一个结果在途，队列按连接上限分配，不会阻塞 */
+    completions_.push_n(done.data(), done.size());
+    if (isCompleteNotified_.exchange(true, std::memory_order_acq_rel) == false)
+    {
+        uint64_t val = 1;
+        ssize_t n = write(completeFd_, &val, sizeof(val));
+        (void)n;
+    }
+}
+
+/*
+ * 主线程：取出完成队列中的全部结果并执行
+ * 先清eventfd和通知标志再取队列，取队列之后放入的结果会重新唤醒
+ */
+void Webserver::dealComplete()
+{
+    uint64_t val = 0;
+    ssize_t n = read(completeFd_, &val, sizeof(val));
+    (void)n;
+    isCompleteNotified_.exchange(false, std::memory_order_acq_rel);
+    ConnAction done[COMPLETE_BATCH_];
+    size_t count = 0;
+    while ((count = completions_.pop_n(done, COMPLETE_BATCH_)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            ConnAction &item = done[i];
+            if (item.client->generation() != item.gen)
+            {
+                LOG_WARN("stale completion for client[%d]", item.client->getFd());
+                continue;
+            }
+            item.client->setBusy(false);
+            /* 处理期间超时或被淘汰，现在可以安全关闭 */
+            this->applyAction(item.client, item.client->isClosing() ? ACTION_CLOSE : item.action);
+        }
+    }
+}
+
+/*
+ * 主线程：把本轮待处理的连接切成若干批，一次加锁全部入队
+ * 可能阻塞的连接(同步查询数据库的登录注册)单独成批，不让同批的其它连接排在它后面；
+ * 其余连接按空闲线程数拆分，空闲线程不足时每批至少BATCH_MIN_个，避免零星事件也唤醒所有线程
+ */
+void Webserver::flushPending()
+{
+    if (pending_.empty())
+    {
+        return;
+    }
+    size_t total = pending_.size();
+    std::vector<std::vector<ConnAction>> batches;
+    std::vector<ConnAction> rest;
+    rest.reserve(total);
+    for (auto &item : pending_)
+    {
+        if (item.action == ACTION_PROCESS && item.client->mayBlock())
+        {
+            batches.push_back(std::vector<ConnAction>(1, item));
+        }
+        else
+        {
+            rest.push_back(item);
+        }
+    }
+    pending_.clear();
+    if (rest.empty() == false)
+    {
+        size_t batchNum = std::max((rest.size() + BATCH_MIN_ - 1) / BATCH_MIN_,
+                                   std::min(threadPool_->idleCount(), rest.size()));
+        batchNum = std::max(std::min(batchNum, threadPool_->size()), static_cast<size_t>(1));
+        auto it = rest.begin();
+        for (size_t i = 0; i < batchNum; i++)
+        {
+            /* 余数分给前几批 */
+            size_t len = rest.size() / batchNum + (i < rest.size() % batchNum ? 1 : 0);
+            batches.push_back(std::vector<ConnAction>(it, it + len));
+            it += len;
+        }
+    }
+    std::vector<std::function<void()>> tasks;
+    std::vector<std::function<void()>> sheds;
+    tasks.reserve(batches.size());
+    sheds.reserve(batches.size());
+    for (auto &batch : batches)
+    {
+        sheds.push_back(std::bind(&Webserver::onShed, this, batch));
+        tasks.push_back(std::bind(&Webserver::onBatch, this, std::move(batch)));
+    }
+    batchTasks_ += total;
+    batches_ += batches.size();
+    threadPool_->addTasks(tasks, sheds);
+}
+
+/*
+ * 将连接加入空闲LRU链表尾部
+ */
+void Webserver::markIdle(int fd)
+{
+    if (idleRef_.count(fd) == 0)
+    {
+        idleRef_[fd] = idleList_.insert(idleList_.end(), fd);
+    }
+}
+
+/*
+ * 连接有新动作或关闭，从空闲LRU链表中移除
+ */
+void Webserver::unmarkIdle(int fd)
+{
+    auto it = idleRef_.find(fd);
+    if (it != idleRef_.end())
+    {
+        idleList_.erase(it->second);
+        idleRef_.erase(it);
+    }
+}
+
+/*
+ * 关闭最久未活动的空闲长连接，没有可淘汰的连接返回false
+ * 空闲连接只在epoll上等待EPOLLIN，没有工作线程持有，主线程可以直接关闭；
+ * 在处理一批事件的中途调用时，该连接排在本批后面的事件由主循环丢弃
+ */
+bool Webserver::evictIdle()
+{
+    if (idleList_.empty())
+    {
+        return false;
+    }
+    int fd = idleList_.front();
+    LOG_INFO("evict idle client[%d], userCount: %d", fd, (int)HttpConn::userCount_);
+    this->closeConn(&users_[fd]);
+    return true;
+}
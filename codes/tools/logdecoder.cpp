@@ -0,0 +1,117 @@
+#include <logrecord.h>
+
+#include <cstdio>
+#include <unordered_map>
+
+/*
+ * 二进制日志解码工具，将Log::MODE_BINARY写出的.blog文件转换为文本输出到标准输出
+ * 用法：LogDecoder 2022_09_17.blog [...]
+ */
+
+/*
+ * 读入整个文件
+ */
+static bool readFile(const char *path, std::string &data)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == nullptr)
+    {
+        return false;
+    }
+    char buff[65536];
+    size_t n = 0;
+    while ((n = fread(buff, 1, sizeof(buff), fp)) > 0)
+    {
+        data.append(buff, n);
+    }
+    fclose(fp);
+    return true;
+}
+
+/*
+ * 解码一个文件，格式串和时钟校准只在本文件内有效
+ */
+static bool decode(const char *path)
+{
+    std::string data;
+    if (readFile(path, data) == false)
+    {
+        fprintf(stderr, "%s: open failed\n", path);
+        return false;
+    }
+    if (data.size() < sizeof(LogRecord::MAGIC_) || memcmp(data.data(), LogRecord::MAGIC_, sizeof(LogRecord::MAGIC_)) != 0)
+    {
+        fprintf(stderr, "%s: not a binary log\n", path);
+        return false;
+    }
+
+    std::unordered_map<uint64_t, std::string> formats;
+    LogClock clock;
+    size_t p = sizeof(LogRecord::MAGIC_);
+    while (p + LogRecord::HEADER_LEN_ <= data.size())
+    {
+        const char *record = data.data() + p;
+        LogRecord::Header header = LogRecord::getHeader(record);
+        if (header.len < LogRecord::HEADER_LEN_ || p + header.len > data.size())
+        {
+            fprintf(stderr, "%s: truncated record at offset %zu\n", path, p);
+            return false;
+        }
+        const char *body = record + LogRecord::HEADER_LEN_;
+        size_t bodyLen = header.len - LogRecord::HEADER_LEN_;
+        p += header.len;
+
+        if (header.type == LogRecord::TYPE_TEXT)
+        {
+            fwrite(body, 1, bodyLen, stdout);
+        }
+        else if (header.type == LogRecord::TYPE_FORMAT && bodyLen >= 8)
+        {
+            uint64_t id = 0;
+            memcpy(&id, body, 8);
+            formats[id].assign(body + 8, bodyLen - 8);
+        }
+        else if (header.type == LogRecord::TYPE_SYNC && bodyLen >= 24)
+        {
+            uint64_t tick = 0;
+            int64_t ns = 0;
+            double rate = 0;
+            memcpy(&tick, body, 8);
+            memcpy(&ns, body + 8, 8);
+            memcpy(&rate, body + 16, 8);
+            clock.set(tick, ns, rate);
+        }
+        else if (header.type == LogRecord::TYPE_LOG && header.len >= LogRecord::LOG_HEADER_LEN_)
+        {
+            uint64_t tick = 0;
+            uint64_t id = 0;
+            memcpy(&tick, body, 8);
+            memcpy(&id, body + 8, 8);
+            auto it = formats.find(id);
+            const char *format = it == formats.end() ? "(unknown format)" : it->second.data();
+            char prefix[64];
+            LogRecord::formatTime(clock.toNs(tick), prefix, sizeof(prefix));
+            std::string msg = LogRecord::format(format, record + LogRecord::LOG_HEADER_LEN_, record + header.len, header.argc);
+            printf("%s%s%s\n", prefix, LogRecord::levelTitle(header.level), msg.data());
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s file.blog [...]\n", argv[0]);
+        return 1;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (decode(argv[i]) == false)
+        {
+            ret = 1;
+        }
+    }
+    return ret;
+}